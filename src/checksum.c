@@ -0,0 +1,179 @@
+#include "checksum.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// Reflected CRC32C polynomial
+#define CRC32C_POLY     0x82F63B78u
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_table_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t prev = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+        }
+    }
+}
+
+// Eight bytes per step, one table lookup for each
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* buf, size_t len) {
+    pthread_once(&crc32c_table_once, crc32c_table_init);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len >= sizeof(uint64_t); buf += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xFF] ^ crc32c_table[6][(word >> 8) & 0xFF] ^
+              crc32c_table[5][(word >> 16) & 0xFF] ^ crc32c_table[4][(word >> 24) & 0xFF] ^
+              crc32c_table[3][(word >> 32) & 0xFF] ^ crc32c_table[2][(word >> 40) & 0xFF] ^
+              crc32c_table[1][(word >> 48) & 0xFF] ^ crc32c_table[0][word >> 56];
+    }
+#endif
+    for (; len > 0; buf++, len--) {
+        crc = crc32c_table[0][(crc ^ *buf) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* buf, size_t len) {
+    uint64_t crc64 = crc;
+    for (; len >= sizeof(uint64_t); buf += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; len > 0; buf++, len--) {
+        crc = _mm_crc32_u8(crc, *buf);
+    }
+    return crc;
+}
+
+static bool crc32c_hw_available(void) {
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* buf, size_t len) {
+    for (; len >= sizeof(uint64_t); buf += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; len > 0; buf++, len--) {
+        crc = __crc32cb(crc, *buf);
+    }
+    return crc;
+}
+
+static bool crc32c_hw_available(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+uint32_t checksum_crc32c(uint32_t crc, const uint8_t* buf, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__) || defined(__aarch64__)
+    if (crc32c_hw_available()) {
+        return ~crc32c_hw(crc, buf, len);
+    }
+#endif
+    return ~crc32c_sw(crc, buf, len);
+}
+
+#define XXH_PRIME64_1   0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2   0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3   0x165667B19E3779F9ULL
+#define XXH_PRIME64_4   0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5   0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t checksum_hash64(const uint8_t* buf, size_t len, uint64_t seed) {
+    const uint8_t* end = buf + len;
+    uint64_t h;
+    if (len >= 32) {
+        // Four independent lanes, so consecutive multiplies overlap in the pipeline
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        for (; end - buf >= 32; buf += 32) {
+            v1 = xxh64_round(v1, read64(buf));
+            v2 = xxh64_round(v2, read64(buf + 8));
+            v3 = xxh64_round(v3, read64(buf + 16));
+            v4 = xxh64_round(v4, read64(buf + 24));
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += len;
+
+    for (; end - buf >= 8; buf += 8) {
+        h ^= xxh64_round(0, read64(buf));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (end - buf >= 4) {
+        uint32_t v;
+        memcpy(&v, buf, sizeof(v));
+        h ^= (uint64_t)v * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        buf += 4;
+    }
+    for (; buf < end; buf++) {
+        h ^= (uint64_t)*buf * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
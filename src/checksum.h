@@ -0,0 +1,25 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Integrity checks for data in flight and at rest. Every data packet carries a CRC32C of its
+// header and payload, and each partition is summarised by a digest built from a 64-bit hash of
+// every packet, which the daemon returns in its FIN for the client to compare with its own.
+
+// CRC32C (Castagnoli) of len bytes, continuing from crc. Start from 0. Uses the SSE4.2 or ARMv8
+// CRC instructions when the CPU has them, and a table otherwise.
+uint32_t checksum_crc32c(uint32_t crc, const uint8_t* buf, size_t len);
+
+// XXH64 of len bytes
+uint64_t checksum_hash64(const uint8_t* buf, size_t len, uint64_t seed);
+
+// What a packet whose data starts at file_offset adds to its partition's digest. Digests are
+// sums of these, so packets can be counted in whatever order they are read or written, but
+// each must be counted exactly once. This guards against corruption, not tampering.
+static inline uint64_t checksum_packet_digest(uint64_t file_offset, const uint8_t* buf, size_t len) {
+    return checksum_hash64(buf, len, file_offset);
+}
+
+#endif // CHECKSUM_H
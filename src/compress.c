@@ -0,0 +1,207 @@
+#include "compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Each sequence starts with a token: the literal count in its high nibble and the match length
+// less COMPRESS_MIN_MATCH in its low one. A nibble of 15 is continued in bytes of up to 255.
+// The literals follow, then a little-endian 16-bit distance back to the match and the rest of
+// its length. The last sequence of a packet has literals only.
+#define COMPRESS_NIBBLE_MAX     15
+#define COMPRESS_MAX_DISTANCE   0xFFFF
+
+compressor_t* compressor_init(void) {
+    compressor_t* compressor = (compressor_t*) calloc(1, sizeof(compressor_t));
+    if (!compressor) {
+        perror("calloc");
+        return NULL;
+    }
+    // The table starts out zeroed, which is below base and so already stale
+    compressor->base = 1;
+    compressor->backoff = 1;
+    return compressor;
+}
+
+void compressor_destroy(compressor_t* compressor) {
+    free(compressor);
+}
+
+static inline uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+}
+
+static bool put_length(uint8_t* dst, size_t cap, size_t* op, size_t n) {
+    for (; n >= 255; n -= 255) {
+        if (*op >= cap) {
+            return false;
+        }
+        dst[(*op)++] = 255;
+    }
+    if (*op >= cap) {
+        return false;
+    }
+    dst[(*op)++] = (uint8_t)n;
+    return true;
+}
+
+// Append a sequence. match_len is 0 for the last one, which has no match.
+static bool put_sequence(uint8_t* dst, size_t cap, size_t* op, const uint8_t* literals, size_t lit_len,
+                         size_t distance, size_t match_len) {
+    size_t match_code = match_len ? match_len - COMPRESS_MIN_MATCH : 0;
+    if (*op >= cap) {
+        return false;
+    }
+    uint8_t lit_nibble = lit_len < COMPRESS_NIBBLE_MAX ? lit_len : COMPRESS_NIBBLE_MAX;
+    uint8_t match_nibble = match_code < COMPRESS_NIBBLE_MAX ? match_code : COMPRESS_NIBBLE_MAX;
+    dst[(*op)++] = (uint8_t)(lit_nibble << 4 | match_nibble);
+    if (lit_nibble == COMPRESS_NIBBLE_MAX && !put_length(dst, cap, op, lit_len - COMPRESS_NIBBLE_MAX)) {
+        return false;
+    }
+    if (*op + lit_len > cap) {
+        return false;
+    }
+    memcpy(dst + *op, literals, lit_len);
+    *op += lit_len;
+    if (match_len == 0) {
+        return true;
+    }
+
+    if (*op + 2 > cap) {
+        return false;
+    }
+    dst[(*op)++] = distance & 0xFF;
+    dst[(*op)++] = (distance >> 8) & 0xFF;
+    if (match_nibble == COMPRESS_NIBBLE_MAX && !put_length(dst, cap, op, match_code - COMPRESS_NIBBLE_MAX)) {
+        return false;
+    }
+    return true;
+}
+
+// Returns the compressed length, or 0 as soon as the output would not fit in cap
+static size_t compress_block(compressor_t* compressor, const uint8_t* src, size_t len, uint8_t* dst, size_t cap) {
+    uint32_t base = compressor->base;
+    size_t op = 0;
+    size_t anchor = 0;
+    size_t ip = 0;
+    bool fits = true;
+
+    while (fits && ip + COMPRESS_MIN_MATCH <= len) {
+        uint32_t v = read32(src + ip);
+        uint32_t h = hash32(v);
+        uint32_t ref = compressor->table[h];
+        compressor->table[h] = base + (uint32_t)ip;
+
+        size_t candidate = (size_t)(ref - base);
+        if (ref < base || candidate >= ip || ip - candidate > COMPRESS_MAX_DISTANCE || read32(src + candidate) != v) {
+            // Step further the longer nothing has matched, so that data that will not compress is
+            // given up on quickly
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        size_t match_len = COMPRESS_MIN_MATCH;
+        while (ip + match_len < len && src[candidate + match_len] == src[ip + match_len]) {
+            match_len++;
+        }
+        fits = put_sequence(dst, cap, &op, src + anchor, ip - anchor, ip - candidate, match_len);
+        ip += match_len;
+        anchor = ip;
+    }
+    if (fits) {
+        fits = put_sequence(dst, cap, &op, src + anchor, len - anchor, 0, 0);
+    }
+
+    // Move base past every position this packet used, starting over before it wraps
+    if (compressor->base > UINT32_MAX - 2 * UDP_PACKET_DATA_SIZE) {
+        memset(compressor->table, 0, sizeof(compressor->table));
+        compressor->base = 1;
+    } else {
+        compressor->base += (uint32_t)len;
+    }
+    return fits ? op : 0;
+}
+
+size_t compressor_compress(compressor_t* compressor, const uint8_t* src, size_t len, uint8_t* dst) {
+    compressor->bytes_in += len;
+    size_t out_len = 0;
+    if (compressor->bypass > 0) {
+        compressor->bypass--;
+    } else {
+        out_len = compress_block(compressor, src, len, dst, len - len / COMPRESS_MIN_SAVING);
+        if (out_len == 0) {
+            compressor->bypass = compressor->backoff;
+            compressor->backoff = compressor->backoff * 2 < COMPRESS_MAX_BYPASS ? compressor->backoff * 2 : COMPRESS_MAX_BYPASS;
+        } else {
+            compressor->backoff = 1;
+        }
+    }
+
+    if (out_len == 0) {
+        compressor->packets_raw++;
+        compressor->bytes_out += len;
+    } else {
+        compressor->bytes_out += out_len;
+    }
+    return out_len;
+}
+
+static bool get_length(const uint8_t* src, size_t len, size_t* ip, size_t* n) {
+    uint8_t byte;
+    do {
+        if (*ip >= len) {
+            return false;
+        }
+        byte = src[(*ip)++];
+        *n += byte;
+    } while (byte == 255);
+    return true;
+}
+
+size_t compress_expand(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_len) {
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+        size_t lit_len = token >> 4;
+        if (lit_len == COMPRESS_NIBBLE_MAX && !get_length(src, len, &ip, &lit_len)) {
+            return 0;
+        }
+        if (lit_len > len - ip || lit_len > dst_len - op) {
+            return 0;
+        }
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == len) {
+            break;
+        }
+
+        if (len - ip < 2) {
+            return 0;
+        }
+        size_t distance = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        size_t match_len = token & 0x0F;
+        if (match_len == COMPRESS_NIBBLE_MAX && !get_length(src, len, &ip, &match_len)) {
+            return 0;
+        }
+        match_len += COMPRESS_MIN_MATCH;
+        if (distance == 0 || distance > op || match_len > dst_len - op) {
+            return 0;
+        }
+        // Byte by byte, since a match may overlap the bytes it is producing
+        const uint8_t* match = dst + op - distance;
+        for (size_t i = 0; i < match_len; i++) {
+            dst[op + i] = match[i];
+        }
+        op += match_len;
+    }
+    return op;
+}
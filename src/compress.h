@@ -0,0 +1,49 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "defines.h"
+
+// Per-packet compression in the style of an LZ4 block: runs of literals, each followed by a
+// copy of earlier bytes of the same packet. Packets are compressed on their own so that any
+// one of them can be lost, resent or decoded out of order.
+
+// Bytes hashed to find a match, and the shortest match worth encoding
+#define COMPRESS_MIN_MATCH      4
+// log2 of the number of entries in the match finder's hash table
+#define COMPRESS_HASH_BITS      12
+// A packet is only sent compressed if it shrinks by at least 1 / COMPRESS_MIN_SAVING
+#define COMPRESS_MIN_SAVING     8
+// Most packets sent as they are, without trying, after repeated failures to compress
+#define COMPRESS_MAX_BYPASS     64
+
+typedef struct __compressor_t {
+    // Positions of recent 4-byte sequences, offset by base so that entries left by earlier
+    // packets are told apart without clearing the table
+    uint32_t table[1 << COMPRESS_HASH_BITS];
+    uint32_t base;
+    uint32_t bypass;                // packets still to send without trying
+    uint32_t backoff;               // packets to bypass after the next failure
+    uint64_t bytes_in;              // payload bytes offered
+    uint64_t bytes_out;             // payload bytes sent, compressed or not
+    uint64_t packets_raw;           // packets sent as they were
+} compressor_t;
+
+compressor_t* compressor_init(void);
+
+void compressor_destroy(compressor_t* compressor);
+
+// Compress len bytes of src into dst, which holds UDP_PACKET_DATA_SIZE bytes. Returns the
+// compressed length, or 0 if the packet should go as it is: it did not shrink enough, or
+// recent packets did not and this one is skipped. Each failure doubles how many packets
+// are skipped after it, so incompressible data costs little more than the check.
+size_t compressor_compress(compressor_t* compressor, const uint8_t* src, size_t len, uint8_t* dst);
+
+// Expand len bytes of src into dst, which holds dst_len bytes. Returns the expanded length,
+// or 0 if src is malformed or does not fit.
+size_t compress_expand(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_len);
+
+#endif // COMPRESS_H
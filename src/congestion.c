@@ -0,0 +1,169 @@
+#include "congestion.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "defines.h"
+
+// Never let an idle period build up more than this many packets of credit
+#define CONGESTION_MAX_BURST    (2 * UDP_BATCH_SIZE)
+
+static const congestion_ops_t* congestion_algorithms[] = {
+    &congestion_bbr_ops,
+    &congestion_none_ops,
+};
+
+uint64_t congestion_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+congestion_t* congestion_init(const char* name) {
+    const congestion_ops_t* ops = NULL;
+    for (size_t i = 0; i < sizeof(congestion_algorithms) / sizeof(congestion_algorithms[0]); i++) {
+        if (strcmp(congestion_algorithms[i]->name, name) == 0) {
+            ops = congestion_algorithms[i];
+        }
+    }
+    if (!ops) {
+        fprintf(stderr, "Unknown congestion control algorithm: %s\n", name);
+        return NULL;
+    }
+
+    congestion_t* cc = (congestion_t*) calloc(1, sizeof(congestion_t));
+    if (!cc) {
+        perror("calloc");
+        return NULL;
+    }
+    pthread_mutex_init(&cc->lock, NULL);
+    cc->ops = ops;
+    cc->last_refill_us = congestion_now_us();
+    // Stateless algorithms have no init
+    cc->state = ops->init ? ops->init(cc->last_refill_us) : NULL;
+    if (ops->init && !cc->state) {
+        pthread_mutex_destroy(&cc->lock);
+        free(cc);
+        return NULL;
+    }
+    return cc;
+}
+
+void congestion_destroy(congestion_t* cc) {
+    if (cc) {
+        cc->ops->destroy(cc->state);
+        pthread_mutex_destroy(&cc->lock);
+        free(cc);
+    }
+}
+
+uint32_t congestion_allowance(congestion_t* cc, uint32_t max, uint64_t* wait_us) {
+    uint32_t allowed = max;
+    *wait_us = 0;
+
+    pthread_mutex_lock(&cc->lock);
+    double rate = cc->ops->pacing_rate(cc->state);
+    if (rate > 0) {
+        // Refill the bucket for the time since the last call
+        uint64_t now = congestion_now_us();
+        cc->tokens += rate * (double)(now - cc->last_refill_us) / 1e6;
+        cc->last_refill_us = now;
+        if (cc->tokens > CONGESTION_MAX_BURST) {
+            cc->tokens = CONGESTION_MAX_BURST;
+        }
+
+        if (cc->tokens < 1) {
+            allowed = 0;
+            *wait_us = (uint64_t)((1 - cc->tokens) * 1e6 / rate) + 1;
+        } else if (cc->tokens < max) {
+            allowed = (uint32_t)cc->tokens;
+        }
+    }
+    pthread_mutex_unlock(&cc->lock);
+    return allowed;
+}
+
+uint32_t congestion_window_available(congestion_t* cc) {
+    pthread_mutex_lock(&cc->lock);
+    uint32_t cwnd = cc->ops->cwnd(cc->state);
+    uint32_t available = UINT32_MAX;
+    if (cwnd > 0) {
+        available = cwnd > cc->in_flight ? cwnd - cc->in_flight : 0;
+    }
+    pthread_mutex_unlock(&cc->lock);
+    return available;
+}
+
+void congestion_on_sent(congestion_t* cc, uint32_t packets, uint32_t new_packets) {
+    pthread_mutex_lock(&cc->lock);
+    // Threads racing on the same allowance may overdraw the bucket; the debt delays the next send
+    cc->tokens -= packets;
+    cc->in_flight += new_packets;
+    pthread_mutex_unlock(&cc->lock);
+}
+
+void congestion_on_ack(congestion_t* cc, uint32_t packets, uint64_t rtt_us) {
+    pthread_mutex_lock(&cc->lock);
+    cc->in_flight = cc->in_flight > packets ? cc->in_flight - packets : 0;
+    cc->ops->on_ack(cc->state, packets, rtt_us, congestion_now_us());
+    pthread_mutex_unlock(&cc->lock);
+}
+
+void congestion_on_loss(congestion_t* cc, uint32_t packets) {
+    pthread_mutex_lock(&cc->lock);
+    cc->ops->on_loss(cc->state, packets, congestion_now_us());
+    pthread_mutex_unlock(&cc->lock);
+}
+
+void congestion_on_abandon(congestion_t* cc, uint32_t packets) {
+    pthread_mutex_lock(&cc->lock);
+    cc->in_flight = cc->in_flight > packets ? cc->in_flight - packets : 0;
+    pthread_mutex_unlock(&cc->lock);
+}
+
+double congestion_pacing_rate(congestion_t* cc) {
+    pthread_mutex_lock(&cc->lock);
+    double rate = cc->ops->pacing_rate(cc->state);
+    pthread_mutex_unlock(&cc->lock);
+    return rate;
+}
+
+// No congestion control: send as fast as the sockets allow
+static void none_destroy(void* state) {
+    (void)state;
+}
+
+static void none_on_ack(void* state, uint32_t packets, uint64_t rtt_us, uint64_t now_us) {
+    (void)state;
+    (void)packets;
+    (void)rtt_us;
+    (void)now_us;
+}
+
+static void none_on_loss(void* state, uint32_t packets, uint64_t now_us) {
+    (void)state;
+    (void)packets;
+    (void)now_us;
+}
+
+static double none_pacing_rate(void* state) {
+    (void)state;
+    return 0;
+}
+
+static uint32_t none_cwnd(void* state) {
+    (void)state;
+    return 0;
+}
+
+const congestion_ops_t congestion_none_ops = {
+    .name = "none",
+    .init = NULL,
+    .destroy = none_destroy,
+    .on_ack = none_on_ack,
+    .on_loss = none_on_loss,
+    .pacing_rate = none_pacing_rate,
+    .cwnd = none_cwnd,
+};
@@ -0,0 +1,66 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Pluggable congestion control for the UDP data path. Rates and windows are counted in data
+// packets, which all carry up to UDP_PACKET_DATA_SIZE bytes. One controller is shared by every
+// partition thread, so the streams of a transfer back off and probe together.
+typedef struct __congestion_ops_t {
+    const char* name;
+    void* (*init)(uint64_t now_us);     // NULL for stateless algorithms
+    void (*destroy)(void* state);
+    // packets newly acknowledged; rtt_us is 0 when no RTT sample is available
+    void (*on_ack)(void* state, uint32_t packets, uint64_t rtt_us, uint64_t now_us);
+    // packets reported missing by the receiver
+    void (*on_loss)(void* state, uint32_t packets, uint64_t now_us);
+    // Allowed send rate in packets per second, 0 for unlimited
+    double (*pacing_rate)(void* state);
+    // Allowed unacknowledged packets, 0 for unlimited
+    uint32_t (*cwnd)(void* state);
+} congestion_ops_t;
+
+extern const congestion_ops_t congestion_none_ops;
+extern const congestion_ops_t congestion_bbr_ops;
+
+typedef struct __congestion_t {
+    pthread_mutex_t lock;
+    const congestion_ops_t* ops;
+    void* state;
+    uint32_t in_flight;     // unacknowledged packets across all partitions
+    double tokens;          // packets that may be sent right now
+    uint64_t last_refill_us;
+} congestion_t;
+
+// Create a controller running the named algorithm. Returns NULL for an unknown name.
+congestion_t* congestion_init(const char* name);
+
+void congestion_destroy(congestion_t* cc);
+
+// How many packets (at most max) the pacing rate allows now. When it is 0, *wait_us is set to
+// the time until the next packet may go.
+uint32_t congestion_allowance(congestion_t* cc, uint32_t max, uint64_t* wait_us);
+
+// How many packets of new data the congestion window allows on top of those in flight
+uint32_t congestion_window_available(congestion_t* cc);
+
+// Record a send of packets, new_packets of which carried data not sent before
+void congestion_on_sent(congestion_t* cc, uint32_t packets, uint32_t new_packets);
+
+void congestion_on_ack(congestion_t* cc, uint32_t packets, uint64_t rtt_us);
+
+void congestion_on_loss(congestion_t* cc, uint32_t packets);
+
+// Stop counting packets in flight that will never be acknowledged, e.g. because the partition
+// that sent them has stopped
+void congestion_on_abandon(congestion_t* cc, uint32_t packets);
+
+// Current pacing rate in packets per second, 0 for unlimited
+double congestion_pacing_rate(congestion_t* cc);
+
+// Monotonic clock in microseconds
+uint64_t congestion_now_us(void);
+
+#endif // CONGESTION_H
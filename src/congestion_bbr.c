@@ -0,0 +1,197 @@
+#include "congestion.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defines.h"
+
+// Rate-based controller in the style of BBR. Each round it measures the delivery rate from the
+// ACK stream and paces at a multiple of the windowed maximum: growing quickly at startup,
+// draining the queue it built, then cycling gently above and below the estimate. Rounds last
+// one minimum RTT, or BBR_DEFAULT_ROUND_US until an RTT sample arrives. Unlike classic BBR,
+// heavy loss in a round also lowers the bandwidth estimate, since NACK storms are what this
+// is meant to prevent.
+
+#define BBR_BW_FILTER_ROUNDS    10          // rounds the max-bandwidth filter spans
+#define BBR_STARTUP_GAIN        2.885       // 2/ln(2): double the delivery rate every round
+#define BBR_CWND_GAIN           2.0
+#define BBR_FULL_BW_GROWTH      1.25        // startup ends once a round grows less than this ...
+#define BBR_FULL_BW_ROUNDS      3           // ... this many rounds in a row
+#define BBR_LOSS_THRESH         0.02        // loss rate above which a round counts as lossy
+#define BBR_LOSS_BETA           0.7         // most a lossy round may cut the estimate by
+#define BBR_DEFAULT_ROUND_US    10000
+#define BBR_MIN_ROUND_US        1000
+#define BBR_MIN_RTT_EXPIRY_US   10000000
+#define BBR_INITIAL_RATE        1000.0      // packets/s before the first sample (~74 Mbps)
+#define BBR_MIN_RATE            100.0
+#define BBR_MIN_CWND            (4 * UDP_BATCH_SIZE)
+
+static const double bbr_probe_gains[] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+#define BBR_PROBE_CYCLE_LEN     (sizeof(bbr_probe_gains) / sizeof(bbr_probe_gains[0]))
+#define BBR_PROBE_DOWN_IDX      1
+#define BBR_PROBE_CRUISE_IDX    2
+
+typedef enum {
+    BBR_STARTUP,
+    BBR_DRAIN,
+    BBR_PROBE_BW,
+} bbr_mode_t;
+
+typedef struct __bbr_state_t {
+    bbr_mode_t mode;
+    double pacing_gain;
+    uint32_t cycle_idx;
+
+    double bw_samples[BBR_BW_FILTER_ROUNDS];    // delivery rate of recent rounds, packets/s
+    uint32_t round;
+    uint64_t round_start_us;
+    uint64_t delivered;                         // packets acknowledged so far
+    uint64_t round_delivered;                   // delivered when the round started
+    uint64_t round_lost;
+
+    double full_bw;
+    uint32_t full_bw_rounds;
+
+    uint64_t min_rtt_us;
+    uint64_t min_rtt_stamp_us;
+} bbr_state_t;
+
+static double bbr_btl_bw(bbr_state_t* bbr) {
+    double bw = 0;
+    for (int i = 0; i < BBR_BW_FILTER_ROUNDS; i++) {
+        if (bbr->bw_samples[i] > bw) {
+            bw = bbr->bw_samples[i];
+        }
+    }
+    return bw > 0 ? bw : BBR_INITIAL_RATE;
+}
+
+static void bbr_enter_probe_bw(bbr_state_t* bbr, uint32_t cycle_idx) {
+    bbr->mode = BBR_PROBE_BW;
+    bbr->cycle_idx = cycle_idx;
+    bbr->pacing_gain = bbr_probe_gains[cycle_idx];
+}
+
+static void bbr_end_round(bbr_state_t* bbr, uint64_t now_us) {
+    uint64_t elapsed = now_us - bbr->round_start_us;
+    uint64_t delivered = bbr->delivered - bbr->round_delivered;
+    double sample = (double)delivered * 1e6 / (double)elapsed;
+    bool lossy = bbr->round_lost > 0 &&
+        (double)bbr->round_lost / (double)(delivered + bbr->round_lost) > BBR_LOSS_THRESH;
+
+    bbr->bw_samples[bbr->round % BBR_BW_FILTER_ROUNDS] = sample;
+    double btl_bw = bbr_btl_bw(bbr);
+
+    if (lossy) {
+        // The path is dropping what we send: bring the estimate down towards what got through
+        double ceiling = sample > BBR_LOSS_BETA * btl_bw ? sample : BBR_LOSS_BETA * btl_bw;
+        for (int i = 0; i < BBR_BW_FILTER_ROUNDS; i++) {
+            if (bbr->bw_samples[i] > ceiling) {
+                bbr->bw_samples[i] = ceiling;
+            }
+        }
+        btl_bw = bbr_btl_bw(bbr);
+    }
+
+    switch (bbr->mode) {
+        case BBR_STARTUP:
+            if (lossy) {
+                bbr->mode = BBR_DRAIN;
+            } else if (btl_bw >= bbr->full_bw * BBR_FULL_BW_GROWTH) {
+                bbr->full_bw = btl_bw;
+                bbr->full_bw_rounds = 0;
+            } else if (++bbr->full_bw_rounds >= BBR_FULL_BW_ROUNDS) {
+                bbr->mode = BBR_DRAIN;
+            }
+            if (bbr->mode == BBR_DRAIN) {
+                bbr->pacing_gain = 1 / BBR_STARTUP_GAIN;
+            }
+            break;
+        case BBR_DRAIN:
+            // One round below the estimate empties the queue startup built
+            bbr_enter_probe_bw(bbr, BBR_PROBE_CRUISE_IDX);
+            break;
+        case BBR_PROBE_BW:
+            if (lossy && bbr->pacing_gain > 1) {
+                bbr_enter_probe_bw(bbr, BBR_PROBE_DOWN_IDX);
+            } else {
+                bbr_enter_probe_bw(bbr, (bbr->cycle_idx + 1) % BBR_PROBE_CYCLE_LEN);
+            }
+            break;
+    }
+
+    bbr->round++;
+    bbr->round_start_us = now_us;
+    bbr->round_delivered = bbr->delivered;
+    bbr->round_lost = 0;
+}
+
+static void bbr_maybe_end_round(bbr_state_t* bbr, uint64_t now_us) {
+    uint64_t round_us = BBR_DEFAULT_ROUND_US;
+    if (bbr->min_rtt_us > 0) {
+        round_us = bbr->min_rtt_us > BBR_MIN_ROUND_US ? bbr->min_rtt_us : BBR_MIN_ROUND_US;
+    }
+    if (now_us - bbr->round_start_us >= round_us) {
+        bbr_end_round(bbr, now_us);
+    }
+}
+
+static void* bbr_init(uint64_t now_us) {
+    bbr_state_t* bbr = (bbr_state_t*) calloc(1, sizeof(bbr_state_t));
+    if (!bbr) {
+        perror("calloc");
+        return NULL;
+    }
+    bbr->mode = BBR_STARTUP;
+    bbr->pacing_gain = BBR_STARTUP_GAIN;
+    bbr->round_start_us = now_us;
+    return bbr;
+}
+
+static void bbr_destroy(void* state) {
+    free(state);
+}
+
+static void bbr_on_ack(void* state, uint32_t packets, uint64_t rtt_us, uint64_t now_us) {
+    bbr_state_t* bbr = (bbr_state_t*)state;
+    bbr->delivered += packets;
+    if (rtt_us > 0 && (bbr->min_rtt_us == 0 || rtt_us <= bbr->min_rtt_us ||
+                       now_us - bbr->min_rtt_stamp_us > BBR_MIN_RTT_EXPIRY_US)) {
+        bbr->min_rtt_us = rtt_us;
+        bbr->min_rtt_stamp_us = now_us;
+    }
+    bbr_maybe_end_round(bbr, now_us);
+}
+
+static void bbr_on_loss(void* state, uint32_t packets, uint64_t now_us) {
+    bbr_state_t* bbr = (bbr_state_t*)state;
+    bbr->round_lost += packets;
+    bbr_maybe_end_round(bbr, now_us);
+}
+
+static double bbr_pacing_rate(void* state) {
+    bbr_state_t* bbr = (bbr_state_t*)state;
+    double rate = bbr->pacing_gain * bbr_btl_bw(bbr);
+    return rate > BBR_MIN_RATE ? rate : BBR_MIN_RATE;
+}
+
+static uint32_t bbr_cwnd(void* state) {
+    bbr_state_t* bbr = (bbr_state_t*)state;
+    if (bbr->min_rtt_us == 0) {
+        // Without an RTT there is no BDP to size the window by
+        return 0;
+    }
+    double bdp = bbr_btl_bw(bbr) * (double)bbr->min_rtt_us / 1e6;
+    uint32_t cwnd = (uint32_t)(BBR_CWND_GAIN * bdp);
+    return cwnd > BBR_MIN_CWND ? cwnd : BBR_MIN_CWND;
+}
+
+const congestion_ops_t congestion_bbr_ops = {
+    .name = "bbr",
+    .init = bbr_init,
+    .destroy = bbr_destroy,
+    .on_ack = bbr_on_ack,
+    .on_loss = bbr_on_loss,
+    .pacing_rate = bbr_pacing_rate,
+    .cwnd = bbr_cwnd,
+};
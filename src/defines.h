@@ -1,14 +1,23 @@
 #ifndef DEFINES_H
 #define DEFINES_H
 
-#define CLIENT_BASE_PORT     6341
+// The daemon receives every partition on SERVER_BASE_PORT. Partition i of a client sends from,
+// and takes its ACKs on, CLIENT_BASE_PORT + i, above the daemon so the two never collide on one host.
 #define SERVER_BASE_PORT     6342
+#define CLIENT_BASE_PORT     6343
 
 #define UDP_PACKET_DATA_SIZE        ((9 * 1024) - (50))
 #define UDP_PACKET_OVERHEAD_MARGIN  (50)
 #define UDP_PACKET_SIZE             (UDP_PACKET_DATA_SIZE + UDP_PACKET_OVERHEAD_MARGIN)
 
-#define NUM_THREADS          10
+// Number of datagrams moved per sendmmsg/recvmmsg syscall. Build with -DUDP_BATCH_SIZE=1
+// to get one syscall per datagram for comparison.
+#ifndef UDP_BATCH_SIZE
+#define UDP_BATCH_SIZE       32
+#endif
+
+// State written by different threads is kept at least this far apart to avoid false sharing
+#define CACHE_LINE_SIZE      64
 
 #define SERVER_ADDR_PORT(addr, ip, port) do { \
     addr.sin_family = AF_INET; \
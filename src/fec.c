@@ -0,0 +1,186 @@
+#include "fec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void fec_xor(uint8_t* dst, const uint8_t* src, size_t len) {
+    // A word at a time; compilers widen this loop to vector registers where they can
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+fec_encoder_t* fec_encoder_init(void) {
+    fec_encoder_t* encoder = (fec_encoder_t*) calloc(1, sizeof(fec_encoder_t));
+    if (!encoder) {
+        perror("calloc");
+        return NULL;
+    }
+    encoder->block_size = FEC_MAX_BLOCK;
+    return encoder;
+}
+
+void fec_encoder_destroy(fec_encoder_t* encoder) {
+    free(encoder);
+}
+
+// Aim for about one loss in every two blocks, which a single parity packet covers. Blocks
+// shrink at once when loss rises but only double per step when it falls, since rebuilt
+// packets are never reported and a larger block rebuilds fewer of them.
+static void fec_encoder_adapt(fec_encoder_t* encoder) {
+    uint32_t size = FEC_MAX_BLOCK;
+    if (encoder->lost > 0) {
+        double rate = (double)encoder->lost / (double)encoder->sent;
+        double target = 1.0 / (2.0 * rate);
+        size = target < FEC_MAX_BLOCK ? (uint32_t)target : FEC_MAX_BLOCK;
+    }
+    if (size > encoder->block_size * 2) {
+        size = encoder->block_size * 2;
+    }
+    encoder->block_size = size < FEC_MIN_BLOCK ? FEC_MIN_BLOCK : size;
+    encoder->sent = 0;
+    encoder->lost = 0;
+}
+
+ucp_packet_t* fec_encoder_add(fec_encoder_t* encoder, ucp_packet_t* packet) {
+    ucp_data_packet_t* data_packet = &packet->data_packet;
+    if (encoder->count == 0) {
+        encoder->first_seq = data_packet->seq_no;
+        encoder->len = 0;
+        memset(encoder->parity, 0, sizeof(encoder->parity));
+    }
+    fec_xor(encoder->parity, data_packet->payload, data_packet->seg_len);
+    if (data_packet->seg_len > encoder->len) {
+        encoder->len = data_packet->seg_len;
+    }
+    encoder->count++;
+    encoder->sent++;
+
+    if (encoder->count < encoder->block_size && data_packet->flag != UCP_FLAG_DATA_END) {
+        return NULL;
+    }
+    ucp_packet_t* parity = ucp_packet_init_parity(encoder->first_seq, encoder->count, encoder->parity, encoder->len);
+    encoder->count = 0;
+    if (encoder->sent >= FEC_ADAPT_PACKETS) {
+        fec_encoder_adapt(encoder);
+    }
+    return parity;
+}
+
+void fec_encoder_on_loss(fec_encoder_t* encoder, uint32_t packets) {
+    encoder->lost += packets;
+}
+
+fec_decoder_t* fec_decoder_init(void) {
+    fec_decoder_t* decoder = (fec_decoder_t*) calloc(1, sizeof(fec_decoder_t));
+    if (!decoder) {
+        perror("calloc");
+        return NULL;
+    }
+    return decoder;
+}
+
+void fec_decoder_destroy(fec_decoder_t* decoder) {
+    free(decoder);
+}
+
+void fec_decoder_add(fec_decoder_t* decoder, ucp_packet_t* parity) {
+    ucp_data_packet_t* data_packet = &parity->data_packet;
+    uint32_t count = (uint32_t)data_packet->flag;
+    if (count == 0 || data_packet->seg_len > UDP_PACKET_DATA_SIZE) {
+        return;
+    }
+
+    fec_block_t* slot = NULL;
+    for (size_t i = 0; i < FEC_MAX_PENDING; i++) {
+        fec_block_t* block = &decoder->blocks[i];
+        if (block->used && block->first_seq == data_packet->seq_no) {
+            // A duplicate
+            return;
+        }
+        if (!block->used && !slot) {
+            slot = block;
+        }
+    }
+    if (!slot) {
+        // The oldest parity gives way; its packets are recovered by retransmission instead
+        slot = &decoder->blocks[decoder->next];
+        decoder->next = (decoder->next + 1) % FEC_MAX_PENDING;
+    }
+
+    slot->used = true;
+    slot->first_seq = data_packet->seq_no;
+    slot->count = count;
+    slot->len = data_packet->seg_len;
+    memcpy(slot->parity, data_packet->payload, data_packet->seg_len);
+    if (slot->first_seq + count > decoder->covered) {
+        decoder->covered = slot->first_seq + count;
+    }
+}
+
+// Rebuild the missing packet of a block from its parity and the rest of its packets
+static bool fec_decoder_rebuild(fec_block_t* block, uint32_t missing, const fec_source_t* source) {
+    uint8_t payload[UDP_PACKET_DATA_SIZE];
+    uint8_t other[UDP_PACKET_DATA_SIZE];
+    memcpy(payload, block->parity, block->len);
+    for (uint32_t seq_no = block->first_seq; seq_no < block->first_seq + block->count; seq_no++) {
+        if (seq_no == missing) {
+            continue;
+        }
+        size_t len = source->load(source->ctx, seq_no, other);
+        if (len == 0 || len > block->len) {
+            return false;
+        }
+        fec_xor(payload, other, len);
+    }
+    return source->restore(source->ctx, missing, payload, block->len);
+}
+
+uint32_t fec_decoder_recover(fec_decoder_t* decoder, const fec_source_t* source) {
+    uint32_t rebuilt = 0;
+    for (size_t i = 0; i < FEC_MAX_PENDING; i++) {
+        fec_block_t* block = &decoder->blocks[i];
+        if (!block->used) {
+            continue;
+        }
+
+        uint32_t num_missing = 0;
+        uint32_t missing = 0;
+        for (uint32_t seq_no = block->first_seq; seq_no < block->first_seq + block->count && num_missing < 2; seq_no++) {
+            if (!source->has(source->ctx, seq_no)) {
+                num_missing++;
+                missing = seq_no;
+            }
+        }
+        if (num_missing > 1) {
+            // Wait for retransmissions to bring it down to one
+            continue;
+        }
+        if (num_missing == 1) {
+            if (!fec_decoder_rebuild(block, missing, source)) {
+                continue;
+            }
+            rebuilt++;
+        }
+        block->used = false;
+    }
+    return rebuilt;
+}
+
+bool fec_decoder_pending(const fec_decoder_t* decoder) {
+    for (size_t i = 0; i < FEC_MAX_PENDING; i++) {
+        if (decoder->blocks[i].used) {
+            return true;
+        }
+    }
+    return false;
+}
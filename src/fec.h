@@ -0,0 +1,88 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "defines.h"
+#include "ucp_packet.h"
+
+// Forward error correction over blocks of consecutive data packets. Each block is followed by
+// one parity packet, the XOR of its payloads, from which the receiver rebuilds any one packet
+// of the block that was lost without waiting a round trip for it.
+
+// Data packets per parity packet, adapted between these as loss is reported
+#define FEC_MIN_BLOCK           4
+#define FEC_MAX_BLOCK           32
+// New packets sent between adjustments of the block size
+#define FEC_ADAPT_PACKETS       1024
+// Parity packets a receiver holds while their blocks are missing more than one packet
+#define FEC_MAX_PENDING         16
+
+// XOR len bytes of src into dst
+void fec_xor(uint8_t* dst, const uint8_t* src, size_t len);
+
+// Sender side: folds each new data packet into the block being built
+typedef struct __fec_encoder_t {
+    uint32_t block_size;
+    uint32_t first_seq;
+    uint32_t count;                 // packets folded into the block so far
+    size_t len;                     // longest payload among them
+    uint64_t sent;                  // new packets since the block size was last adjusted
+    uint64_t lost;                  // packets reported lost since then
+    uint8_t parity[UDP_PACKET_DATA_SIZE];
+} fec_encoder_t;
+
+fec_encoder_t* fec_encoder_init(void);
+
+void fec_encoder_destroy(fec_encoder_t* encoder);
+
+// Fold a data packet, sent for the first time, into the current block. Returns the block's
+// parity packet once the block is full or the packet ends the partition, otherwise NULL.
+// The caller sends the parity packet and frees it.
+ucp_packet_t* fec_encoder_add(fec_encoder_t* encoder, ucp_packet_t* packet);
+
+// Count packets the receiver reported missing, which it could not rebuild. Blocks shrink
+// while this is high and grow back while it is not.
+void fec_encoder_on_loss(fec_encoder_t* encoder, uint32_t packets);
+
+// Receiver side: parity packets waiting for all but one packet of their block to arrive
+typedef struct __fec_block_t {
+    bool used;
+    uint32_t first_seq;
+    uint32_t count;
+    size_t len;
+    uint8_t parity[UDP_PACKET_DATA_SIZE];
+} fec_block_t;
+
+typedef struct __fec_decoder_t {
+    fec_block_t blocks[FEC_MAX_PENDING];
+    uint32_t next;                  // slot the next parity packet replaces when all are used
+    uint32_t covered;               // end of the furthest block a parity packet has arrived for
+} fec_decoder_t;
+
+// How the decoder reaches the packets of a partition. load reads a packet that has arrived
+// into buf and returns its length, or 0 on failure. restore hands over a rebuilt packet.
+typedef struct __fec_source_t {
+    bool (*has)(void* ctx, uint32_t seq_no);
+    size_t (*load)(void* ctx, uint32_t seq_no, uint8_t* buf);
+    bool (*restore)(void* ctx, uint32_t seq_no, const uint8_t* payload, size_t len);
+    void* ctx;
+} fec_source_t;
+
+fec_decoder_t* fec_decoder_init(void);
+
+void fec_decoder_destroy(fec_decoder_t* decoder);
+
+// Hold a parity packet until its block can be checked
+void fec_decoder_add(fec_decoder_t* decoder, ucp_packet_t* parity);
+
+// Rebuild the one missing packet of each held block that lacks only one, and release blocks
+// that lack none. Returns the number of packets rebuilt.
+uint32_t fec_decoder_recover(fec_decoder_t* decoder, const fec_source_t* source);
+
+// True if parity packets are held
+bool fec_decoder_pending(const fec_decoder_t* decoder);
+
+#endif // FEC_H
@@ -1,134 +1,466 @@
+#define _GNU_SOURCE
 #include "defines.h"
 #include "file_io.h"
+#include "io_ring.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-file_io_partition_handle_t* file_io_partition_file(char* filepath, int count) {
-    char invocation[256] = {0};
+typedef struct __file_io_uring_slot_t {
+    uint8_t data[UDP_PACKET_DATA_SIZE];
+    size_t offset;
+    size_t len;
+    int32_t res;
+    bool busy;
+} file_io_uring_slot_t;
 
-    char prefix[10] = "tmp_";
+struct __file_io_uring_state_t {
+    io_ring_t* ring;
+    int fd;
+    uint64_t base_offset;
+    file_io_uring_slot_t slots[FILE_IO_URING_DEPTH];
+    // Reader: offset of the next packet handed out, and of the next read to queue
+    size_t next_offset;
+    size_t next_read_offset;
+    // Writer: slots that are free to take a new write
+    uint32_t free_slots[FILE_IO_URING_DEPTH];
+    uint32_t num_free;
+    uint32_t in_flight;
+    bool failed;
+};
 
-    snprintf(invocation, sizeof(invocation) - 1, "/usr/bin/split -d -n %d %s %s", count, filepath, prefix);
+// Flag the first and last packets of a partition. The only packet of a partition is its last,
+// which is what the receiver and the parity encoder look for.
+static void file_io_flag_packet(file_io_partition_handle_t* handle, ucp_packet_t* packet) {
+    if (packet->data_packet.offset + packet->data_packet.seg_len >= handle->part_size) {
+        packet->data_packet.flag = UCP_FLAG_DATA_END;
+    } else if (packet->data_packet.offset == 0) {
+        packet->data_packet.flag = UCP_FLAG_DATA_START;
+    }
+}
 
-    FILE* fp = popen(invocation, "r");
-    if (!fp) {
-        perror("popen");
+// Set up the io_uring backend for a handle. Leaves handle->uring NULL (stdio fallback) if unavailable.
+static void file_io_uring_attach(file_io_partition_handle_t* handle) {
+    io_ring_t* ring = io_ring_init(FILE_IO_URING_DEPTH);
+    if (!ring) {
+        return;
+    }
+    file_io_uring_state_t* state = (file_io_uring_state_t*)calloc(1, sizeof(file_io_uring_state_t));
+    if (!state) {
+        perror("calloc");
+        io_ring_destroy(ring);
+        return;
+    }
+    state->ring = ring;
+    state->fd = handle->fd;
+    state->base_offset = handle->base_offset;
+    for (uint32_t i = 0; i < FILE_IO_URING_DEPTH; i++) {
+        state->free_slots[i] = i;
     }
+    state->num_free = FILE_IO_URING_DEPTH;
+    handle->uring = state;
+}
 
-    int ret = pclose(fp);
-    if (ret) {
-        perror("pclose");
+static void file_io_uring_detach(file_io_partition_handle_t* handle) {
+    if (handle->uring) {
+        io_ring_destroy(handle->uring->ring);
+        free(handle->uring);
+        handle->uring = NULL;
+    }
+}
+
+// Collect every available completion. Short or failed requests are finished synchronously.
+static void file_io_uring_reap(file_io_uring_state_t* state, bool is_write) {
+    uint64_t user_data = 0;
+    int32_t res = 0;
+    while (io_ring_peek(state->ring, &user_data, &res)) {
+        file_io_uring_slot_t* slot = &state->slots[user_data];
+        if (res >= 0 && (size_t)res < slot->len) {
+            ssize_t ret = is_write
+                ? pwrite(state->fd, slot->data + res, slot->len - res, state->base_offset + slot->offset + res)
+                : pread(state->fd, slot->data + res, slot->len - res, state->base_offset + slot->offset + res);
+            res = ret < 0 ? -1 : res + (int32_t)ret;
+        }
+        if (res < 0) {
+            fprintf(stderr, "io_uring %s failed at offset %zu: %s\n", is_write ? "write" : "read", slot->offset, strerror(-res));
+            state->failed = true;
+        }
+        slot->res = res;
+        slot->busy = false;
+        state->in_flight--;
+        if (is_write) {
+            state->free_slots[state->num_free++] = (uint32_t)user_data;
+        }
+    }
+}
+
+// Keep up to FILE_IO_URING_DEPTH reads queued ahead of the reader
+static void file_io_uring_read_ahead(file_io_partition_handle_t* handle) {
+    file_io_uring_state_t* state = handle->uring;
+    while (state->next_read_offset < handle->part_size &&
+           state->next_read_offset < state->next_offset + (FILE_IO_URING_DEPTH * UDP_PACKET_DATA_SIZE)) {
+        uint32_t idx = (state->next_read_offset / UDP_PACKET_DATA_SIZE) % FILE_IO_URING_DEPTH;
+        file_io_uring_slot_t* slot = &state->slots[idx];
+        size_t remaining = handle->part_size - state->next_read_offset;
+        slot->offset = state->next_read_offset;
+        slot->len = remaining > UDP_PACKET_DATA_SIZE ? UDP_PACKET_DATA_SIZE : remaining;
+        slot->busy = true;
+        if (!io_ring_prep_read(state->ring, state->fd, slot->data, slot->len, state->base_offset + slot->offset, idx)) {
+            slot->busy = false;
+            break;
+        }
+        state->in_flight++;
+        state->next_read_offset += UDP_PACKET_DATA_SIZE;
+    }
+    io_ring_submit(state->ring, 0);
+}
+
+static ucp_packet_t* file_io_uring_get_next_packet(file_io_partition_handle_t* handle) {
+    file_io_uring_state_t* state = handle->uring;
+    if (state->next_offset >= handle->part_size) {
+        return NULL;
+    }
+
+    file_io_uring_slot_t* slot = &state->slots[(state->next_offset / UDP_PACKET_DATA_SIZE) % FILE_IO_URING_DEPTH];
+    if (slot->offset != state->next_offset || (!slot->busy && slot->len == 0)) {
+        file_io_uring_read_ahead(handle);
+        if (slot->offset != state->next_offset || (!slot->busy && slot->len == 0)) {
+            fprintf(stderr, "Failed to queue read at offset %zu\n", state->next_offset);
+            return NULL;
+        }
+    }
+    // Wait for the read backing this packet to land
+    while (slot->busy) {
+        if (io_ring_submit(state->ring, 1) < 0) {
+            return NULL;
+        }
+        file_io_uring_reap(state, false);
+    }
+    if (slot->res <= 0) {
+        return NULL;
+    }
+
+    size_t offset = slot->offset;
+    ucp_packet_t* packet = ucp_packet_init_data(handle->last_seq_no++, offset, slot->data, slot->res);
+    slot->len = 0;
+    state->next_offset += UDP_PACKET_DATA_SIZE;
+    file_io_flag_packet(handle, packet);
+
+    file_io_uring_read_ahead(handle);
+    return packet;
+}
+
+static bool file_io_uring_save_packet(file_io_partition_handle_t* handle, ucp_packet_t* packet) {
+    file_io_uring_state_t* state = handle->uring;
+
+    file_io_uring_reap(state, true);
+    // All slots busy: push queued writes out and wait for one to retire
+    while (state->num_free == 0) {
+        if (io_ring_submit(state->ring, 1) < 0) {
+            return false;
+        }
+        file_io_uring_reap(state, true);
+    }
+    if (state->failed) {
+        return false;
+    }
+
+    uint32_t idx = state->free_slots[--state->num_free];
+    file_io_uring_slot_t* slot = &state->slots[idx];
+    memcpy(slot->data, packet->data_packet.payload, packet->data_packet.seg_len);
+    slot->offset = packet->data_packet.offset;
+    slot->len = packet->data_packet.seg_len;
+    slot->busy = true;
+    if (!io_ring_prep_write(state->ring, state->fd, slot->data, slot->len, state->base_offset + slot->offset, idx)) {
+        slot->busy = false;
+        state->free_slots[state->num_free++] = idx;
+        return false;
+    }
+    state->in_flight++;
+
+    if (io_ring_queued(state->ring) >= FILE_IO_URING_SUBMIT_BATCH) {
+        return io_ring_submit(state->ring, 0) >= 0;
+    }
+    return true;
+}
+
+// Submit anything queued and wait until no request is in flight
+static bool file_io_uring_drain(file_io_partition_handle_t* handle, bool is_write) {
+    file_io_uring_state_t* state = handle->uring;
+    while (state->in_flight > 0 || io_ring_queued(state->ring) > 0) {
+        if (io_ring_submit(state->ring, state->in_flight > 0 ? 1 : 0) < 0) {
+            return false;
+        }
+        file_io_uring_reap(state, is_write);
+    }
+    return !state->failed;
+}
+
+bool file_io_get_size(char* filepath, uint64_t* size) {
+    struct stat st;
+    if (stat(filepath, &st) < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", filepath, strerror(errno));
+        return false;
+    }
+    *size = (uint64_t)st.st_size;
+    return true;
+}
+
+file_io_partition_handle_t* file_io_partition_file(char* filepath, size_t count) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", filepath, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+    uint64_t file_size = (uint64_t)st.st_size;
+
+    // Each partition is read front to back
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Split into count ranges, with the remainder going to the last one (as split -n does)
+    uint64_t chunk = file_size / count;
+    if (file_size - (chunk * (count - 1)) > UINT32_MAX) {
+        fprintf(stderr, "File %s is too large for %zu partitions\n", filepath, count);
+        close(fd);
         return NULL;
     }
 
     file_io_partition_handle_t* handles = (file_io_partition_handle_t*)calloc(count, sizeof(file_io_partition_handle_t));
     if (!handles) {
         perror("calloc");
+        close(fd);
         return NULL;
     }
 
-    for (uint8_t i = 0; i < count; i++) {
+    for (size_t i = 0; i < count; i++) {
         handles[i].idx = i;
-        snprintf(handles[i].filepath, sizeof(handles[i].filepath) - 1, "%s%02d", prefix, i);
-        if (access(handles[i].filepath, F_OK) == -1) {
-            fprintf(stderr, "File %s does not exist\n", handles[i].filepath);
-            return NULL;
-        }
-        handles[i].fp = fopen(handles[i].filepath, "rb");
-        if (!handles[i].fp) {
-            perror("fopen");
-            return NULL;
-        }
-        // Get the size of the file
-        fseek(handles[i].fp, 0L, SEEK_END);
-        handles[i].part_size = ftell(handles[i].fp);
-        fseek(handles[i].fp, 0L, SEEK_SET);
-        
+        strncpy(handles[i].filepath, filepath, sizeof(handles[i].filepath) - 1);
+        handles[i].fd = fd;
+        handles[i].file_size = file_size;
+        handles[i].base_offset = chunk * i;
+        handles[i].part_size = (i == count - 1) ? file_size - handles[i].base_offset : chunk;
+
+        file_io_uring_attach(&handles[i]);
     }
 
     return handles;
 }
 
-void file_io_partition_release(file_io_partition_handle_t* handle, uint8_t count) {
-    for (uint8_t i = 0; i < count; i++) {
-        fclose(handle[i].fp);
-        remove(handle[i].filepath);
+void file_io_partition_release(file_io_partition_handle_t* handle, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (handle[i].uring) {
+            file_io_uring_drain(&handle[i], false);
+            file_io_uring_detach(&handle[i]);
+        }
+        if (handle[i].map) {
+            size_t delta = handle[i].base_offset % sysconf(_SC_PAGESIZE);
+            munmap(handle[i].map - delta, handle[i].part_size + delta);
+        }
+    }
+    if (count > 0) {
+        close(handle[0].fd);
     }
     free(handle);
 }
 
-ucp_packet_t* file_io_get_next_packet(file_io_partition_handle_t* handle) {
-    uint8_t buffer[UDP_PACKET_DATA_SIZE] = {0};
-    size_t offset = ftell(handle->fp);
-    size_t size = fread(buffer, 1, UDP_PACKET_DATA_SIZE, handle->fp);
-    if (size == 0) {
+// Read up to len bytes at offset within the partition, clamped to the partition's end
+static ssize_t file_io_read_at(file_io_partition_handle_t* handle, uint8_t* buf, size_t len, size_t offset) {
+    if (offset >= handle->part_size) {
+        return 0;
+    }
+    if (len > handle->part_size - offset) {
+        len = handle->part_size - offset;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = pread(handle->fd, buf + done, len - done, handle->base_offset + offset + done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            perror("pread");
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+bool file_io_map_partition(file_io_partition_handle_t* handle) {
+    if (handle->part_size == 0) {
+        return false;
+    }
+    // Mappings must start on a page boundary, so map from the page holding base_offset
+    size_t delta = handle->base_offset % sysconf(_SC_PAGESIZE);
+    void* map = mmap(NULL, handle->part_size + delta, PROT_READ, MAP_SHARED, handle->fd, handle->base_offset - delta);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    // Packets are produced front to back; let the kernel read ahead aggressively
+    madvise(map, handle->part_size + delta, MADV_SEQUENTIAL);
+    madvise(map, handle->part_size + delta, MADV_WILLNEED);
+
+    if (handle->uring) {
+        file_io_uring_drain(handle, false);
+        file_io_uring_detach(handle);
+    }
+    handle->map = (uint8_t*)map + delta;
+    handle->bytes_read = 0;
+    return true;
+}
+
+static ucp_packet_t* file_io_map_get_next_packet(file_io_partition_handle_t* handle) {
+    size_t offset = handle->bytes_read;
+    if (offset >= handle->part_size) {
         return NULL;
     }
-    ucp_packet_t* packet = ucp_packet_init_data(handle->last_seq_no++, offset, buffer, size);
-    if (offset == 0) {
-        packet->data_packet.flag = UCP_FLAG_DATA_START;
-    } else if (feof(handle->fp)) {
-        // fprintf(stderr, "End of file\n");
-        packet->data_packet.flag = UCP_FLAG_DATA_END;
+    size_t remaining = handle->part_size - offset;
+    size_t size = remaining > UDP_PACKET_DATA_SIZE ? UDP_PACKET_DATA_SIZE : remaining;
+
+    ucp_packet_t* packet = ucp_packet_init_data_ref(handle->last_seq_no++, offset, handle->map + offset, size);
+    if (!packet) {
+        return NULL;
     }
+    handle->bytes_read += size;
+    file_io_flag_packet(handle, packet);
     return packet;
 }
 
-ucp_packet_t* file_io_get_next_packet_with_offset(file_io_partition_handle_t* handle, size_t offset) {
-    uint8_t buffer[UDP_PACKET_DATA_SIZE] = {0};
-    fseek(handle->fp, offset, SEEK_SET);
-    size_t size = fread(buffer, 1, UDP_PACKET_DATA_SIZE, handle->fp);
-    if (size == 0) {
+ucp_packet_t* file_io_get_next_packet(file_io_partition_handle_t* handle) {
+    if (handle->map) {
+        return file_io_map_get_next_packet(handle);
+    }
+    if (handle->uring) {
+        return file_io_uring_get_next_packet(handle);
+    }
+
+    uint8_t buffer[UDP_PACKET_DATA_SIZE];
+    size_t offset = handle->bytes_read;
+    ssize_t size = file_io_read_at(handle, buffer, UDP_PACKET_DATA_SIZE, offset);
+    if (size <= 0) {
         return NULL;
     }
-    return ucp_packet_init_data(handle->last_seq_no++, offset, buffer, size);
+    handle->bytes_read += size;
+    ucp_packet_t* packet = ucp_packet_init_data(handle->last_seq_no++, offset, buffer, size);
+    file_io_flag_packet(handle, packet);
+    return packet;
+}
+
+ucp_packet_t* file_io_get_next_packet_with_offset(file_io_partition_handle_t* handle, size_t offset) {
+    return file_io_get_next_packet_with_offset_and_size(handle, offset, UDP_PACKET_DATA_SIZE);
 }
 
 ucp_packet_t* file_io_get_next_packet_with_offset_and_size(file_io_partition_handle_t* handle, size_t offset, size_t size) {
-    uint8_t buffer[UDP_PACKET_DATA_SIZE] = {0};
-    fseek(handle->fp, offset, SEEK_SET);
-    size_t read_size = fread(buffer, 1, size, handle->fp);
-    if (read_size == 0) {
+    uint8_t buffer[UDP_PACKET_DATA_SIZE];
+    if (size > UDP_PACKET_DATA_SIZE) {
+        size = UDP_PACKET_DATA_SIZE;
+    }
+    ssize_t read_size = file_io_read_at(handle, buffer, size, offset);
+    if (read_size <= 0) {
         return NULL;
     }
     return ucp_packet_init_data(handle->last_seq_no++, offset, buffer, read_size);
 }
 
 bool file_io_save_packet(file_io_partition_handle_t* handle, ucp_packet_t* packet) {
-    if (fseek(handle->fp, packet->data_packet.offset, SEEK_SET)) {
-        return false;
+    if (handle->uring) {
+        return file_io_uring_save_packet(handle, packet);
     }
-    if (fwrite(packet->data_packet.segment_data, 1, packet->data_packet.seg_len, handle->fp) != packet->data_packet.seg_len) {
-        return false;
-    }
-    if (fflush(handle->fp)) {
-        return false;
+
+    // Space was reserved up front, so each packet goes straight to its offset
+    const uint8_t* data = packet->data_packet.payload;
+    size_t len = packet->data_packet.seg_len;
+    uint64_t offset = handle->base_offset + packet->data_packet.offset;
+    while (len > 0) {
+        ssize_t ret = pwrite(handle->fd, data, len, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            perror("pwrite");
+            return false;
+        }
+        data += ret;
+        len -= ret;
+        offset += ret;
     }
     return true;
 }
 
+ssize_t file_io_read_saved(file_io_partition_handle_t* handle, uint8_t* buf, size_t len, size_t offset) {
+    if (handle->uring && !file_io_uring_drain(handle, true)) {
+        return -1;
+    }
+    return file_io_read_at(handle, buf, len, offset);
+}
+
 bool file_io_open_file_of_size(file_io_partition_handle_t* handle, char* name, size_t size) {
+    return file_io_open_file_part(handle, name, size, 0, size);
+}
 
-    handle->fp = fopen(name, "wb");
-    if (!handle->fp) {
-        perror("fopen");
+bool file_io_open_file_part(file_io_partition_handle_t* handle, char* name, uint64_t file_size, uint64_t base_offset, uint32_t part_size) {
+    handle->uring = NULL;
+    handle->map = NULL;
+    handle->file_size = file_size;
+    handle->base_offset = base_offset;
+    handle->fd = open(name, O_RDWR | O_CREAT, 0644);
+    if (handle->fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", name, strerror(errno));
         return false;
     }
-    handle->part_size = size;
-    // Create a file of size size filled with 0s
-    uint8_t buffer[UDP_PACKET_DATA_SIZE] = {0};
-    size_t remaining = size;
-    while (remaining > 0) {
-        size_t write_size = remaining > UDP_PACKET_DATA_SIZE ? UDP_PACKET_DATA_SIZE : remaining;
-        if (fwrite(buffer, 1, write_size, handle->fp) != write_size) {
-            return false;
-        }
-        remaining -= write_size;
+    handle->part_size = part_size;
+
+    // Reserve the blocks without writing zeros. Every partition does this, which is harmless
+    // once the first has: neither call touches data that is already there.
+#if defined(__linux__)
+    if (file_size > 0 && fallocate(handle->fd, 0, 0, file_size) < 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        perror("fallocate");
     }
+#endif // __linux__
+    // Drop anything left over from a longer file of the same name
+    struct stat st;
+    if (fstat(handle->fd, &st) < 0 || ((uint64_t)st.st_size != file_size && ftruncate(handle->fd, file_size) < 0)) {
+        perror("ftruncate");
+        close(handle->fd);
+        handle->fd = -1;
+        return false;
+    }
+
+    file_io_uring_attach(handle);
     return true;
 }
 
+bool file_io_close_file(file_io_partition_handle_t* handle) {
+    bool ok = true;
+    if (handle->uring) {
+        ok = file_io_uring_drain(handle, true);
+        file_io_uring_detach(handle);
+    }
+    if (handle->fd >= 0) {
+        if (close(handle->fd)) {
+            ok = false;
+        }
+        handle->fd = -1;
+    }
+    return ok;
+}
+
 bool file_io_merge_file(char* prefix, char* outfile) {
     char invocation[256] = {0};
     #ifdef __APPLE__
@@ -4,20 +4,45 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include "ucp_packet.h"
 
+// Number of reads/writes each handle keeps in flight when io_uring is available
+#define FILE_IO_URING_DEPTH         32
+// Queued writes are submitted to the kernel in groups of this size
+#define FILE_IO_URING_SUBMIT_BATCH  8
+
+// io_uring backend state. NULL when the handle uses the stdio fallback.
+typedef struct __file_io_uring_state_t file_io_uring_state_t;
+
+// A partition is a (base_offset, part_size) range of the source file. All partitions of a
+// file share one read-only descriptor and are read with positional I/O, so no copies of the
+// source are made. On the receiver, fd is the destination file and base_offset is where the
+// partition starts in it.
 typedef struct __file_io_partition_handle {
     char filepath[255];
-    FILE* fp;
+    int fd;
+    uint64_t file_size;
+    uint64_t base_offset;
     size_t bytes_read;
-    uint8_t idx;
+    uint16_t idx;
     uint32_t last_seq_no;
     uint32_t part_size;
+    file_io_uring_state_t* uring;
+    // Read-only mapping of the partition when sending in mmap mode, otherwise NULL
+    uint8_t* map;
 } file_io_partition_handle_t;
 
-file_io_partition_handle_t* file_io_partition_file(char* filepath, int count);
+file_io_partition_handle_t* file_io_partition_file(char* filepath, size_t count);
+
+void file_io_partition_release(file_io_partition_handle_t* handle, size_t count);
+
+// Get the size of the file at filepath. Returns false if it cannot be read.
+bool file_io_get_size(char* filepath, uint64_t* size);
 
-void file_io_partition_release(file_io_partition_handle_t* handle, uint8_t count);
+// Switch a partition to mmap mode. Packets then reference the mapping instead of copying it,
+// and must be freed before the partition is released. Returns false if the mapping failed.
+bool file_io_map_partition(file_io_partition_handle_t* handle);
 
 ucp_packet_t* file_io_get_next_packet(file_io_partition_handle_t* handle);
 
@@ -27,8 +52,20 @@ ucp_packet_t* file_io_get_next_packet_with_offset_and_size(file_io_partition_han
 
 bool file_io_save_packet(file_io_partition_handle_t* handle, ucp_packet_t* packet);
 
+// Read back up to len bytes saved at offset within a partition being received, once every write
+// queued before has landed. Returns the number of bytes read, or -1.
+ssize_t file_io_read_saved(file_io_partition_handle_t* handle, uint8_t* buf, size_t len, size_t offset);
+
 bool file_io_open_file_of_size(file_io_partition_handle_t* handle, char* name, size_t size);
 
+// Open the part_size byte partition at base_offset of a file_size byte destination. Other
+// partitions of the file may be open and writing at the same time, so the file is sized
+// but never truncated.
+bool file_io_open_file_part(file_io_partition_handle_t* handle, char* name, uint64_t file_size, uint64_t base_offset, uint32_t part_size);
+
+// Wait for all outstanding writes to complete and close the file. Returns false if any write failed.
+bool file_io_close_file(file_io_partition_handle_t* handle);
+
 bool file_io_merge_file(char* prefix, char* outfile);
 
 #endif // FILE_IO_H_
@@ -0,0 +1,213 @@
+#include "io_ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct __io_ring_t {
+    int fd;
+
+    // Submission queue
+    void* sq_ptr;
+    size_t sq_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned to_submit;
+
+    // Completion queue
+    void* cq_ptr;
+    size_t cq_size;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+// Every partition and daemon session sets up its own ring, so a missing io_uring is only reported once
+static atomic_flag io_ring_unavailable_reported = ATOMIC_FLAG_INIT;
+
+io_ring_t* io_ring_init(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        if (!atomic_flag_test_and_set(&io_ring_unavailable_reported)) {
+            fprintf(stderr, "io_uring unavailable: %s\n", strerror(errno));
+        }
+        return NULL;
+    }
+
+    io_ring_t* ring = (io_ring_t*)calloc(1, sizeof(io_ring_t));
+    if (!ring) {
+        perror("calloc");
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->sq_entries = params.sq_entries;
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        perror("mmap");
+        io_ring_destroy(ring);
+        return NULL;
+    }
+
+    uint8_t* sq = (uint8_t*)ring->sq_ptr;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    uint8_t* cq = (uint8_t*)ring->cq_ptr;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return ring;
+}
+
+static bool io_ring_prep(io_ring_t* ring, uint8_t opcode, int fd, const void* buf, unsigned len, uint64_t offset, uint64_t user_data) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        return false;
+    }
+
+    unsigned idx = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    return true;
+}
+
+bool io_ring_prep_read(io_ring_t* ring, int fd, void* buf, unsigned len, uint64_t offset, uint64_t user_data) {
+    return io_ring_prep(ring, IORING_OP_READ, fd, buf, len, offset, user_data);
+}
+
+bool io_ring_prep_write(io_ring_t* ring, int fd, const void* buf, unsigned len, uint64_t offset, uint64_t user_data) {
+    return io_ring_prep(ring, IORING_OP_WRITE, fd, buf, len, offset, user_data);
+}
+
+int io_ring_submit(io_ring_t* ring, unsigned wait_nr) {
+    unsigned to_submit = ring->to_submit;
+    // Publish the new tail so the kernel sees the queued entries
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+
+    int ret;
+    do {
+        ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+        return -1;
+    }
+    ring->to_submit -= (unsigned)ret > to_submit ? to_submit : (unsigned)ret;
+    return ret;
+}
+
+bool io_ring_peek(io_ring_t* ring, uint64_t* user_data, int32_t* res) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+unsigned io_ring_queued(io_ring_t* ring) {
+    return ring->to_submit;
+}
+
+void io_ring_destroy(io_ring_t* ring) {
+    if (ring) {
+        if (ring->sqes && ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED) {
+            munmap(ring->cq_ptr, ring->cq_size);
+        }
+        if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED) {
+            munmap(ring->sq_ptr, ring->sq_size);
+        }
+        close(ring->fd);
+        free(ring);
+    }
+}
+
+#else // __linux__
+
+io_ring_t* io_ring_init(unsigned entries) {
+    (void)entries;
+    return NULL;
+}
+
+bool io_ring_prep_read(io_ring_t* ring, int fd, void* buf, unsigned len, uint64_t offset, uint64_t user_data) {
+    (void)ring; (void)fd; (void)buf; (void)len; (void)offset; (void)user_data;
+    return false;
+}
+
+bool io_ring_prep_write(io_ring_t* ring, int fd, const void* buf, unsigned len, uint64_t offset, uint64_t user_data) {
+    (void)ring; (void)fd; (void)buf; (void)len; (void)offset; (void)user_data;
+    return false;
+}
+
+int io_ring_submit(io_ring_t* ring, unsigned wait_nr) {
+    (void)ring; (void)wait_nr;
+    return -1;
+}
+
+bool io_ring_peek(io_ring_t* ring, uint64_t* user_data, int32_t* res) {
+    (void)ring; (void)user_data; (void)res;
+    return false;
+}
+
+unsigned io_ring_queued(io_ring_t* ring) {
+    (void)ring;
+    return 0;
+}
+
+void io_ring_destroy(io_ring_t* ring) {
+    (void)ring;
+}
+
+#endif // __linux__
@@ -0,0 +1,31 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal io_uring wrapper over the raw syscalls. A ring is not thread safe;
+// each thread doing file I/O should own its own ring.
+typedef struct __io_ring_t io_ring_t;
+
+// Create a ring with room for entries submissions. Returns NULL when io_uring is unavailable.
+io_ring_t* io_ring_init(unsigned entries);
+
+// Queue a read/write of len bytes at offset. Returns false if the submission queue is full.
+bool io_ring_prep_read(io_ring_t* ring, int fd, void* buf, unsigned len, uint64_t offset, uint64_t user_data);
+bool io_ring_prep_write(io_ring_t* ring, int fd, const void* buf, unsigned len, uint64_t offset, uint64_t user_data);
+
+// Submit all queued requests and wait until at least wait_nr completions are available.
+// Returns the number of requests submitted, or -1 on error.
+int io_ring_submit(io_ring_t* ring, unsigned wait_nr);
+
+// Pop one completion if available. Returns false when the completion queue is empty.
+bool io_ring_peek(io_ring_t* ring, uint64_t* user_data, int32_t* res);
+
+// Number of queued requests not yet submitted
+unsigned io_ring_queued(io_ring_t* ring);
+
+void io_ring_destroy(io_ring_t* ring);
+
+#endif // IO_RING_H
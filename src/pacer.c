@@ -0,0 +1,130 @@
+#include "pacer.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+
+#define PACER_CALIBRATION_SAMPLES   16
+#define PACER_CALIBRATION_SLEEP_NS  (20 * 1000)
+
+// How early a sleep must end to be sure of waking up in time; spin for the rest
+static uint64_t pacer_timer_slack_ns;
+static pthread_once_t pacer_calibrated = PTHREAD_ONCE_INIT;
+
+uint64_t pacer_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Measure how late short sleeps wake up. The worst case seen is the slack left for spinning.
+static void pacer_calibrate(void) {
+    uint64_t worst = 0;
+    for (int i = 0; i < PACER_CALIBRATION_SAMPLES; i++) {
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = PACER_CALIBRATION_SLEEP_NS };
+        uint64_t start = pacer_now_ns();
+        nanosleep(&ts, NULL);
+        uint64_t overshoot = pacer_now_ns() - start - PACER_CALIBRATION_SLEEP_NS;
+        if (overshoot > worst) {
+            worst = overshoot;
+        }
+    }
+    pacer_timer_slack_ns = worst;
+}
+
+static void pacer_wait_until(uint64_t deadline_ns) {
+    uint64_t now = pacer_now_ns();
+    if (deadline_ns > now + pacer_timer_slack_ns) {
+        uint64_t wake = deadline_ns - pacer_timer_slack_ns;
+        struct timespec ts = { .tv_sec = wake / 1000000000, .tv_nsec = wake % 1000000000 };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    // Yield while spinning so a receiver sharing the core is not starved
+    while (pacer_now_ns() < deadline_ns) {
+        sched_yield();
+    }
+}
+
+void pacer_clock_init(pacer_clock_t* clock) {
+    atomic_init(&clock->next_tx_ns, 0);
+}
+
+void pacer_init(pacer_t* pacer, int sock_fd, pacer_clock_t* clock, bool use_txtime, bool use_gso, uint16_t segment_size) {
+    pthread_once(&pacer_calibrated, pacer_calibrate);
+
+    pacer->sock_fd = sock_fd;
+    pacer->clock = clock;
+    pacer->segment_size = segment_size;
+    pacer->use_txtime = use_txtime && udp_socket_enable_txtime(sock_fd);
+    pacer->use_gso = use_gso && udp_socket_enable_gso(sock_fd, segment_size);
+}
+
+static int pacer_send_now(pacer_t* pacer, struct sockaddr_in* addr, udp_datagram_t* dgrams, size_t count, uint64_t* sent_ns) {
+    // Stamp before the syscall: the receiver may well answer before it returns
+    uint64_t now = pacer_now_ns();
+    int ret = -1;
+    if (pacer->use_gso) {
+        ret = udp_socket_send_gso(pacer->sock_fd, addr, dgrams, count, pacer->segment_size);
+        if (ret < 0) {
+            fprintf(stderr, "GSO send failed. Falling back to batched sends\n");
+            pacer->use_gso = false;
+        }
+    }
+    if (!pacer->use_gso) {
+        ret = udp_socket_send_batch(pacer->sock_fd, addr, dgrams, count);
+    }
+    if (sent_ns) {
+        for (size_t i = 0; i < (ret > 0 ? (size_t)ret : 0); i++) {
+            sent_ns[i] = now;
+        }
+    }
+    return ret;
+}
+
+int pacer_send(pacer_t* pacer, struct sockaddr_in* addr, udp_datagram_t* dgrams, size_t count, double rate, uint64_t* sent_ns) {
+    for (size_t i = 0; i < count; i++) {
+        dgrams[i].tx_time = 0;
+    }
+    if (rate <= 0 || count == 0) {
+        return pacer_send_now(pacer, addr, dgrams, count, sent_ns);
+    }
+
+    // Reserve count consecutive slots on the shared schedule. A sender that fell idle
+    // restarts from now rather than bursting to catch up.
+    uint64_t interval = (uint64_t)(1e9 / rate);
+    uint64_t now = pacer_now_ns();
+    uint64_t next = atomic_load(&pacer->clock->next_tx_ns);
+    uint64_t start;
+    do {
+        start = next > now ? next : now;
+    } while (!atomic_compare_exchange_weak(&pacer->clock->next_tx_ns, &next, start + count * interval));
+
+    if (pacer->use_txtime) {
+        // Let the qdisc release each datagram on time, but keep the backlog within the horizon
+        if (start > now + PACER_TXTIME_HORIZON_NS) {
+            pacer_wait_until(start - PACER_TXTIME_HORIZON_NS);
+        }
+        for (size_t i = 0; i < count; i++) {
+            dgrams[i].tx_time = start + i * interval;
+        }
+        return pacer_send_now(pacer, addr, dgrams, count, sent_ns);
+    }
+
+    // Wait for each datagram's slot, then send everything due before the timer could fire again
+    size_t sent = 0;
+    while (sent < count) {
+        pacer_wait_until(start + sent * interval);
+        uint64_t horizon = pacer_now_ns() + pacer_timer_slack_ns;
+        size_t due = 1;
+        while (sent + due < count && start + (sent + due) * interval <= horizon) {
+            due++;
+        }
+        int ret = pacer_send_now(pacer, addr, dgrams + sent, due, sent_ns ? sent_ns + sent : NULL);
+        if (ret <= 0) {
+            break;
+        }
+        sent += ret;
+    }
+    return sent > 0 ? (int)sent : -1;
+}
@@ -0,0 +1,46 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "udp_socket.h"
+
+// With SO_TXTIME, never schedule datagrams further ahead than this, so the qdisc queue stays short
+#define PACER_TXTIME_HORIZON_NS     (2 * 1000 * 1000)
+
+// Departure schedule shared by every sender pacing against the same aggregate rate
+typedef struct __pacer_clock_t {
+    _Atomic uint64_t next_tx_ns;
+} pacer_clock_t;
+
+// Spaces the datagrams of one socket evenly in time. Departure times are either handed to the
+// kernel (SO_TXTIME, honoured by the fq qdisc) or waited out in user space with a timer
+// calibrated against the scheduler's wakeup latency.
+typedef struct __pacer_t {
+    int sock_fd;
+    pacer_clock_t* clock;
+    bool use_txtime;
+    bool use_gso;
+    uint16_t segment_size;
+} pacer_t;
+
+void pacer_clock_init(pacer_clock_t* clock);
+
+// Set up pacing on sock_fd. use_txtime and use_gso are requests; each falls back quietly when the
+// kernel lacks support. segment_size is the size of a full datagram.
+void pacer_init(pacer_t* pacer, int sock_fd, pacer_clock_t* clock, bool use_txtime, bool use_gso, uint16_t segment_size);
+
+// Send count datagrams spaced 1/rate seconds apart (rate in datagrams per second, 0 for
+// unpaced). When sent_ns is given, it receives when each datagram was handed to the kernel, not
+// its SO_TXTIME departure time, which a qdisc other than fq ignores. Returns the number of
+// datagrams sent, or -1 if none could be sent; only that many leading entries of sent_ns are
+// filled in.
+int pacer_send(pacer_t* pacer, struct sockaddr_in* addr, udp_datagram_t* dgrams, size_t count, double rate, uint64_t* sent_ns);
+
+// Monotonic clock in nanoseconds, the clock SO_TXTIME uses
+uint64_t pacer_now_ns(void);
+
+#endif // PACER_H
@@ -0,0 +1,46 @@
+#include "rtt_estimator.h"
+
+static uint64_t rtt_estimator_clamp(uint64_t rto_us) {
+    if (rto_us < RTT_MIN_RTO_US) {
+        return RTT_MIN_RTO_US;
+    }
+    if (rto_us > RTT_MAX_RTO_US) {
+        return RTT_MAX_RTO_US;
+    }
+    return rto_us;
+}
+
+void rtt_estimator_init(rtt_estimator_t* est) {
+    est->srtt_us = 0;
+    est->rttvar_us = 0;
+    est->min_rtt_us = 0;
+    est->rto_us = RTT_INITIAL_RTO_US;
+    est->samples = 0;
+}
+
+void rtt_estimator_sample(rtt_estimator_t* est, uint64_t rtt_us) {
+    if (est->samples == 0) {
+        // (2.2) SRTT <- R, RTTVAR <- R/2
+        est->srtt_us = rtt_us;
+        est->rttvar_us = rtt_us / 2;
+        est->min_rtt_us = rtt_us;
+    } else {
+        // (2.3) RTTVAR <- 3/4 RTTVAR + 1/4 |SRTT - R'|, then SRTT <- 7/8 SRTT + 1/8 R'
+        uint64_t delta = est->srtt_us > rtt_us ? est->srtt_us - rtt_us : rtt_us - est->srtt_us;
+        est->rttvar_us = (3 * est->rttvar_us + delta) / 4;
+        est->srtt_us = (7 * est->srtt_us + rtt_us) / 8;
+        if (rtt_us < est->min_rtt_us) {
+            est->min_rtt_us = rtt_us;
+        }
+    }
+    est->samples++;
+
+    // RTO <- SRTT + max(G, K*RTTVAR), which also undoes any backoff
+    uint64_t variance = 4 * est->rttvar_us;
+    est->rto_us = rtt_estimator_clamp(est->srtt_us + (variance > RTT_GRANULARITY_US ? variance : RTT_GRANULARITY_US));
+}
+
+void rtt_estimator_backoff(rtt_estimator_t* est) {
+    // (5.5) RTO <- RTO * 2
+    est->rto_us = rtt_estimator_clamp(est->rto_us * 2);
+}
@@ -0,0 +1,32 @@
+#ifndef RTT_ESTIMATOR_H
+#define RTT_ESTIMATOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Retransmission timeout bounds. RFC 6298 asks for a 1 s floor; like Linux, use 200 ms so that a
+// lost tail on a fast path does not stall the transfer for a whole second.
+#define RTT_INITIAL_RTO_US      (1000 * 1000)
+#define RTT_MIN_RTO_US          (200 * 1000)
+#define RTT_MAX_RTO_US          (60 * 1000 * 1000)
+// Clock granularity G of RFC 6298: how coarsely ACKs are noticed, not the clock resolution
+#define RTT_GRANULARITY_US      1000
+
+// Smoothed round-trip time and retransmission timeout as specified by RFC 6298
+typedef struct __rtt_estimator_t {
+    uint64_t srtt_us;       // smoothed RTT, 0 until the first sample
+    uint64_t rttvar_us;     // RTT variation
+    uint64_t min_rtt_us;    // smallest sample seen
+    uint64_t rto_us;        // current timeout, including backoff
+    uint32_t samples;
+} rtt_estimator_t;
+
+void rtt_estimator_init(rtt_estimator_t* est);
+
+// Feed one RTT measurement. Only packets sent once may be measured (Karn's algorithm).
+void rtt_estimator_sample(rtt_estimator_t* est, uint64_t rtt_us);
+
+// Double the timeout after it expired, up to RTT_MAX_RTO_US
+void rtt_estimator_backoff(rtt_estimator_t* est);
+
+#endif // RTT_ESTIMATOR_H
@@ -0,0 +1,249 @@
+#include "send_window.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+send_window_t* send_window_init(uint32_t capacity) {
+    uint32_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    send_window_t* window = (send_window_t*) calloc(1, sizeof(send_window_t));
+    if (!window) {
+        perror("calloc");
+        return NULL;
+    }
+    window->slots = (ucp_packet_t**) calloc(size, sizeof(ucp_packet_t*));
+    window->pending = (uint8_t*) calloc(size, sizeof(uint8_t));
+    window->resend_queue = (uint32_t*) calloc(size, sizeof(uint32_t));
+    window->sent_us = (uint64_t*) calloc(size, sizeof(uint64_t));
+    window->transmissions = (uint8_t*) calloc(size, sizeof(uint8_t));
+    window->older = (uint32_t*) calloc(size, sizeof(uint32_t));
+    window->newer = (uint32_t*) calloc(size, sizeof(uint32_t));
+    if (!window->slots || !window->pending || !window->resend_queue || !window->sent_us ||
+        !window->transmissions || !window->older || !window->newer) {
+        perror("calloc");
+        send_window_destroy(window);
+        return NULL;
+    }
+    window->capacity = size;
+    window->mask = size - 1;
+    window->oldest = SEND_WINDOW_NONE;
+    window->newest = SEND_WINDOW_NONE;
+    return window;
+}
+
+void send_window_destroy(send_window_t* window) {
+    if (window) {
+        if (window->slots) {
+            for (uint32_t i = 0; i < window->capacity; i++) {
+                ucp_packet_free(window->slots[i]);
+            }
+        }
+        free(window->slots);
+        free(window->pending);
+        free(window->resend_queue);
+        free(window->sent_us);
+        free(window->transmissions);
+        free(window->older);
+        free(window->newer);
+        free(window);
+    }
+}
+
+bool send_window_full(send_window_t* window) {
+    return window->next - window->base >= window->capacity;
+}
+
+uint32_t send_window_count(send_window_t* window) {
+    return window->count;
+}
+
+uint32_t send_window_pending(send_window_t* window) {
+    return window->resend_tail - window->resend_head;
+}
+
+// Take a slot out of the send-order list
+static void send_window_unlink(send_window_t* window, uint32_t idx) {
+    if (window->transmissions[idx] == 0) {
+        return;
+    }
+    uint32_t older = window->older[idx];
+    uint32_t newer = window->newer[idx];
+    if (older != SEND_WINDOW_NONE) {
+        window->newer[older] = newer;
+    } else {
+        window->oldest = newer;
+    }
+    if (newer != SEND_WINDOW_NONE) {
+        window->older[newer] = older;
+    } else {
+        window->newest = older;
+    }
+}
+
+bool send_window_insert(send_window_t* window, ucp_packet_t* packet) {
+    uint32_t seq_no = packet->data_packet.seq_no;
+    if (seq_no - window->base >= window->capacity) {
+        return false;
+    }
+    uint32_t idx = seq_no & window->mask;
+    if (window->slots[idx] == NULL) {
+        window->count++;
+    } else {
+        send_window_unlink(window, idx);
+    }
+    window->slots[idx] = packet;
+    window->pending[idx] = 0;
+    window->transmissions[idx] = 0;
+    window->sent_us[idx] = 0;
+    if (seq_no - window->base >= window->next - window->base) {
+        window->next = seq_no + 1;
+    }
+    return true;
+}
+
+ucp_packet_t* send_window_find(send_window_t* window, uint32_t seq_no) {
+    if (seq_no - window->base >= window->next - window->base) {
+        return NULL;
+    }
+    return window->slots[seq_no & window->mask];
+}
+
+void send_window_mark_sent(send_window_t* window, uint32_t seq_no, uint64_t now_us) {
+    if (!send_window_find(window, seq_no)) {
+        return;
+    }
+    uint32_t idx = seq_no & window->mask;
+    send_window_unlink(window, idx);
+    if (window->transmissions[idx] > 0) {
+        window->retransmissions++;
+    }
+    if (window->transmissions[idx] < UINT8_MAX) {
+        window->transmissions[idx]++;
+    }
+    window->sent_us[idx] = now_us;
+    // Any queued retransmission is now satisfied
+    window->pending[idx] = 0;
+
+    // Append as the most recently sent
+    window->older[idx] = window->newest;
+    window->newer[idx] = SEND_WINDOW_NONE;
+    if (window->newest != SEND_WINDOW_NONE) {
+        window->newer[window->newest] = idx;
+    } else {
+        window->oldest = idx;
+    }
+    window->newest = idx;
+}
+
+void send_window_restamp(send_window_t* window, uint32_t seq_no, uint64_t now_us) {
+    if (send_window_find(window, seq_no)) {
+        window->sent_us[seq_no & window->mask] = now_us;
+    }
+}
+
+// Clip first..last to the outstanding part of the window. Returns false if they do not overlap.
+static bool send_window_clip(send_window_t* window, uint32_t* first, uint32_t* last) {
+    if (window->count == 0) {
+        return false;
+    }
+    // Distances from the base, signed so that ranges behind the window are told apart
+    int64_t span = window->next - window->base;
+    int64_t lo = (int32_t)(*first - window->base);
+    int64_t hi = (int32_t)(*last - window->base);
+    if (hi < 0 || lo >= span || lo > hi) {
+        return false;
+    }
+    *first = window->base + (uint32_t)(lo < 0 ? 0 : lo);
+    *last = window->base + (uint32_t)(hi >= span ? span - 1 : hi);
+    return true;
+}
+
+uint32_t send_window_ack_range(send_window_t* window, uint32_t first, uint32_t last, uint64_t* rtt_sent_us) {
+    if (rtt_sent_us) {
+        *rtt_sent_us = 0;
+    }
+    if (!send_window_clip(window, &first, &last)) {
+        return 0;
+    }
+
+    uint32_t retired = 0;
+    for (uint32_t seq_no = first; ; seq_no++) {
+        uint32_t idx = seq_no & window->mask;
+        if (window->slots[idx]) {
+            // Karn's algorithm: an ACK for a resent packet cannot be matched to a send
+            if (rtt_sent_us && window->transmissions[idx] == 1 && window->sent_us[idx] > *rtt_sent_us) {
+                *rtt_sent_us = window->sent_us[idx];
+            }
+            send_window_unlink(window, idx);
+            ucp_packet_free(window->slots[idx]);
+            window->slots[idx] = NULL;
+            window->pending[idx] = 0;
+            window->transmissions[idx] = 0;
+            window->count--;
+            retired++;
+        }
+        if (seq_no == last) {
+            break;
+        }
+    }
+
+    // Slide the base past everything that has now been acknowledged
+    while (window->base != window->next && window->slots[window->base & window->mask] == NULL) {
+        window->base++;
+    }
+    return retired;
+}
+
+uint32_t send_window_nack_range(send_window_t* window, uint32_t first, uint32_t last) {
+    if (!send_window_clip(window, &first, &last)) {
+        return 0;
+    }
+
+    uint32_t queued = 0;
+    for (uint32_t seq_no = first; ; seq_no++) {
+        uint32_t idx = seq_no & window->mask;
+        // Stale entries (packets resent by timer since they were queued) can crowd the queue;
+        // anything that does not fit is left to the retransmission timer
+        if (window->slots[idx] && !window->pending[idx] && send_window_pending(window) < window->capacity) {
+            window->pending[idx] = 1;
+            window->resend_queue[window->resend_tail++ & window->mask] = seq_no;
+            queued++;
+        }
+        if (seq_no == last) {
+            break;
+        }
+    }
+    return queued;
+}
+
+ucp_packet_t* send_window_next_pending(send_window_t* window) {
+    while (window->resend_head != window->resend_tail) {
+        uint32_t seq_no = window->resend_queue[window->resend_head++ & window->mask];
+        uint32_t idx = seq_no & window->mask;
+        // Skip entries acknowledged or resent since they were queued
+        ucp_packet_t* packet = send_window_find(window, seq_no);
+        if (packet && window->pending[idx]) {
+            window->pending[idx] = 0;
+            return packet;
+        }
+    }
+    return NULL;
+}
+
+ucp_packet_t* send_window_next_expired(send_window_t* window, uint64_t now_us, uint64_t rto_us) {
+    uint32_t idx = window->oldest;
+    if (idx == SEND_WINDOW_NONE || window->sent_us[idx] + rto_us > now_us) {
+        return NULL;
+    }
+    return window->slots[idx];
+}
+
+uint64_t send_window_next_expiry(send_window_t* window, uint64_t rto_us) {
+    if (window->oldest == SEND_WINDOW_NONE) {
+        return 0;
+    }
+    return window->sent_us[window->oldest] + rto_us;
+}
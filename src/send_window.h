@@ -0,0 +1,83 @@
+#ifndef SEND_WINDOW_H
+#define SEND_WINDOW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ucp_packet.h"
+
+// Unacknowledged data packets of one partition, stored in a ring indexed by seq_no modulo
+// capacity. Lookup, ACK and NACK are O(1). Packets queued for retransmission after a NACK
+// stay in the window until they are acknowledged. Sent packets are also linked in the order
+// they were last sent, so the one whose retransmission timer fires first is always at hand.
+typedef struct __send_window_t {
+    ucp_packet_t** slots;
+    uint8_t* pending;
+    uint32_t* resend_queue;
+    uint32_t resend_head;
+    uint32_t resend_tail;
+    uint32_t capacity;
+    uint32_t mask;
+    uint32_t base;              // lowest unacknowledged seq_no
+    uint32_t next;              // one past the highest seq_no inserted
+    uint32_t count;             // packets in the window
+
+    uint64_t* sent_us;          // when each packet was last sent
+    uint8_t* transmissions;     // how often each packet was sent (saturating)
+    uint32_t* older;            // send-order list links, by slot
+    uint32_t* newer;
+    uint32_t oldest;            // slot sent longest ago, SEND_WINDOW_NONE if none
+    uint32_t newest;
+    uint64_t retransmissions;   // packets sent more than once, over the window's lifetime
+} send_window_t;
+
+#define SEND_WINDOW_NONE    UINT32_MAX
+
+// Create a window holding capacity packets (rounded up to a power of two)
+send_window_t* send_window_init(uint32_t capacity);
+
+// Free the window and every packet still in it
+void send_window_destroy(send_window_t* window);
+
+// True when no new seq_no fits until the oldest packet is acknowledged
+bool send_window_full(send_window_t* window);
+
+// Number of packets awaiting acknowledgement
+uint32_t send_window_count(send_window_t* window);
+
+// Number of packets queued for retransmission
+uint32_t send_window_pending(send_window_t* window);
+
+// Take ownership of a new packet. Returns false if its seq_no does not fit.
+bool send_window_insert(send_window_t* window, ucp_packet_t* packet);
+
+// Look up an outstanding packet
+ucp_packet_t* send_window_find(send_window_t* window, uint32_t seq_no);
+
+// Record that a packet is being (re)sent at now_us. This restarts its retransmission timer and
+// takes it off the retransmission queue.
+void send_window_mark_sent(send_window_t* window, uint32_t seq_no, uint64_t now_us);
+
+// Move the send time of a packet just marked sent to when it actually left, e.g. after pacing
+// held it back. Packets must be restamped in the order they were marked.
+void send_window_restamp(send_window_t* window, uint32_t seq_no, uint64_t now_us);
+
+// Acknowledge every packet from first to last inclusive, freeing them. Returns the number retired.
+// When rtt_sent_us is given, it receives the send time of the most recently sent packet retired
+// that was only ever sent once (a valid RTT sample), or 0 if there was none.
+uint32_t send_window_ack_range(send_window_t* window, uint32_t first, uint32_t last, uint64_t* rtt_sent_us);
+
+// Queue every outstanding packet from first to last inclusive for retransmission. Returns the
+// number newly queued.
+uint32_t send_window_nack_range(send_window_t* window, uint32_t first, uint32_t last);
+
+// Pop the next packet queued for retransmission, or NULL
+ucp_packet_t* send_window_next_pending(send_window_t* window);
+
+// The packet sent longest ago if it has gone unacknowledged for rto_us, or NULL
+ucp_packet_t* send_window_next_expired(send_window_t* window, uint64_t now_us, uint64_t rto_us);
+
+// When the next retransmission timer fires, or 0 if no sent packet is outstanding
+uint64_t send_window_next_expiry(send_window_t* window, uint64_t rto_us);
+
+#endif // SEND_WINDOW_H
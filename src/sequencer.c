@@ -2,173 +2,236 @@
 #include <stdlib.h>
 #include <string.h>
 
-typedef struct __sequencer_item_t {
-    uint32_t firstSeqNo;
-    uint32_t lastSeqNo;
-} sequencer_item_t;
+#define SEQUENCER_WORD_BITS         64
+#define SEQUENCER_INITIAL_CAPACITY  4096
 
-// Initialize the sequencer
-sequencer_t* sequencer_init(void) {
-    sequencer_t* seq = (sequencer_t*) malloc(sizeof(sequencer_t));
+#define WORDS_FOR(bits) (((bits) + SEQUENCER_WORD_BITS - 1) / SEQUENCER_WORD_BITS)
+
+// Resize both bitmap levels to hold at least capacity sequence numbers
+static bool sequencer_reserve(sequencer_t* seq, uint32_t capacity) {
+    uint32_t old_words = WORDS_FOR(seq->capacity);
+    uint32_t old_full_words = WORDS_FOR(old_words);
+    uint32_t words = WORDS_FOR(capacity);
+    uint32_t full_words = WORDS_FOR(words);
+
+    uint64_t* bitmap = (uint64_t*) realloc(seq->bitmap, (words ? words : 1) * sizeof(uint64_t));
+    if (!bitmap) {
+        perror("realloc");
+        return false;
+    }
+    seq->bitmap = bitmap;
+    memset(seq->bitmap + old_words, 0, (words - old_words) * sizeof(uint64_t));
+
+    uint64_t* full = (uint64_t*) realloc(seq->full, (full_words ? full_words : 1) * sizeof(uint64_t));
+    if (!full) {
+        perror("realloc");
+        return false;
+    }
+    seq->full = full;
+    memset(seq->full + old_full_words, 0, (full_words - old_full_words) * sizeof(uint64_t));
+
+    seq->capacity = words * SEQUENCER_WORD_BITS;
+    return true;
+}
+
+static sequencer_t* sequencer_alloc(uint32_t capacity) {
+    sequencer_t* seq = (sequencer_t*) calloc(1, sizeof(sequencer_t));
     if (!seq) {
-        perror("malloc");
+        perror("calloc");
         return NULL;
     }
-    memset(seq, 0, sizeof(sequencer_t));
-    LinkedListInit(&seq->seq);
     seq->expectedLastSeqNo = UINT32_MAX;
+    if (!sequencer_reserve(seq, capacity)) {
+        sequencer_destroy(seq);
+        return NULL;
+    }
     return seq;
 }
 
-static sequencer_item_t* create_sequencer_range(uint32_t first_seq, uint32_t last_seq) {
-    sequencer_item_t* item = (sequencer_item_t*) malloc(sizeof(sequencer_item_t));
-    if (!item) {
-        perror("malloc");
-        return NULL;
+// Initialize the sequencer
+sequencer_t* sequencer_init(void) {
+    return sequencer_alloc(SEQUENCER_INITIAL_CAPACITY);
+}
+
+// Initialize a sequencer for exactly count sequence numbers (0 to count - 1)
+sequencer_t* sequencer_init_sized(uint32_t count) {
+    sequencer_t* seq = sequencer_alloc(count);
+    if (seq) {
+        seq->fixed = true;
+        if (count > 0) {
+            seq->expectedLastSeqNo = count - 1;
+        }
     }
-    item->firstSeqNo = first_seq;
-    item->lastSeqNo = last_seq;
-    return item;
+    return seq;
 }
 
 // Add a sequence number to the sequencer
 int sequencer_add(sequencer_t* seq, uint32_t seqNo, bool isLast) {
-    // printf("Adding sequence to a list of %d fragments \n", LinkedListLength(&seq->seq));
+    // A sized sequencer knows every valid sequence number up front
+    if (seq->fixed && (seq->expectedLastSeqNo == UINT32_MAX || seqNo > seq->expectedLastSeqNo)) {
+        return false;
+    }
+
+    if (seqNo >= seq->capacity) {
+        uint64_t capacity = seq->capacity ? seq->capacity : SEQUENCER_INITIAL_CAPACITY;
+        while (capacity <= seqNo) {
+            capacity *= 2;
+        }
+        if (!sequencer_reserve(seq, capacity > UINT32_MAX ? UINT32_MAX : (uint32_t)capacity)) {
+            return false;
+        }
+    }
 
     if (isLast) {
-        seq->expectedLastSeqNo = seqNo;
+        if (!seq->fixed) {
+            seq->expectedLastSeqNo = seqNo;
+        }
         seq->maxSeqNo = seqNo;
     } else if (seq->maxSeqNo < seqNo) {
         seq->maxSeqNo = seqNo;
     }
 
-    if (sequencer_check(seq, seqNo)) {
+    uint32_t word = seqNo / SEQUENCER_WORD_BITS;
+    uint64_t bit = 1ULL << (seqNo % SEQUENCER_WORD_BITS);
+    if (seq->bitmap[word] & bit) {
         // Check if the sequence number is already in the sequencer
-        return FALSE;
-    } else if (LinkedListEmpty(&seq->seq)) {
-        // if the sequence number is the first in the sequence, insert it at the beginning of the sequencer
-        LinkedListAppend(&seq->seq, create_sequencer_range(seqNo, seqNo));
-        return TRUE;
-    }
-
-    // Add the sequence number to the sequencer
-    for (LinkedListElem* elem = LinkedListFirst(&seq->seq); elem != NULL; elem = LinkedListNext(&seq->seq, elem)) {
-        // If the sequence number is the next in the sequence, extend the last sequence number
-        sequencer_item_t* item = (sequencer_item_t*)elem->obj;
-        if (item->lastSeqNo + 1 == seqNo) {
-            // printf("Extending (%d->%d) to (%d->%d)\n", item->firstSeqNo, item->lastSeqNo, item->firstSeqNo, seqNo);
-            item->lastSeqNo = seqNo;
-            // Check if the sequence number can be merged with the next sequence number
-            LinkedListElem* nextElem = LinkedListNext(&seq->seq, elem);
-            if (nextElem != NULL) {
-                sequencer_item_t* nextItem = (sequencer_item_t*)nextElem->obj;
-                if (nextItem->firstSeqNo - 1 == item->lastSeqNo) {
-                    // printf("Merging (%d->%d) with (%d->%d)\n", item->firstSeqNo, item->lastSeqNo, nextItem->firstSeqNo, nextItem->lastSeqNo);
-                    item->lastSeqNo = nextItem->lastSeqNo;
-                    LinkedListUnlink(&seq->seq, nextElem);
-                    free(nextItem);
-                }
-            }
-            return TRUE;
-        }
-        // Else If the sequence number is the previous in the sequence, extend the first sequence number
-        else if (item->firstSeqNo - 1 == seqNo) {
-            // printf("Extending (%d->%d) to (%d->%d)\n", item->firstSeqNo, item->lastSeqNo, seqNo, item->lastSeqNo);
-            item->firstSeqNo = seqNo;
-            // Check if the sequence number can be merged with the previous sequence number
-            LinkedListElem* prevElem = LinkedListPrev(&seq->seq, elem);
-            if (prevElem != NULL) {
-                sequencer_item_t* prevItem = (sequencer_item_t*)prevElem->obj;
-                if (prevItem->lastSeqNo + 1 == item->firstSeqNo) {
-                    // printf("Merging (%d->%d) with (%d->%d)\n", prevItem->firstSeqNo, prevItem->lastSeqNo, item->firstSeqNo, item->lastSeqNo);
-                    item->firstSeqNo = prevItem->firstSeqNo;
-                    LinkedListUnlink(&seq->seq, prevElem);
-                    free(prevItem);
-                }
-            }
-            return TRUE;
-        } else {
-            // Else if the sequence number is between two sequences, but cannot be merged with any of them 
-            // Make it a new sequence number and insert it between two sequences
-            LinkedListElem* nextElem = LinkedListNext(&seq->seq, elem);
-            if (nextElem != NULL) {
-                sequencer_item_t* nextItem = (sequencer_item_t*)nextElem->obj;
-                if (item->lastSeqNo < seqNo && seqNo < nextItem->firstSeqNo) {
-                    LinkedListInsertBefore(&seq->seq, create_sequencer_range(seqNo, seqNo), nextElem);
-                    return TRUE;
-                }
-            } else {
-                if (item->lastSeqNo < seqNo) {
-                    LinkedListAppend(&seq->seq, create_sequencer_range(seqNo, seqNo));
-                    return TRUE;
-                }
-            }
-        }
+        return false;
+    }
+
+    seq->bitmap[word] |= bit;
+    seq->received++;
+    if (seq->bitmap[word] == UINT64_MAX) {
+        seq->full[word / SEQUENCER_WORD_BITS] |= 1ULL << (word % SEQUENCER_WORD_BITS);
     }
-    return FALSE;
+    return true;
 }
 
 // Check if a sequence number is in the sequencer
 int sequencer_check(sequencer_t* seq, uint32_t seqNo) {
-    for (LinkedListElem* elem = LinkedListFirst(&seq->seq); elem != NULL; elem = LinkedListNext(&seq->seq, elem)) {
-        sequencer_item_t* item = (sequencer_item_t*)elem->obj;
-        if (item->firstSeqNo <= seqNo && seqNo <= item->lastSeqNo) {
-            return TRUE;
-        }
+    if (seqNo >= seq->capacity) {
+        return false;
     }
-    return FALSE;
+    return (seq->bitmap[seqNo / SEQUENCER_WORD_BITS] >> (seqNo % SEQUENCER_WORD_BITS)) & 1;
 }
 
 uint32_t sequencer_complete(sequencer_t* seq) {
-    if (LinkedListEmpty(&seq->seq)) {
-        return FALSE;
-    }
-    // Iterate through the link list and check if the blocks are contiguous
-    for (LinkedListElem* elem = LinkedListFirst(&seq->seq); elem != NULL; elem = LinkedListNext(&seq->seq, elem)) {
-        sequencer_item_t* item = (sequencer_item_t*)elem->obj;
-        LinkedListElem* next_elem = LinkedListNext(&seq->seq, elem);
-        if (next_elem) {
-            sequencer_item_t* next_item = (sequencer_item_t*)next_elem->obj;
-            if (item->lastSeqNo + 1 == next_item->firstSeqNo) {
-                item->lastSeqNo = next_item->lastSeqNo;
-                LinkedListUnlink(&seq->seq, next_elem);
-                free(next_item);
+    if (seq->expectedLastSeqNo == UINT32_MAX) {
+        // A sequencer sized for no packets at all is complete from the start
+        return seq->fixed;
+    }
+    // Every number from 0 to expectedLastSeqNo has been seen exactly once
+    return seq->received == seq->expectedLastSeqNo + 1;
+}
+
+// Get the next missing sequence number in the sequencer
+void sequencer_iterate_missing_segments(sequencer_t* seq, void (*callback)(uint32_t, void*), void* ctx) {
+    if (seq->received == 0) {
+        return;
+    }
+
+    uint32_t last_word = WORDS_FOR(seq->maxSeqNo);
+    for (uint32_t word = 0; word < last_word; word++) {
+        // Skip over 64 full words at a time using the second level
+        uint32_t full_idx = word / SEQUENCER_WORD_BITS;
+        if (word % SEQUENCER_WORD_BITS == 0 && seq->full[full_idx] == UINT64_MAX) {
+            word += SEQUENCER_WORD_BITS - 1;
+            continue;
+        }
+        if ((seq->full[full_idx] >> (word % SEQUENCER_WORD_BITS)) & 1) {
+            continue;
+        }
+
+        uint64_t missing = ~seq->bitmap[word];
+        while (missing) {
+            uint32_t req_seq_no = word * SEQUENCER_WORD_BITS + __builtin_ctzll(missing);
+            if (req_seq_no >= seq->maxSeqNo) {
+                return;
             }
+            callback(req_seq_no, ctx);
+            missing &= missing - 1;
         }
     }
+}
 
-    if (LinkedListLength(&seq->seq) == 1) {
-        LinkedListElem* elem = LinkedListFirst(&seq->seq);
-        sequencer_item_t* item = (sequencer_item_t*)elem->obj;
-        if (item->firstSeqNo == 0 && item->lastSeqNo == seq->expectedLastSeqNo) {
-            return TRUE;
+// Find the first sequence number at or after from (and below limit) whose bit equals present.
+// Returns limit if there is none.
+static uint32_t sequencer_find_next(sequencer_t* seq, uint32_t from, uint32_t limit, bool present) {
+    uint32_t word = from / SEQUENCER_WORD_BITS;
+    uint32_t last_word = WORDS_FOR(limit);
+    // Ignore the bits below from in the first word
+    uint64_t mask = ~0ULL << (from % SEQUENCER_WORD_BITS);
+
+    while (word < last_word) {
+        if (!present && (seq->full[word / SEQUENCER_WORD_BITS] >> (word % SEQUENCER_WORD_BITS)) & 1) {
+            // Nothing missing in this word
+            word++;
+            mask = ~0ULL;
+            continue;
+        }
+        uint64_t bits = (present ? seq->bitmap[word] : ~seq->bitmap[word]) & mask;
+        if (bits) {
+            uint32_t found = word * SEQUENCER_WORD_BITS + __builtin_ctzll(bits);
+            return found < limit ? found : limit;
         }
-        
+        word++;
+        mask = ~0ULL;
     }
-    return FALSE;
+    return limit;
 }
 
-// Get the next missing sequence number in the sequencer
-void sequencer_iterate_missing_segments(sequencer_t* seq, void (*callback)(uint32_t, void*), void* ctx) {
-    if (LinkedListEmpty(&seq->seq)) {
+void sequencer_iterate_missing_ranges(sequencer_t* seq, void (*callback)(uint32_t, uint32_t, void*), void* ctx) {
+    if (seq->received == 0) {
         return;
     }
 
-    uint32_t req_seq_no = 0;
+    uint32_t limit = seq->maxSeqNo < seq->capacity ? seq->maxSeqNo : seq->capacity;
+    uint32_t pos = 0;
+    while (pos < limit) {
+        uint32_t first = sequencer_find_next(seq, pos, limit, false);
+        if (first >= limit) {
+            break;
+        }
+        uint32_t end = sequencer_find_next(seq, first, limit, true);
+        callback(first, end - 1, ctx);
+        pos = end;
+    }
+}
+
+uint32_t sequencer_cumulative(sequencer_t* seq) {
+    // Numbers are never removed, so the scan resumes where the last one stopped
+    seq->cumulative = sequencer_find_next(seq, seq->cumulative, seq->capacity, false);
+    return seq->cumulative;
+}
 
-    while(req_seq_no < seq->maxSeqNo) {
-        if (!sequencer_check(seq, req_seq_no)) {
-            callback(req_seq_no, ctx);
+size_t sequencer_get_bitmap(sequencer_t* seq, uint32_t from, uint8_t* out, size_t len) {
+    size_t used = 0;
+    uint32_t words = WORDS_FOR(seq->capacity);
+    for (size_t i = 0; i < len; i++) {
+        uint64_t pos = (uint64_t)from + i * 8;
+        uint8_t byte = 0;
+        if (pos < seq->capacity) {
+            uint32_t word = pos / SEQUENCER_WORD_BITS;
+            uint32_t shift = pos % SEQUENCER_WORD_BITS;
+            uint64_t bits = seq->bitmap[word] >> shift;
+            // The byte straddles two words
+            if (shift > SEQUENCER_WORD_BITS - 8 && word + 1 < words) {
+                bits |= seq->bitmap[word + 1] << (SEQUENCER_WORD_BITS - shift);
+            }
+            byte = bits & 0xFF;
+        }
+        out[i] = byte;
+        if (byte) {
+            used = i + 1;
         }
-        req_seq_no++;
     }
+    return used;
 }
 
 // Free the sequencer
 void sequencer_destroy(sequencer_t* seq) {
-    for (LinkedListElem* elem = LinkedListFirst(&seq->seq); elem != NULL; elem = LinkedListNext(&seq->seq, elem)) {
-        free(elem->obj);
+    if (seq) {
+        free(seq->bitmap);
+        free(seq->full);
+        free(seq);
     }
-    LinkedListUnlinkAll(&seq->seq);
-    free(seq);
 }
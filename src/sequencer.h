@@ -5,10 +5,15 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#include "linked_list.h"
-
+// Received sequence numbers are tracked in a bitmap, with a second-level bitmap marking
+// the words that are completely filled so that gap scans can skip them 64 at a time.
 typedef struct __sequencer {
-    LinkedList seq;
+    uint64_t* bitmap;
+    uint64_t* full;
+    uint32_t capacity;
+    bool fixed;
+    uint32_t received;
+    uint32_t cumulative;    // every number below this has been received
     uint32_t maxSeqNo;
     uint32_t expectedLastSeqNo;
 } sequencer_t;
@@ -16,6 +21,9 @@ typedef struct __sequencer {
 // Initialize the sequencer
 sequencer_t* sequencer_init(void);
 
+// Initialize a sequencer for exactly count sequence numbers (0 to count - 1)
+sequencer_t* sequencer_init_sized(uint32_t count);
+
 // Add a sequence number to the sequencer
 int sequencer_add(sequencer_t* seq, uint32_t seqNo, bool isLast);
 
@@ -25,6 +33,17 @@ int sequencer_check(sequencer_t* seq, uint32_t seqNo);
 // Get the next missing sequence number in the sequencer
 void sequencer_iterate_missing_segments(sequencer_t* seq, void (*callback)(uint32_t, void*), void* ctx);
 
+// Call back once per run of missing sequence numbers below the highest one seen, with the
+// first and last number of each run
+void sequencer_iterate_missing_ranges(sequencer_t* seq, void (*callback)(uint32_t, uint32_t, void*), void* ctx);
+
+// Get the first sequence number not yet received: everything below it has been
+uint32_t sequencer_cumulative(sequencer_t* seq);
+
+// Fill len bytes of out with a bitmap of the sequence numbers from onwards, bit i of byte j
+// standing for from + 8 * j + i. Returns the bytes up to the last one with a bit set.
+size_t sequencer_get_bitmap(sequencer_t* seq, uint32_t from, uint8_t* out, size_t len);
+
 // Check if the sequencer is complete
 uint32_t sequencer_complete(sequencer_t* seq);
 
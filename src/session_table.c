@@ -0,0 +1,120 @@
+#include "session_table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+session_key_t session_key_make(const struct sockaddr_in* addr, uint32_t transfer_id) {
+    session_key_t key;
+    memset(&key, 0, sizeof(key));
+    key.addr = addr->sin_addr.s_addr;
+    key.port = addr->sin_port;
+    key.transfer_id = transfer_id;
+    return key;
+}
+
+static bool session_key_equal(const session_key_t* a, const session_key_t* b) {
+    return a->addr == b->addr && a->port == b->port && a->transfer_id == b->transfer_id;
+}
+
+static size_t session_key_hash(const session_key_t* key) {
+    // Multiplicative mixing; the top bits are the best mixed
+    uint64_t h = ((uint64_t)key->addr << 16) ^ key->port;
+    h = (h ^ ((uint64_t)key->transfer_id << 32)) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32);
+}
+
+session_table_t* session_table_init(size_t buckets) {
+    size_t size = 1;
+    while (size < buckets) {
+        size <<= 1;
+    }
+
+    session_table_t* table = (session_table_t*) calloc(1, sizeof(session_table_t));
+    if (!table) {
+        perror("calloc");
+        return NULL;
+    }
+    table->buckets = (session_table_entry_t**) calloc(size, sizeof(session_table_entry_t*));
+    if (!table->buckets) {
+        perror("calloc");
+        free(table);
+        return NULL;
+    }
+    table->mask = size - 1;
+    return table;
+}
+
+void* session_table_find(session_table_t* table, const session_key_t* key) {
+    session_table_entry_t* entry = table->buckets[session_key_hash(key) & table->mask];
+    for (; entry; entry = entry->next) {
+        if (session_key_equal(&entry->key, key)) {
+            return entry->value;
+        }
+    }
+    return NULL;
+}
+
+bool session_table_insert(session_table_t* table, const session_key_t* key, void* value) {
+    if (session_table_find(table, key)) {
+        return false;
+    }
+    session_table_entry_t* entry = (session_table_entry_t*) malloc(sizeof(session_table_entry_t));
+    if (!entry) {
+        perror("malloc");
+        return false;
+    }
+    session_table_entry_t** bucket = &table->buckets[session_key_hash(key) & table->mask];
+    entry->key = *key;
+    entry->value = value;
+    entry->next = *bucket;
+    *bucket = entry;
+    table->count++;
+    return true;
+}
+
+void* session_table_remove(session_table_t* table, const session_key_t* key) {
+    session_table_entry_t** link = &table->buckets[session_key_hash(key) & table->mask];
+    for (; *link; link = &(*link)->next) {
+        if (session_key_equal(&(*link)->key, key)) {
+            session_table_entry_t* entry = *link;
+            void* value = entry->value;
+            *link = entry->next;
+            free(entry);
+            table->count--;
+            return value;
+        }
+    }
+    return NULL;
+}
+
+void session_table_sweep(session_table_t* table, bool (*callback)(const session_key_t*, void*, void*), void* ctx) {
+    for (size_t i = 0; i <= table->mask; i++) {
+        session_table_entry_t** link = &table->buckets[i];
+        while (*link) {
+            session_table_entry_t* entry = *link;
+            if (callback(&entry->key, entry->value, ctx)) {
+                *link = entry->next;
+                free(entry);
+                table->count--;
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+void session_table_destroy(session_table_t* table) {
+    if (!table) {
+        return;
+    }
+    for (size_t i = 0; i <= table->mask; i++) {
+        while (table->buckets[i]) {
+            session_table_entry_t* entry = table->buckets[i];
+            table->buckets[i] = entry->next;
+            free(entry);
+        }
+    }
+    free(table->buckets);
+    free(table);
+}
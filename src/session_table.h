@@ -0,0 +1,50 @@
+#ifndef SESSION_TABLE_H
+#define SESSION_TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+// A transfer is identified by the address and port it is sent from plus the ID its client
+// picked for the run, so that a rerun from the same port is never confused with the last one
+typedef struct __session_key_t {
+    uint32_t addr;          // network byte order
+    uint16_t port;          // network byte order
+    uint32_t transfer_id;
+} session_key_t;
+
+typedef struct __session_table_entry_t {
+    session_key_t key;
+    void* value;
+    struct __session_table_entry_t* next;
+} session_table_entry_t;
+
+// Chained hash table from session keys to caller-owned values. Not thread safe.
+typedef struct __session_table_t {
+    session_table_entry_t** buckets;
+    size_t mask;
+    size_t count;
+} session_table_t;
+
+session_key_t session_key_make(const struct sockaddr_in* addr, uint32_t transfer_id);
+
+// Create a table with buckets (rounded up to a power of two) chains
+session_table_t* session_table_init(size_t buckets);
+
+// Return the value stored under key, or NULL
+void* session_table_find(session_table_t* table, const session_key_t* key);
+
+// Store value under key. Returns false if the key is already present or memory ran out.
+bool session_table_insert(session_table_t* table, const session_key_t* key, void* value);
+
+// Remove key and return the value it held, or NULL if it was not present
+void* session_table_remove(session_table_t* table, const session_key_t* key);
+
+// Call back once per entry. Entries for which the callback returns true are removed.
+void session_table_sweep(session_table_t* table, bool (*callback)(const session_key_t*, void*, void*), void* ctx);
+
+// Free the table. The values are left to the caller.
+void session_table_destroy(session_table_t* table);
+
+#endif // SESSION_TABLE_H
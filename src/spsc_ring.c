@@ -0,0 +1,186 @@
+#include "spsc_ring.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif // __linux__
+
+spsc_ring_t* spsc_ring_init(size_t capacity, size_t elem_size) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    spsc_ring_t* ring = (spsc_ring_t*) aligned_alloc(SPSC_RING_CACHE_LINE, sizeof(spsc_ring_t));
+    if (!ring) {
+        perror("aligned_alloc");
+        return NULL;
+    }
+    memset(ring, 0, sizeof(spsc_ring_t));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->consumer_waiting, false);
+    ring->mask = size - 1;
+    ring->elem_size = elem_size;
+
+    ring->slots = (uint8_t*) malloc(size * elem_size);
+    if (!ring->slots) {
+        perror("malloc");
+        free(ring);
+        return NULL;
+    }
+
+#if defined(__linux__)
+    ring->wake_fd[0] = ring->wake_fd[1] = eventfd(0, EFD_CLOEXEC);
+    if (ring->wake_fd[0] < 0) {
+#else
+    if (pipe(ring->wake_fd) < 0) {
+#endif // __linux__
+        perror("eventfd");
+        free(ring->slots);
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+bool spsc_ring_push(spsc_ring_t* ring, const void* elem) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - ring->cached_head > ring->mask) {
+        // Looks full; refresh our view of the consumer
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail - ring->cached_head > ring->mask) {
+            return false;
+        }
+    }
+
+    memcpy(ring->slots + (tail & ring->mask) * ring->elem_size, elem, ring->elem_size);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    // Pairs with the fence in spsc_ring_pop_batch: either the consumer sees the new tail
+    // before parking, or we see it waiting and wake it.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->consumer_waiting, memory_order_relaxed)) {
+        spsc_ring_wake(ring);
+    }
+    return true;
+}
+
+size_t spsc_ring_try_pop_batch(spsc_ring_t* ring, void* out, size_t max) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (ring->cached_tail == head) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (ring->cached_tail == head) {
+            return 0;
+        }
+    }
+
+    size_t count = ring->cached_tail - head;
+    if (count > max) {
+        count = max;
+    }
+    for (size_t i = 0; i < count; i++) {
+        memcpy((uint8_t*)out + i * ring->elem_size, ring->slots + ((head + i) & ring->mask) * ring->elem_size, ring->elem_size);
+    }
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    return count;
+}
+
+static uint64_t spsc_ring_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+size_t spsc_ring_pop_batch(spsc_ring_t* ring, void* out, size_t max, unsigned spin_us, long wait_us) {
+    size_t count = spsc_ring_try_pop_batch(ring, out, max);
+    if (count > 0) {
+        return count;
+    }
+
+    // Spin briefly, in case the producer is mid-burst
+    uint64_t deadline = spsc_ring_now_us() + spin_us;
+    do {
+        for (int i = 0; i < 64; i++) {
+            count = spsc_ring_try_pop_batch(ring, out, max);
+            if (count > 0) {
+                return count;
+            }
+        }
+    } while (spsc_ring_now_us() < deadline);
+
+    // Park until the producer signals
+    atomic_store_explicit(&ring->consumer_waiting, true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    count = spsc_ring_try_pop_batch(ring, out, max);
+    if (count == 0) {
+        struct pollfd pfd = { .fd = ring->wake_fd[0], .events = POLLIN };
+        int timeout_ms = wait_us < 0 ? -1 : (int)((wait_us + 999) / 1000);
+        int ready;
+        do {
+            ready = poll(&pfd, 1, timeout_ms);
+        } while (ready < 0 && errno == EINTR);
+        if (ready > 0) {
+            uint64_t value = 0;
+            ssize_t ret;
+            do {
+                ret = read(ring->wake_fd[0], &value, sizeof(value));
+            } while (ret < 0 && errno == EINTR);
+        }
+        count = spsc_ring_try_pop_batch(ring, out, max);
+    }
+    atomic_store_explicit(&ring->consumer_waiting, false, memory_order_relaxed);
+    return count;
+}
+
+void spsc_ring_wake(spsc_ring_t* ring) {
+    uint64_t value = 1;
+    if (write(ring->wake_fd[1], &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+bool spsc_ring_arm(spsc_ring_t* ring) {
+    // The same handshake as parking in spsc_ring_pop_batch
+    atomic_store_explicit(&ring->consumer_waiting, true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->tail, memory_order_acquire) != head) {
+        atomic_store_explicit(&ring->consumer_waiting, false, memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void spsc_ring_disarm(spsc_ring_t* ring) {
+    atomic_store_explicit(&ring->consumer_waiting, false, memory_order_relaxed);
+    // The fd blocks, so only read it once it has something to give
+    struct pollfd pfd = { .fd = ring->wake_fd[0], .events = POLLIN };
+    if (poll(&pfd, 1, 0) > 0) {
+        uint64_t value;
+        if (read(ring->wake_fd[0], &value, sizeof(value)) < 0 && errno != EINTR) {
+            perror("read");
+        }
+    }
+}
+
+int spsc_ring_wake_fd(spsc_ring_t* ring) {
+    return ring->wake_fd[0];
+}
+
+void spsc_ring_destroy(spsc_ring_t* ring) {
+    if (ring) {
+        close(ring->wake_fd[0]);
+        if (ring->wake_fd[1] != ring->wake_fd[0]) {
+            close(ring->wake_fd[1]);
+        }
+        free(ring->slots);
+        free(ring);
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPSC_RING_CACHE_LINE    64
+
+// Fixed-capacity lock-free ring for exactly one producer thread and one consumer thread.
+// Elements are copied in and out by value. An idle consumer spins for a bounded time and
+// then parks on an eventfd until the producer publishes more elements.
+typedef struct __spsc_ring_t {
+    // Written by the consumer only
+    _Alignas(SPSC_RING_CACHE_LINE) atomic_size_t head;
+    size_t cached_tail;
+    atomic_bool consumer_waiting;
+
+    // Written by the producer only
+    _Alignas(SPSC_RING_CACHE_LINE) atomic_size_t tail;
+    size_t cached_head;
+
+    _Alignas(SPSC_RING_CACHE_LINE) size_t mask;
+    size_t elem_size;
+    uint8_t* slots;
+    int wake_fd[2];
+} spsc_ring_t;
+
+// Create a ring holding capacity elements (rounded up to a power of two) of elem_size bytes
+spsc_ring_t* spsc_ring_init(size_t capacity, size_t elem_size);
+
+// Producer: append an element. Returns false if the ring is full.
+bool spsc_ring_push(spsc_ring_t* ring, const void* elem);
+
+// Consumer: copy up to max elements into out without blocking. Returns the number popped.
+size_t spsc_ring_try_pop_batch(spsc_ring_t* ring, void* out, size_t max);
+
+// Consumer: like spsc_ring_try_pop_batch, but when the ring is empty spin for up to spin_us
+// microseconds and then sleep until an element arrives or spsc_ring_wake is called, or for at
+// most wait_us microseconds when it is not negative.
+size_t spsc_ring_pop_batch(spsc_ring_t* ring, void* out, size_t max, unsigned spin_us, long wait_us);
+
+// Wake a parked consumer (e.g. to make it notice shutdown)
+void spsc_ring_wake(spsc_ring_t* ring);
+
+// Consumer: for waiting on the ring with poll or epoll instead of spsc_ring_pop_batch. Returns
+// false if elements are already waiting. Otherwise spsc_ring_wake_fd turns readable once the
+// producer publishes one, and spsc_ring_disarm must be called before popping.
+bool spsc_ring_arm(spsc_ring_t* ring);
+
+// Consumer: stop being woken and consume any wakeup already signalled
+void spsc_ring_disarm(spsc_ring_t* ring);
+
+// The fd a parked consumer is woken through
+int spsc_ring_wake_fd(spsc_ring_t* ring);
+
+void spsc_ring_destroy(spsc_ring_t* ring);
+
+#endif // SPSC_RING_H
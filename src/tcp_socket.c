@@ -1,183 +1,215 @@
+#define _GNU_SOURCE
 #include "tcp_socket.h"
 #include "stdlib.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+// Readiness events collected per epoll_wait
+#define TCP_SERVER_MAX_EVENTS   64
+
+// Set once epoll_pwait2 turns out to be missing, after which timeouts round up to milliseconds
+static atomic_bool epoll_pwait2_missing = false;
+
 tcp_server_t* tcp_server_start(uint16_t port) {
     tcp_server_t* server = (tcp_server_t*) calloc(1, sizeof(tcp_server_t));
-
     if (server == NULL) {
         fprintf(stderr, "Failed to allocate memory for tcp_server_t\n");
-    } else {
-        // Create a socket
-        server->sd = socket(AF_INET, SOCK_STREAM, 0);
-        if (server->sd < 0) {
-            fprintf(stderr, "Failed to create socket. Error: %s.\n", strerror(errno));
-            free(server);
-        } else {
-            struct sockaddr_in server_addr = {0};
-            SERVER_ADDR_PORT(server_addr, "0.0.0.0", port);
+        return NULL;
+    }
+    server->port = port;
 
-            // Use the SO_REUSEADDR option to allow the server to restart immediately after it is killed
-            setsockopt(server->sd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    // Create a non-blocking socket; readiness is reported by epoll
+    server->sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (server->sd < 0) {
+        fprintf(stderr, "Failed to create socket. Error: %s.\n", strerror(errno));
+        free(server);
+        return NULL;
+    }
 
-            // Bind the socket to the port
-            if (bind(server->sd, (struct sockaddr*) &server_addr, sizeof(server_addr)) < 0) {
-                fprintf(stderr, "Failed to bind socket. Error: %s.\n", strerror(errno));
-                free(server);
-            } else {
-                if (listen(server->sd, 5) < 0) {
-                    fprintf(stderr, "Failed to listen on socket. Error: %s.\n", strerror(errno));
-                } else {
-                    server->max_sd = server->sd;
-                    FD_SET(server->sd, &server->server_fd_set);
-                    fprintf(stdout, "TCP Server started on port %d\n", port);
-                }
-            }
+    struct sockaddr_in server_addr = {0};
+    SERVER_ADDR_PORT(server_addr, "0.0.0.0", port);
+
+    // Use the SO_REUSEADDR option to allow the server to restart immediately after it is killed
+    setsockopt(server->sd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+
+    // Bind the socket to the port
+    if (bind(server->sd, (struct sockaddr*) &server_addr, sizeof(server_addr)) < 0) {
+        fprintf(stderr, "Failed to bind socket. Error: %s.\n", strerror(errno));
+        close(server->sd);
+        free(server);
+        return NULL;
+    }
+    if (listen(server->sd, 5) < 0) {
+        fprintf(stderr, "Failed to listen on socket. Error: %s.\n", strerror(errno));
+        close(server->sd);
+        free(server);
+        return NULL;
+    }
+
+    // The listening socket is registered with a NULL pointer, child sockets with their endpoint
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+    if (server->epoll_fd < 0 || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->sd, &event) < 0) {
+        fprintf(stderr, "Failed to watch socket. Error: %s.\n", strerror(errno));
+        if (server->epoll_fd >= 0) {
+            close(server->epoll_fd);
         }
+        close(server->sd);
+        free(server);
+        return NULL;
     }
+
+    fprintf(stdout, "TCP Server started on port %d\n", port);
     return server;
 }
 
-// Close a TCP Child Socket
-static void close_child_socket(tcp_server_t* server, int child_sd) {
-    if (server != NULL) {
-        close(child_sd);
-        FD_CLR(child_sd, &server->server_fd_set);
-        if (child_sd == server->max_sd) {
-            server->max_sd--;
+// Close a TCP Child Socket and forget its endpoint
+static void close_child_socket(tcp_server_t* server, tcp_endpoint_t* endpoint) {
+    if (server != NULL && endpoint != NULL) {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, endpoint->sd, NULL);
+        close(endpoint->sd);
+        for (tcp_endpoint_t** link = &server->endpoints; *link; link = &(*link)->next) {
+            if (*link == endpoint) {
+                *link = endpoint->next;
+                break;
+            }
         }
+        free(endpoint);
     }
 }
 
 // Close the TCP Server
 void tcp_server_stop(tcp_server_t* server) {
     if (server != NULL) {
-        while(server->max_sd > server->sd) {
-            close_child_socket(server, server->max_sd);
+        while (server->endpoints) {
+            close_child_socket(server, server->endpoints);
         }
+        close(server->epoll_fd);
         close(server->sd);
         free(server);
     }
 }
 
 // Create a new TCP Child Socket
-static void create_child_socket(tcp_server_t* server, int child_sd) {
-    if (server != NULL) {
-        tcp_endpoint_t* endpoint = calloc(1, sizeof(tcp_endpoint_t));
-        endpoint->sd = child_sd;
-        endpoint->next = server->endpoints;
-        server->endpoints = endpoint;
-        endpoint->addr = (struct sockaddr_in) {0};
-        socklen_t addr_len = sizeof(endpoint->addr);
-        // Get the address of the client
-        if (getpeername(child_sd, (struct sockaddr*) &endpoint->addr, &addr_len) < 0) {
-            fprintf(stderr, "Failed to get peer name. Error: %s.\n", strerror(errno));
-        } else {
-            // fprintf(stdout, "Peer name: " IP_ADDR_FORMAT, IP_ADDR(endpoint));
-        }
+static bool create_child_socket(tcp_server_t* server, int child_sd) {
+    tcp_endpoint_t* endpoint = calloc(1, sizeof(tcp_endpoint_t));
+    if (endpoint == NULL) {
+        fprintf(stderr, "Failed to allocate memory for tcp_endpoint_t\n");
+        return false;
+    }
+    endpoint->sd = child_sd;
+    socklen_t addr_len = sizeof(endpoint->addr);
+    // Get the address of the client
+    if (getpeername(child_sd, (struct sockaddr*) &endpoint->addr, &addr_len) < 0) {
+        fprintf(stderr, "Failed to get peer name. Error: %s.\n", strerror(errno));
+    }
 
-        FD_SET(child_sd, &server->server_fd_set);
-        if (child_sd > server->max_sd) {
-            server->max_sd = child_sd;
-        }
+    // Edge-triggered: each wakeup must be followed by reads until the socket runs dry
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = endpoint };
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, child_sd, &event) < 0) {
+        fprintf(stderr, "Failed to watch socket. Error: %s.\n", strerror(errno));
+        free(endpoint);
+        return false;
     }
+    endpoint->next = server->endpoints;
+    server->endpoints = endpoint;
+    return true;
 }
 
-// Accept a new connection. Open a Child Socket
-int tcp_server_accept(tcp_server_t* server) {
+// Accept every pending connection. Returns how many were accepted.
+static int tcp_server_accept(tcp_server_t* server) {
+    int accepted = 0;
     if (server != NULL) {
-        int new_sd = -1;
-        if ((new_sd = accept(server->sd, NULL, NULL)) < 0) {
-            fprintf(stderr, "Failed to accept connection. Error: %s.\n", strerror(errno));
-            return 0;
-        } else {
-            // Create a new child socket
+        for (;;) {
+            int new_sd = accept4(server->sd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (new_sd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    fprintf(stderr, "Failed to accept connection. Error: %s.\n", strerror(errno));
+                }
+                break;
+            }
+            if (!create_child_socket(server, new_sd)) {
+                close(new_sd);
+                continue;
+            }
             fprintf(stdout, "Accepted connection on socket %d\n", new_sd);
-            create_child_socket(server, new_sd);
-            return 1;
+            accepted++;
         }
     }
-    return 0;
+    return accepted;
 }
 
-// Get TCP Endpoint from Socket Descriptor
-static tcp_endpoint_t* get_endpoint(tcp_server_t* server, int sd) {
-    tcp_endpoint_t* endpoint = NULL;
-    if (server != NULL) {
-        endpoint = server->endpoints;
-        while(endpoint != NULL) {
-            if (endpoint->sd == sd) {
-                break;
+// Read a child socket until it runs dry, handing each read to on_rx
+static void receive_endpoint(tcp_server_t* server, tcp_endpoint_t* endpoint) {
+    for (;;) {
+        tcp_sgmnt_t sgmnt;
+        ssize_t bytes_read = read(endpoint->sd, sgmnt.data, sizeof(sgmnt.data));
+        if (bytes_read > 0) {
+            sgmnt.data_len = bytes_read;
+            if (server->on_rx) {
+                server->on_rx(server, endpoint, &sgmnt);
             }
-            endpoint = endpoint->next;
+        } else if (bytes_read == 0) {
+            fprintf(stdout, "Client disconnected.\n");
+            close_child_socket(server, endpoint);
+            return;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Failed to read from socket. Error: %s.\n", strerror(errno));
+                close_child_socket(server, endpoint);
+            }
+            return;
         }
     }
-    return endpoint;
 }
 
-// Receive data from a Child Socket
-void tcp_server_receive(tcp_server_t* server, int child_sd) {
-    uint8_t buffer[1024] = {0};
-    size_t bytes_read = read(child_sd, buffer, sizeof(buffer));
-    if (bytes_read < 0) {
-        fprintf(stderr, "Failed to read from socket. Error: %s.\n", strerror(errno));
-    } else if (bytes_read == 0) {
-        fprintf(stdout, "Client disconnected.\n");
-        close_child_socket(server, child_sd);
-    } else {
-        tcp_endpoint_t* endpoint = get_endpoint(server, child_sd);
-        // fprintf(stdout, "Received %ld bytes from "IP_ADDR_FORMAT" : %s", bytes_read, IP_ADDR(endpoint), buffer);
-        tcp_sgmnt_t sgmnt = {0};
-        memcpy(sgmnt.data, buffer, bytes_read);
-        sgmnt.data_len = bytes_read;
-        server->on_rx(server, endpoint, &sgmnt);
+// Wait up to timeout_us for events. epoll_wait only counts milliseconds, which is far coarser
+// than the pacing and retransmission deadlines callers wait for.
+static int wait_for_events(int epoll_fd, struct epoll_event* events, int max_events, long timeout_us) {
+#ifdef __NR_epoll_pwait2
+    if (timeout_us > 0 && !atomic_load_explicit(&epoll_pwait2_missing, memory_order_relaxed)) {
+        struct timespec timeout = { .tv_sec = timeout_us / 1000000, .tv_nsec = (timeout_us % 1000000) * 1000 };
+        int ret = (int)syscall(__NR_epoll_pwait2, epoll_fd, events, max_events, &timeout, NULL, 0);
+        if (ret >= 0 || errno != ENOSYS) {
+            return ret;
+        }
+        atomic_store_explicit(&epoll_pwait2_missing, true, memory_order_relaxed);
     }
+#endif
+    return epoll_wait(epoll_fd, events, max_events, timeout_us > 0 ? (int)((timeout_us + 999) / 1000) : 0);
 }
 
-// Server Loop. Accept new connections and receive data
-void tcp_server_tick(tcp_server_t* server) {
+// Accept new connections and receive data, waiting at most timeout_us for something to arrive.
+// A timeout of 0 only handles what has already arrived and never blocks.
+void tcp_server_poll(tcp_server_t* server, long timeout_us) {
     if (server != NULL) {
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        memcpy(&read_fds, &server->server_fd_set, sizeof(server->server_fd_set));
-
-        struct timeval timeout = { .tv_sec = 1, .tv_usec = 100*1000 };
-
-        int err = select(server->max_sd + 1, &read_fds, NULL, NULL, &timeout);
-        if (err > 0) {
-            for (int sd = server->sd; sd <= server->max_sd; sd++) {
-                if (FD_ISSET(sd, &read_fds)) {
-                    if (sd == server->sd) {
-                        // New connection
-                        tcp_server_accept(server);
-                    } else {
-                        // Receive data
-                        tcp_server_receive(server, sd);
-                    }
-                }
+        struct epoll_event events[TCP_SERVER_MAX_EVENTS];
+        int ready = wait_for_events(server->epoll_fd, events, TCP_SERVER_MAX_EVENTS, timeout_us);
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) {
+                // New connection
+                tcp_server_accept(server);
+            } else {
+                // Receive data
+                receive_endpoint(server, (tcp_endpoint_t*)events[i].data.ptr);
             }
         }
     }
 }
 
-// Send data to a Child Socket
-void tcp_server_send(tcp_server_t* server, tcp_endpoint_t* dst, tcp_sgmnt_t* segment) {
-    if (server != NULL && dst != NULL && segment != NULL) {
-        // fprintf(stdout, "Sending TCP Segment to "IP_ADDR_FORMAT" %.*s", IP_ADDR(dst), (int) segment->data_len, segment->data);
-        // Send data to the client
-        size_t bytes_sent = sendto(dst->sd, segment->data, segment->data_len, 0, (struct sockaddr*) &dst->addr, sizeof(struct sockaddr));
-        if (bytes_sent < 0) {
-            fprintf(stderr, "Failed to send TCP Segment. Error: %s.\n", strerror(errno));
-        } else {
-            fprintf(stdout, "Sent %ld bytes\n", bytes_sent);
-        }
-    }
-}
-
 tcp_client_t* tcp_client_connect(tcp_endpoint_t* dest, tcp_receive_handler_t on_receive, tcp_disconnect_handler_t on_disconnect) {
     tcp_client_t* client = malloc(sizeof(tcp_client_t));
     if (!client) {
@@ -187,21 +219,48 @@ tcp_client_t* tcp_client_connect(tcp_endpoint_t* dest, tcp_receive_handler_t on_
 
     client->server = dest;
 
-    // Create a new socket
-    client->sd = socket(AF_INET, SOCK_STREAM, 0);
+    client->port = 0;
+
+    // Create a non-blocking socket, so that an unreachable server holds up nobody
+    client->sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (client->sd < 0) {
         fprintf(stderr, "tcp_client_connect: Error creating socket\n");
         free(client);
         return NULL;
     }
 
-    // Connect to TCP server
-    if (connect(client->sd, (struct sockaddr*)&dest->addr, sizeof(struct sockaddr)) < 0) {
-        fprintf(stderr, "tcp_client_connect: Error connecting to server\n");
+    // Start connecting to the TCP server
+    if (connect(client->sd, (struct sockaddr*)&dest->addr, sizeof(struct sockaddr)) < 0 && errno != EINPROGRESS) {
+        fprintf(stderr, "tcp_client_connect: Error connecting to server. Error: %s.\n", strerror(errno));
+        close(client->sd);
         free(client);
         return NULL;
     }
 
+    client->on_receive = on_receive;
+    client->on_disconnect = on_disconnect;
+
+    return client;
+}
+
+bool tcp_client_connect_finish(tcp_client_t* client) {
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(client->sd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        fprintf(stderr, "tcp_client_connect: Error connecting to server. Error: %s.\n", strerror(err));
+        return false;
+    }
+
+    // Sends block once connected, as they always have
+    int flags = fcntl(client->sd, F_GETFL);
+    if (flags < 0 || fcntl(client->sd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        fprintf(stderr, "tcp_client_connect: Failed to make socket blocking. Error: %s.\n", strerror(errno));
+        return false;
+    }
+
     struct sockaddr_in addr = {0};
     socklen_t addr_len = sizeof(addr);
 
@@ -213,11 +272,7 @@ tcp_client_t* tcp_client_connect(tcp_endpoint_t* dest, tcp_receive_handler_t on_
         client->port = ntohs(addr.sin_port);
         fprintf(stdout, "Locally bound to port %d\n", client->port);
     }
-
-    client->on_receive = on_receive;
-    client->on_disconnect = on_disconnect;
-
-    return client;
+    return true;
 }
 
 void tcp_client_disconnect(tcp_client_t* client) {
@@ -239,22 +294,3 @@ uint8_t tcp_client_send(tcp_client_t* client, tcp_sgmnt_t* sgmnt) {
     }
     return 1;
 }
-
-void tcp_client_receive(tcp_client_t* client) {
-    if (client) {
-        tcp_sgmnt_t sgmnt = {0};
-        // Read data from socket into buffer
-        size_t bytes_read = recv(client->sd, sgmnt.data, sizeof(sgmnt.data), 0);
-        if (bytes_read > 0) {
-            sgmnt.data_len = bytes_read;
-            fprintf(stdout, "Received %ld bytes from server\n", bytes_read);
-            if (client->on_receive) {
-                client->on_receive(client, &sgmnt);
-            }
-        } else {
-            if (client->on_disconnect) {
-                client->on_disconnect(client);
-            }
-        }
-    }
-}
@@ -2,12 +2,13 @@
 #define TCP_SOCKET_H
 
 #include "defines.h"
+#include <stdbool.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
 typedef struct __tcp_sgmnt_t {
-    uint8_t data[1024];
+    uint8_t data[4096];
     ssize_t data_len;
 } tcp_sgmnt_t;
 
@@ -36,14 +37,17 @@ struct __tcp_client_t {
     void* user_data;
 };
 
+// Start connecting to dest without waiting. Once client->sd turns writable, finish with
+// tcp_client_connect_finish().
 tcp_client_t* tcp_client_connect(tcp_endpoint_t* dest, tcp_receive_handler_t on_receive, tcp_disconnect_handler_t on_disconnect);
 
+// Returns true if the connection formed. The socket blocks from then on.
+bool tcp_client_connect_finish(tcp_client_t* client);
+
 void tcp_client_disconnect(tcp_client_t* client);
 
 uint8_t tcp_client_send(tcp_client_t* client, tcp_sgmnt_t* sgmnt);
 
-void tcp_client_receive(tcp_client_t* client);
-
 typedef struct __tcp_server_t tcp_server_t;
 
 typedef void (*tcp_message_tx_cb_t) (tcp_server_t* tcp, tcp_endpoint_t* dest, tcp_sgmnt_t* res_sgmnt);
@@ -52,19 +56,17 @@ typedef void (*tcp_message_rx_cb_t) (tcp_server_t* tcp, tcp_endpoint_t* dest, tc
 struct __tcp_server_t {
     int sd;
     uint16_t port;
-    int max_sd;
-    fd_set server_fd_set;
+    // Listening and child sockets are non-blocking and watched edge-triggered
+    int epoll_fd;
     tcp_endpoint_t *endpoints;    
     tcp_message_rx_cb_t on_rx;
     tcp_message_tx_cb_t on_tx;
+    void* user_data;
 };
 
 tcp_server_t* tcp_server_start(uint16_t port);
 void tcp_server_stop(tcp_server_t* server);
-void tcp_server_tick(tcp_server_t* server);
-void tcp_server_send(tcp_server_t* server, tcp_endpoint_t* dest, tcp_sgmnt_t* datagram);
-
-void tcp_server_receive(tcp_server_t* server, int child_sd);
-int  tcp_server_accept(tcp_server_t* server);
+// Accept connections and hand received data to on_rx, waiting at most timeout_us (0: never block)
+void tcp_server_poll(tcp_server_t* server, long timeout_us);
 
 #endif // TCP_SOCKET_H
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <unistd.h>
+#include <poll.h>
 #include <pthread.h>
 #if defined(__linux__)
 #include <sys/sysinfo.h>
@@ -11,21 +13,92 @@
 #include "ucp_packet.h"
 #include "udp_socket.h"
 #include "tcp_socket.h"
-#include "linked_list.h"
+#include "send_window.h"
+#include "congestion.h"
+#include "pacer.h"
+#include "rtt_estimator.h"
+#include "checksum.h"
+#include "compress.h"
+#include "fec.h"
 #include <sys/time.h>
-
+#include <sys/random.h>
+#include <time.h>
+
+// Unacknowledged packets each partition may have outstanding before it stops reading the file
+#define SEND_WINDOW_PACKETS     8192
+// How long a partition with nothing in flight waits for others to free room in the shared window
+#define SHARED_WINDOW_WAIT_US   1000
+// Files are not split into partitions smaller than this; below it the handshake and per-partition
+// state cost more than the extra stream gains
+#define PARTITION_MIN_SIZE      (8 * 1024 * 1024)
+// Most partitions, and so sender threads, a transfer uses. Each holds four descriptors.
+#define PARTITION_MAX_COUNT     256
+// Rate one partition is expected to sustain, in Mbps, unless -s says otherwise
+#define PARTITION_STREAM_MBPS   1000
+// Longest control frame the server sends: a NACK carrying the most ranges
+#define CTRL_MESSAGE_MAX_SIZE   (UCP_FRAME_HEADER_SIZE + UCP_NACK_HEADER_SIZE + UCP_NACK_MAX_RANGES * UCP_NACK_RANGE_SIZE)
+// In-band control datagrams taken per receive syscall
+#define CTRL_RECV_BATCH_SIZE    8
+// The metadata is sent again every CONNECT_RETRY_US until the daemon answers, at most
+// CONNECT_ATTEMPTS times
+#define CONNECT_RETRY_US        200000
+#define CONNECT_ATTEMPTS        25
+
+// Everything a sender thread touches while sending lives in its own context. Contexts are
+// cache-line aligned so that neighbouring partitions never write to the same line.
 typedef struct _ucp_client_thread_context {
-    pthread_t thread;
+    _Alignas(CACHE_LINE_SIZE) pthread_t thread;
     struct timeval start_time;
     struct timeval end_time;
     file_io_partition_handle_t* handles;
+    send_window_t* window;
+    rtt_estimator_t rtt;
+    uint64_t timeouts;          // retransmission timer expiries
+    // When the timer fires, everything sent before lost_before_us is taken as lost, and the
+    // timer is not backed off again until backoff_until_us
+    uint64_t lost_before_us;
+    uint64_t backoff_until_us;
+    uint64_t retransmissions;   // packets sent more than once
+    uint64_t packets_created;   // packets read from the file
+    uint64_t syscalls;          // UDP syscalls issued by the thread
+    congestion_t* cc;
+    pacer_clock_t* pacer_clock;
     char* dst_ip;
     char* dst_filename;
+    uint32_t transfer_id;
+    bool use_gso;
+    bool use_txtime;
+    // Builds parity packets when sending with forward error correction, otherwise NULL
+    fec_encoder_t* fec;
+    // A parity packet that did not fit in the batch of the block it covers
+    ucp_packet_t* parity;
+    // Compresses new packets when asked to, otherwise NULL
+    compressor_t* compressor;
+    uint64_t payload_bytes;     // payload bytes read from the file, and sent for them
+    uint64_t compressed_bytes;
+    uint64_t packets_raw;       // packets sent uncompressed while compressing
+    // Set when the daemon has the whole partition
+    bool done;
+    // Digests of the partition as read here and as the daemon wrote it, from its FIN
+    uint64_t digest;
+    uint64_t remote_digest;
+    bool fin_received;
+    // Set once every packet of the partition has been read from the file
+    bool read_all;
+    double max_rate;
+    // Where control messages arrive: a listener the daemon connects back to, or, when it is
+    // NULL, the UDP socket the data leaves from
+    tcp_server_t* tcp_server;
+    bool inband_ctrl;
+    int sock_fd;
+    struct sockaddr_in* remote_addr;
+    // Set once the daemon has answered the metadata
+    bool connected;
+    // Control bytes received but not yet decoded: a message split across TCP reads
+    uint8_t ctrl_buf[CTRL_MESSAGE_MAX_SIZE + sizeof(((tcp_sgmnt_t*)0)->data)];
+    size_t ctrl_len;
 } ucp_client_thread_context_t;
 
-static LinkedList in_flight_packet_list;
-static LinkedList pending_packet_list;
-
 
 // Print the total time taken with the appropriate units
 static void print_time(double time_microseconds) {    
@@ -70,10 +143,10 @@ static double get_total_time_taken(struct timeval start_time, struct timeval end
 }
 
 // Report statistics for the file transfer
-static void report_statistics(ucp_client_thread_context_t *thread_ctx, uint8_t num_threads) {
+static void report_statistics(ucp_client_thread_context_t *thread_ctx, size_t num_threads) {
     //Get smallest start time compared to all threads
     struct timeval start_time = thread_ctx[0].start_time;
-    for (uint8_t i = 1; i < num_threads; i++) {
+    for (size_t i = 1; i < num_threads; i++) {
         if (thread_ctx[i].start_time.tv_sec < start_time.tv_sec) {
             start_time = thread_ctx[i].start_time;
         } else if (thread_ctx[i].start_time.tv_sec == start_time.tv_sec) {
@@ -85,7 +158,7 @@ static void report_statistics(ucp_client_thread_context_t *thread_ctx, uint8_t n
 
     //Get largest end time compared to all threads
     struct timeval end_time = thread_ctx[0].end_time;
-    for (uint8_t i = 1; i < num_threads; i++) {
+    for (size_t i = 1; i < num_threads; i++) {
         if (thread_ctx[i].end_time.tv_sec > end_time.tv_sec) {
             end_time = thread_ctx[i].end_time;
         } else if (thread_ctx[i].end_time.tv_sec == end_time.tv_sec) {
@@ -97,11 +170,11 @@ static void report_statistics(ucp_client_thread_context_t *thread_ctx, uint8_t n
 
     // Get the total number of bytes transferred
     uint64_t total_bytes = 0;
-    for (uint8_t i = 0; i < num_threads; i++) {
+    for (size_t i = 0; i < num_threads; i++) {
         total_bytes += thread_ctx[i].handles->part_size;
     }
     printf("--------------------------------------------------------\n");
-    printf("Total bytes transferred : %llu\n", total_bytes);
+    printf("Total bytes transferred : %llu\n", (unsigned long long)total_bytes);
 
     // Get the total time taken for the file transfer in microseconds
     double total_time = get_total_time_taken(start_time, end_time);
@@ -110,20 +183,39 @@ static void report_statistics(ucp_client_thread_context_t *thread_ctx, uint8_t n
     // Get the transfer rate for the file transfer in bps
     double transfer_rate = get_transfer_rate(total_bytes * 8, total_time);
     print_transfer_rate(transfer_rate);
-    printf("--------------------------------------------------------\n");
-}
 
-// Search for a packet in the in-flight window with the given sequence number
-static LinkedListElem* find_packet(LinkedList* packet_list, uint32_t seq_no) {
-    LinkedListElem* elem = packet_list->anchor.next;
-    while (elem != &(packet_list->anchor)) {
-        ucp_packet_t* packet = (ucp_packet_t*)elem->obj;
-        if (packet->data_packet.seq_no == seq_no) {
-            return elem;
-        }
-        elem = elem->next;
+    // Get the number of UDP syscalls issued, normalised per GB of file data
+    uint64_t syscalls = 0;
+    for (size_t i = 0; i < num_threads; i++) {
+        syscalls += thread_ctx[i].syscalls;
     }
-    return NULL;
+    printf("UDP syscalls\t\t: %llu (batch size %d)\n", (unsigned long long)syscalls, UDP_BATCH_SIZE);
+    if (total_bytes > 0) {
+        printf("UDP syscalls per GB\t: %.0f\n", (double)syscalls * 1e9 / (double)total_bytes);
+    }
+
+    // Round-trip estimates and loss recovery per partition
+    for (size_t i = 0; i < num_threads; i++) {
+        rtt_estimator_t* rtt = &thread_ctx[i].rtt;
+        printf("Partition %zu\t\t: srtt %.3f ms, rttvar %.3f ms, min rtt %.3f ms, rto %.1f ms, %llu retransmissions, %llu timeouts\n",
+               i, rtt->srtt_us / 1e3, rtt->rttvar_us / 1e3, rtt->min_rtt_us / 1e3, rtt->rto_us / 1e3,
+               (unsigned long long)thread_ctx[i].retransmissions, (unsigned long long)thread_ctx[i].timeouts);
+    }
+
+    // Payload bytes sent for those read, first sends only
+    uint64_t payload_bytes = 0;
+    uint64_t compressed_bytes = 0;
+    uint64_t packets_raw = 0;
+    for (size_t i = 0; i < num_threads; i++) {
+        payload_bytes += thread_ctx[i].payload_bytes;
+        compressed_bytes += thread_ctx[i].compressed_bytes;
+        packets_raw += thread_ctx[i].packets_raw;
+    }
+    if (payload_bytes > 0) {
+        printf("Compression\t\t: %.1f%% of payload bytes sent, %llu packets sent uncompressed\n",
+               100.0 * (double)compressed_bytes / (double)payload_bytes, (unsigned long long)packets_raw);
+    }
+    printf("--------------------------------------------------------\n");
 }
 
 int create_socket(int port, struct sockaddr_in *server_addr) {
@@ -144,72 +236,273 @@ int create_socket(int port, struct sockaddr_in *server_addr) {
     return sock_fd;
 }
 
-static int packet_count = 0;
+// Compare what the daemon wrote with what was read, partition by partition. The file's digest is
+// the sum of its partitions'. Returns false if any partition differs or never finished.
+static bool verify_digests(ucp_client_thread_context_t *thread_ctx, size_t num_threads) {
+    bool verified = true;
+    uint64_t file_digest = 0;
+    for (size_t i = 0; i < num_threads; i++) {
+        file_digest += thread_ctx[i].digest;
+        if (thread_ctx[i].handles->part_size == 0) {
+            // Nothing was sent, so both digests are 0 and the thread may stop before the FIN arrives
+            continue;
+        }
+        if (!thread_ctx[i].fin_received) {
+            fprintf(stderr, "Partition %zu was not confirmed by the daemon\n", i);
+            verified = false;
+        } else if (thread_ctx[i].remote_digest != thread_ctx[i].digest) {
+            fprintf(stderr, "Partition %zu failed its integrity check: sent %016llx, written %016llx\n", i,
+                    (unsigned long long)thread_ctx[i].digest, (unsigned long long)thread_ctx[i].remote_digest);
+            verified = false;
+        }
+    }
+    printf("File digest\t\t: %016llx (%s)\n", (unsigned long long)file_digest, verified ? "verified" : "NOT verified");
+    return verified;
+}
+
+// The timeout a packet in the send window is held to. Packets sent before the timer last fired
+// are already known lost, so they expire at once however far the timer has backed off.
+static uint64_t effective_rto_us(ucp_client_thread_context_t* curr_thread, uint64_t now_us) {
+    uint64_t rto_us = curr_thread->rtt.rto_us;
+    if (curr_thread->lost_before_us > 0 && now_us - curr_thread->lost_before_us < rto_us) {
+        rto_us = now_us - curr_thread->lost_before_us;
+    }
+    return rto_us;
+}
 
-static ucp_packet_t *get_next_packet(LinkedList* pending_packet_list, LinkedList* inflight_packet_list, file_io_partition_handle_t *handle) {
-    // If there is a packet in the pending window, return it
-    if (!LinkedListEmpty(pending_packet_list)) {
-        LinkedListElem* elem = LinkedListFirst(pending_packet_list);
-        ucp_packet_t* packet = (ucp_packet_t*)elem->obj;
-        LinkedListUnlink(pending_packet_list, elem);
-        // printf("Sending pending packet: %p\n", elem->obj);
+// Replace a new packet's payload with its compressed form when it shrinks. A packet that
+// references a file mapping has no room of its own, so it is swapped for one that does.
+static ucp_packet_t* compress_packet(compressor_t* compressor, ucp_packet_t* packet) {
+    ucp_data_packet_t* data_packet = &packet->data_packet;
+    uint8_t out[UDP_PACKET_DATA_SIZE];
+    size_t len = compressor_compress(compressor, data_packet->payload, data_packet->seg_len, out);
+    if (len == 0) {
         return packet;
     }
-    // Else, read the next packet from the file and return it
-    ucp_packet_t* file_packet = file_io_get_next_packet(handle);
-    if (file_packet) {
-        packet_count++;
-        // printf("Sending file packet: %p\n", file_packet);
-        return file_packet;
+
+    if (data_packet->payload != data_packet->segment_data) {
+        ucp_packet_t* copy = ucp_packet_init_data(data_packet->seq_no, data_packet->offset, out, len);
+        if (!copy) {
+            return packet;
+        }
+        copy->data_packet.flag = data_packet->flag;
+        ucp_packet_free(packet);
+        packet = copy;
+    } else {
+        memcpy(data_packet->segment_data, out, len);
+        data_packet->seg_len = len;
     }
+    packet->data_packet.compressed = true;
+    return packet;
+}
 
-    if (!LinkedListEmpty(inflight_packet_list)) {
-        LinkedListElem* elem = LinkedListFirst(inflight_packet_list);
-        ucp_packet_t* packet = (ucp_packet_t*)elem->obj;
-        LinkedListUnlink(inflight_packet_list, elem);
-        // printf("Sending in-flight packet: %p\n", packet);
-        return packet;
+// new_budget is what the congestion window leaves for new data. Packets are marked as sent as
+// they are picked, so one batch never holds the same packet twice. timeouts counts the packets
+// picked because their retransmission timer fired.
+static ucp_packet_t *get_next_packet(ucp_client_thread_context_t* curr_thread, size_t* new_budget, uint64_t now_us, uint32_t* timeouts) {
+    send_window_t* window = curr_thread->window;
+
+    // If there is a packet the server reported missing, resend it first
+    ucp_packet_t* packet = send_window_next_pending(window);
+
+    // Else resend a packet that has gone unacknowledged too long: it, its ACK or its NACK was lost
+    if (!packet) {
+        packet = send_window_next_expired(window, now_us, effective_rto_us(curr_thread, now_us));
+        if (packet) {
+            (*timeouts)++;
+        }
     }
 
-    return NULL;
+    // Else, read the next packet from the file while both windows have room for it
+    if (!packet && *new_budget > 0 && !send_window_full(window)) {
+        packet = file_io_get_next_packet(curr_thread->handles);
+        if (packet) {
+            (*new_budget)--;
+            curr_thread->packets_created++;
+            curr_thread->digest += checksum_packet_digest(curr_thread->handles->base_offset + packet->data_packet.offset,
+                                                          packet->data_packet.payload, packet->data_packet.seg_len);
+            // Parity covers the bytes the daemon writes, so it is taken before compression
+            if (curr_thread->fec) {
+                curr_thread->parity = fec_encoder_add(curr_thread->fec, packet);
+            }
+            if (curr_thread->compressor) {
+                packet = compress_packet(curr_thread->compressor, packet);
+            }
+            send_window_insert(window, packet);
+        } else {
+            curr_thread->read_all = true;
+        }
+    }
+
+    if (packet) {
+        send_window_mark_sent(window, packet->data_packet.seq_no, now_us);
+    }
+    return packet;
 }
 
-static int done = 0;
+// Retire everything a SACK covers, one range per run of set bits. Keeps in rtt_sent_us the
+// latest send time among the packets it retired that were only sent once.
+static uint32_t retire_sacked(send_window_t* window, ucp_sack_packet_t* sack, uint64_t* rtt_sent_us) {
+    uint32_t retired = 0;
+    uint64_t sent_us = 0;
+    if (sack->cumulative > 0) {
+        retired += send_window_ack_range(window, 0, sack->cumulative - 1, &sent_us);
+        if (sent_us > *rtt_sent_us) {
+            *rtt_sent_us = sent_us;
+        }
+    }
 
-static void on_ack_received(tcp_server_t* tcp, tcp_endpoint_t* dest, tcp_sgmnt_t* res_sgmnt) {
+    uint32_t base = sack->cumulative + 1;
+    uint32_t bits = (uint32_t)sack->bitmap_len * 8;
+    uint32_t i = 0;
+    while (i < bits) {
+        if (!((sack->bitmap[i / 8] >> (i % 8)) & 1)) {
+            i++;
+            continue;
+        }
+        uint32_t first = i;
+        while (i < bits && ((sack->bitmap[i / 8] >> (i % 8)) & 1)) {
+            i++;
+        }
+        retired += send_window_ack_range(window, base + first, base + i - 1, &sent_us);
+        if (sent_us > *rtt_sent_us) {
+            *rtt_sent_us = sent_us;
+        }
+    }
+    return retired;
+}
 
-    (void)(tcp);
-    (void)(dest);
+// Act on the control frames at the start of buf. Returns the bytes they took up; a frame cut
+// short at the end is left for the caller.
+static size_t handle_ctrl_frames(ucp_client_thread_context_t* curr_thread, uint8_t* buf, size_t buf_len) {
+    send_window_t* window = curr_thread->window;
 
+    uint32_t acked = 0;
+    uint32_t lost = 0;
+    uint64_t rtt_sent_us = 0;
     ucp_packet_t rsp_pkt;
-    ucp_packet_decode(res_sgmnt->data, res_sgmnt->data_len, &rsp_pkt);
-    if (rsp_pkt.type == UCP_PACKET_TYPE_CTRL) {
-        if (rsp_pkt.ctrl_packet.flag == UCP_FLAG_ACK) {
-            // printf("ACK received for %d\n", rsp_pkt.ctrl_packet.seq_no);
-            // If the response is an ACK, drop the packet with the same sequence number from the in-flight window
-            LinkedListElem* elem = find_packet(&in_flight_packet_list, rsp_pkt.ctrl_packet.seq_no);
-            if (elem) {
-                // ucp_packet_free((ucp_packet_t*)elem->obj);
-                LinkedListUnlink(&in_flight_packet_list, elem);
+    size_t offset = 0;
+    while (offset < buf_len) {
+        size_t len = ucp_packet_decode_frame(buf + offset, buf_len - offset, &rsp_pkt);
+        if (len == 0) {
+            if (buf_len - offset >= CTRL_MESSAGE_MAX_SIZE) {
+                // Longer than any frame the server sends: the stream is corrupt, drop what was received
+                fprintf(stderr,"ACK failed\n");
+                offset = buf_len;
+            }
+            break;
+        }
+        // Frames holding messages this client does not know are stepped over
+        offset += len;
+        curr_thread->connected = true;
+
+        if (rsp_pkt.type == UCP_PACKET_TYPE_CTRL) {
+            if (rsp_pkt.ctrl_packet.flag == UCP_FLAG_ACK) {
+                // printf("ACK received for %d\n", rsp_pkt.ctrl_packet.seq_no);
+                // If the response is an ACK, retire the packet from the window and recycle it into the pool
+                uint64_t sent_us = 0;
+                acked += send_window_ack_range(window, rsp_pkt.ctrl_packet.seq_no, rsp_pkt.ctrl_packet.seq_no, &sent_us);
+                if (sent_us > rtt_sent_us) {
+                    rtt_sent_us = sent_us;
+                }
+            } else if (rsp_pkt.ctrl_packet.flag == UCP_FLAG_NACK) {
+                // If the response is a NACK, queue the packet for retransmission
+                // fprintf(stderr, "NACK received. Moving packet to pending window\n");
+                lost += send_window_nack_range(window, rsp_pkt.ctrl_packet.seq_no, rsp_pkt.ctrl_packet.seq_no);
+            } else if (rsp_pkt.ctrl_packet.flag == UCP_FLAG_FIN) {
+                printf("FIN received. Closing socket\n");
+                // If the response is a FIN, close the socket and exit the thread
+                curr_thread->done = true;
+                curr_thread->fin_received = true;
+                curr_thread->remote_digest = rsp_pkt.ctrl_packet.digest;
             }
-        } else if (rsp_pkt.ctrl_packet.flag == UCP_FLAG_NACK) {
-            // If the response is a NACK, move the packet to the pending window
-            // fprintf(stderr, "NACK received. Moving packet to pending window\n");
-            LinkedListElem* elem = find_packet(&in_flight_packet_list, rsp_pkt.ctrl_packet.seq_no);
-            if (elem) {
-                LinkedListAppend(&pending_packet_list, elem->obj);
-                LinkedListUnlink(&in_flight_packet_list, elem);
+        } else if (rsp_pkt.type == UCP_PACKET_TYPE_SACK) {
+            acked += retire_sacked(window, &rsp_pkt.sack_packet, &rtt_sent_us);
+        } else if (rsp_pkt.type == UCP_PACKET_TYPE_NACK) {
+            // fprintf(stderr, "NACK received for %d ranges\n", rsp_pkt.nack_packet.num_ranges);
+            for (uint16_t i = 0; i < rsp_pkt.nack_packet.num_ranges; i++) {
+                lost += send_window_nack_range(window, rsp_pkt.nack_packet.ranges[i].first, rsp_pkt.nack_packet.ranges[i].last);
             }
-        } else if (rsp_pkt.ctrl_packet.flag == UCP_FLAG_FIN) {
-            printf("FIN received. Closing socket\n");
-            // If the response is a FIN, close the socket and exit the thread
-            done = 1;
         }
-    } else {
-        fprintf(stderr,"ACK failed\n");
     }
+
+    // One RTT sample per read, from the most recently sent packet it acknowledged. A send time
+    // after now would wrap around to an enormous sample, so it is skipped.
+    uint64_t rtt_us = 0;
+    uint64_t now_us = congestion_now_us();
+    if (rtt_sent_us > 0 && rtt_sent_us <= now_us) {
+        rtt_us = now_us - rtt_sent_us;
+        rtt_estimator_sample(&curr_thread->rtt, rtt_us);
+    }
+
+    // Only packets not already awaiting retransmission count as new loss
+    if (acked > 0) {
+        congestion_on_ack(curr_thread->cc, acked, rtt_us);
+    }
+    if (lost > 0) {
+        congestion_on_loss(curr_thread->cc, lost);
+        if (curr_thread->fec) {
+            fec_encoder_on_loss(curr_thread->fec, lost);
+        }
+    }
+    return offset;
 }
 
+static void on_ack_received(tcp_server_t* tcp, tcp_endpoint_t* dest, tcp_sgmnt_t* res_sgmnt) {
+
+    (void)(dest);
+    ucp_client_thread_context_t* curr_thread = (ucp_client_thread_context_t*)tcp->user_data;
+
+    // One read usually carries many control frames, and the last may be cut short
+    memcpy(curr_thread->ctrl_buf + curr_thread->ctrl_len, res_sgmnt->data, res_sgmnt->data_len);
+    size_t buf_len = curr_thread->ctrl_len + res_sgmnt->data_len;
+    size_t offset = handle_ctrl_frames(curr_thread, curr_thread->ctrl_buf, buf_len);
+
+    // Keep the incomplete tail for the next read
+    curr_thread->ctrl_len = buf_len - offset;
+    memmove(curr_thread->ctrl_buf, curr_thread->ctrl_buf + offset, curr_thread->ctrl_len);
+}
+
+
+// Act on the control datagrams that have arrived on the UDP socket, waiting at most timeout_us
+// for the first. Each holds whole frames.
+static void receive_inband_ctrl(ucp_client_thread_context_t* curr_thread, long timeout_us) {
+    if (timeout_us > 0) {
+        struct pollfd pfd = { .fd = curr_thread->sock_fd, .events = POLLIN };
+        struct timespec timeout = { .tv_sec = timeout_us / 1000000, .tv_nsec = (timeout_us % 1000000) * 1000 };
+        if (ppoll(&pfd, 1, &timeout, NULL) <= 0) {
+            return;
+        }
+    }
+
+    uint8_t bufs[CTRL_RECV_BATCH_SIZE][UCP_CTRL_DATAGRAM_MAX_SIZE];
+    udp_datagram_t batch[CTRL_RECV_BATCH_SIZE];
+    int count;
+    do {
+        for (int i = 0; i < CTRL_RECV_BATCH_SIZE; i++) {
+            batch[i].buf = bufs[i];
+            batch[i].buf_len = sizeof(bufs[i]);
+        }
+        count = udp_socket_receive_batch(curr_thread->sock_fd, batch, CTRL_RECV_BATCH_SIZE, false);
+        for (int i = 0; i < count; i++) {
+            // Only the daemon's port may steer the window
+            if (batch[i].addr.sin_addr.s_addr != curr_thread->remote_addr->sin_addr.s_addr ||
+                batch[i].addr.sin_port != curr_thread->remote_addr->sin_port) {
+                continue;
+            }
+            handle_ctrl_frames(curr_thread, batch[i].buf, batch[i].data_len);
+        }
+    } while (count == CTRL_RECV_BATCH_SIZE);
+}
+
+// Handle whatever control messages have arrived, waiting at most timeout_us for some (0: never block)
+static void ctrl_poll(ucp_client_thread_context_t* curr_thread, long timeout_us) {
+    if (curr_thread->tcp_server) {
+        tcp_server_poll(curr_thread->tcp_server, timeout_us);
+    } else {
+        receive_inband_ctrl(curr_thread, timeout_us);
+    }
+}
 
 static void* block_thread(void* arg) {
     int sock_fd = -1;
@@ -227,119 +520,436 @@ static void* block_thread(void* arg) {
         return NULL;
     }
 
-    // Create TCP Socket Server with base port + idx
-    tcp_server_t* tcp_server = tcp_server_start(CLIENT_BASE_PORT + handle->idx);
-    tcp_server->on_rx = on_ack_received;
+    // Create TCP Socket Server with base port + idx, unless control comes back in-band
+    tcp_server_t* tcp_server = NULL;
+    if (!curr_thread->inband_ctrl) {
+        tcp_server = tcp_server_start(CLIENT_BASE_PORT + handle->idx);
+        if (!tcp_server) {
+            fprintf(stderr, "Failed to listen for ACKs\n");
+            close(sock_fd);
+            return NULL;
+        }
+        tcp_server->on_rx = on_ack_received;
+        tcp_server->user_data = curr_thread;
+    }
 
     remote_addr->sin_addr.s_addr = inet_addr(curr_thread->dst_ip);
-    remote_addr->sin_port = htons(SERVER_BASE_PORT + handle->idx);
+    // Every partition goes to the same port; the daemon steers each to a core by its index
+    remote_addr->sin_port = htons(SERVER_BASE_PORT);
     remote_addr->sin_family = AF_INET;
-    
+
+    curr_thread->tcp_server = tcp_server;
+    curr_thread->sock_fd = sock_fd;
+    curr_thread->remote_addr = remote_addr;
 
     uint8_t buf[UDP_PACKET_DATA_SIZE + UDP_PACKET_OVERHEAD_MARGIN];
     ucp_packet_t *packet = NULL;
 
-    // TODO: Send the metadata for the thread
-    ucp_packet_t *metadata_packet = ucp_packet_init_metadata(curr_thread->dst_filename, strlen(curr_thread->dst_filename), handle->idx, handle->part_size);
+    ucp_packet_t *metadata_packet = ucp_packet_init_metadata(curr_thread->dst_filename, strlen(curr_thread->dst_filename), handle->idx,
+                                                             handle->part_size, curr_thread->transfer_id, handle->base_offset, handle->file_size);
+    if (curr_thread->inband_ctrl) {
+        metadata_packet->metadata_packet.flags |= UCP_METADATA_FLAG_INBAND_CTRL;
+    }
+    if (curr_thread->fec) {
+        metadata_packet->metadata_packet.flags |= UCP_METADATA_FLAG_FEC;
+    }
     size_t len = ucp_packet_encode(metadata_packet, buf, sizeof(buf));
-    udp_socket_send(sock_fd, remote_addr, (void *)buf, len);
-
-    // Accept a TCP connection from the server
+    ucp_packet_free(metadata_packet);
 
+    // Send the metadata until the daemon answers, by connecting back or with its first SACK,
+    // in case it was lost
     fprintf(stderr, "Waiting for connection\n");
-    while (tcp_server_accept(tcp_server) == 0) {
-        usleep(1000);
+    int attempts = 0;
+    uint64_t retry_us = 0;
+    while (!curr_thread->connected) {
+        uint64_t now_us = congestion_now_us();
+        if (now_us >= retry_us) {
+            if (attempts++ == CONNECT_ATTEMPTS) {
+                fprintf(stderr, "No answer from %s for part %u\n", curr_thread->dst_ip, handle->idx);
+                curr_thread->done = true;
+                break;
+            }
+            udp_socket_send(sock_fd, remote_addr, (void *)buf, len);
+            retry_us = now_us + CONNECT_RETRY_US;
+        }
+        ctrl_poll(curr_thread, (long)(retry_us - now_us));
+        if (tcp_server && tcp_server->endpoints) {
+            curr_thread->connected = true;
+        }
+    }
+
+    if (curr_thread->connected) {
+        printf("Connected to receive ACKs\n");
     }
 
-    printf("Connected to receive ACKs\n");
+    // Encode up to UDP_BATCH_SIZE packet headers before handing them to the socket in one syscall
+    uint8_t send_headers[UDP_BATCH_SIZE][UCP_DATA_HEADER_SIZE];
+    udp_datagram_t batch[UDP_BATCH_SIZE];
+    uint32_t batch_seq_no[UDP_BATCH_SIZE];
+    uint64_t batch_sent_ns[UDP_BATCH_SIZE] = {0};
+    ucp_packet_t* batch_parity[UDP_BATCH_SIZE];
+    for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+        batch[i].buf = send_headers[i];
+        batch[i].buf_len = UCP_DATA_HEADER_SIZE;
+    }
+
+    // All sends go through the pacer, which hands the kernel super-buffers of full-sized
+    // datagrams when segmentation offload is available
+    pacer_t pacer;
+    pacer_init(&pacer, sock_fd, curr_thread->pacer_clock, curr_thread->use_txtime, curr_thread->use_gso, UCP_DATA_HEADER_SIZE + UDP_PACKET_DATA_SIZE);
+
     // Store start time
     gettimeofday(&curr_thread->start_time, NULL);
 
     // Send the data for the thread
-    // Read the next packet from the API
-    while ((packet = get_next_packet(&pending_packet_list, &in_flight_packet_list, handle)) != NULL) {
-        // Send the packet to the server
-        // printf("Sending packet: %p\n", packet);
-        len = ucp_packet_encode(packet, buf, sizeof(buf));
-        udp_socket_send(sock_fd, remote_addr, (void *)buf, len);
-        fprintf(stdout, "Sending seq_no %d\n", packet->data_packet.seq_no);
+    while (!curr_thread->done) {
+        // The shared controller decides how many packets this thread may send now
+        uint64_t wait_us = 0;
+        size_t allowance = congestion_allowance(curr_thread->cc, UDP_BATCH_SIZE, &wait_us);
+        if (allowance == 0) {
+            ctrl_poll(curr_thread, wait_us);
+            continue;
+        }
 
-        // Add the packet to the in-flight window
-        LinkedListAppend(&in_flight_packet_list, packet);
+        // Read the next batch of packets from the API
+        size_t count = 0;
+        uint32_t timeouts = 0;
+        uint64_t now_us = congestion_now_us();
+        size_t new_budget = congestion_window_available(curr_thread->cc);
+        size_t new_budget_start = new_budget;
+        while (count < allowance) {
+            // A parity packet goes out right behind the block it covers. It is never acknowledged
+            // or resent, so it stays out of the send window.
+            ucp_packet_t* parity = curr_thread->parity;
+            curr_thread->parity = NULL;
+            if (parity) {
+                packet = parity;
+            } else {
+                packet = get_next_packet(curr_thread, &new_budget, now_us, &timeouts);
+                if (!packet) {
+                    break;
+                }
+            }
+            batch_parity[count] = parity;
+
+            // Only the header is encoded; the payload is gathered straight from the packet (or file mapping)
+            packet->data_packet.transfer_id = curr_thread->transfer_id;
+            packet->data_packet.part_index = handle->idx;
+            batch[count].data_len = ucp_packet_encode_data_header(packet, batch[count].buf, batch[count].buf_len);
+            batch[count].payload = packet->data_packet.payload;
+            batch[count].payload_len = packet->data_packet.seg_len;
+            batch_seq_no[count] = packet->data_packet.seq_no;
+            count++;
+        }
 
-        tcp_server_tick(tcp_server);
+        if (count == 0) {
+            if (send_window_count(curr_thread->window) == 0) {
+                if (curr_thread->read_all) {
+                    break;
+                }
+                // Other partitions hold the whole shared window; wait for their ACKs to free some
+                ctrl_poll(curr_thread, SHARED_WINDOW_WAIT_US);
+                continue;
+            }
+            // Nothing may go out until an ACK opens a window or a retransmission timer fires
+            uint64_t expiry = send_window_next_expiry(curr_thread->window, effective_rto_us(curr_thread, now_us));
+            ctrl_poll(curr_thread, expiry > now_us ? (long)(expiry - now_us) : 0);
+            continue;
+        }
+        if (timeouts > 0) {
+            // Back off once per expiry, not once per batch of the packets that expired with it;
+            // the rest of them go out over the following batches at the controller's rate
+            if (now_us >= curr_thread->backoff_until_us) {
+                curr_thread->lost_before_us = now_us - effective_rto_us(curr_thread, now_us);
+                rtt_estimator_backoff(&curr_thread->rtt);
+                curr_thread->backoff_until_us = now_us + curr_thread->rtt.rto_us;
+                curr_thread->timeouts++;
+            }
+            congestion_on_loss(curr_thread->cc, timeouts);
+            if (curr_thread->fec) {
+                fec_encoder_on_loss(curr_thread->fec, timeouts);
+            }
+        }
+        congestion_on_sent(curr_thread->cc, count, new_budget_start - new_budget);
 
-        if (done) {
-            break;
+        // Send the batch to the server, spaced out at the congestion controller's rate
+        double rate = congestion_pacing_rate(curr_thread->cc);
+        if (curr_thread->max_rate > 0 && (rate <= 0 || rate > curr_thread->max_rate)) {
+            rate = curr_thread->max_rate;
+        }
+        int sent = pacer_send(&pacer, remote_addr, batch, count, rate, batch_sent_ns);
+
+        // Time RTTs from when each packet was sent, not from when it was picked. Packets that did not
+        // go out keep the time they were picked, so their timer still fires and they are resent.
+        for (size_t i = 0; i < count; i++) {
+            if (batch_parity[i]) {
+                ucp_packet_free(batch_parity[i]);
+            } else if (sent > 0 && i < (size_t)sent) {
+                send_window_restamp(curr_thread->window, batch_seq_no[i], batch_sent_ns[i] / 1000);
+            }
         }
+
+        // Process whatever ACKs have arrived without waiting for more
+        ctrl_poll(curr_thread, 0);
     }
 
-    fprintf(stderr, "Total packets created %d\n", packet_count);
+    fprintf(stderr, "Total packets created %llu\n", (unsigned long long)curr_thread->packets_created);
 
     // Print the number of packets in the in-flight window
-    fprintf(stderr, "In-flight window size: %d\n", in_flight_packet_list.num_members);
+    fprintf(stderr, "In-flight window size: %u\n", send_window_count(curr_thread->window));
 
     // Print the number of packets in the pending window
-    fprintf(stderr, "Pending window size: %d\n", pending_packet_list.num_members);
+    fprintf(stderr, "Pending window size: %u\n", send_window_pending(curr_thread->window));
+
+    // Whatever is still unacknowledged must not hold the other partitions' shared window
+    congestion_on_abandon(curr_thread->cc, send_window_count(curr_thread->window));
 
     close(sock_fd);
+    tcp_server_stop(tcp_server);
+    free(local_addr);
+    free(remote_addr);
 
     gettimeofday(&curr_thread->end_time, NULL);
+    curr_thread->syscalls = udp_socket_syscall_count();
+    curr_thread->retransmissions = curr_thread->window->retransmissions;
+    send_window_destroy(curr_thread->window);
+    curr_thread->window = NULL;
+    if (curr_thread->parity) {
+        ucp_packet_free(curr_thread->parity);
+        curr_thread->parity = NULL;
+    }
+    fec_encoder_destroy(curr_thread->fec);
+    curr_thread->fec = NULL;
+    if (curr_thread->compressor) {
+        curr_thread->payload_bytes = curr_thread->compressor->bytes_in;
+        curr_thread->compressed_bytes = curr_thread->compressor->bytes_out;
+        curr_thread->packets_raw = curr_thread->compressor->packets_raw;
+        compressor_destroy(curr_thread->compressor);
+        curr_thread->compressor = NULL;
+    }
+    ucp_packet_pool_release();
     return NULL;
 }
 
+// Pick how many partitions to send a file_size byte file in: one per online core, but none
+// smaller than PARTITION_MIN_SIZE and, when the total rate is capped at max_mbps, only as many
+// streams of stream_mbps as it takes to reach the cap. Partitions address their bytes with 32-bit
+// offsets, so large files get at least enough to stay within that.
+static size_t choose_partition_count(uint64_t file_size, double stream_mbps, double max_mbps) {
+#if defined(__linux__)
+    size_t count = (size_t)get_nprocs();
+#else
+    size_t count = 1;
+#endif // __linux__
+
+    size_t by_size = (file_size + PARTITION_MIN_SIZE - 1) / PARTITION_MIN_SIZE;
+    if (by_size < count) {
+        count = by_size;
+    }
+    if (max_mbps > 0 && stream_mbps > 0) {
+        size_t by_rate = (size_t)(max_mbps / stream_mbps);
+        if (by_rate * stream_mbps < max_mbps) {
+            by_rate++;
+        }
+        if (by_rate < count) {
+            count = by_rate;
+        }
+    }
+
+    // The last partition also takes the remainder of the split
+    size_t by_offset = file_size / (UINT32_MAX - PARTITION_MAX_COUNT) + 1;
+    if (count < by_offset) {
+        count = by_offset;
+    }
+    if (count < 1) {
+        count = 1;
+    }
+    return count;
+}
+
 static void print_usage(void) {
-    printf("Usage: ucp_client src remote_ip:dst\n");
+    printf("Usage: ucp_client [-g] [-m] [-t] [-u] [-f] [-z] [-c algorithm] [-r mbps] [-n partitions] [-s mbps] src remote_ip:dst\n");
+    printf("  -g  Use UDP segmentation offload (GSO) when the kernel supports it\n");
+    printf("  -m  Memory-map the source and send payloads without copying them\n");
+    printf("  -c  Congestion control algorithm: bbr (default) or none\n");
+    printf("  -t  Pace with SO_TXTIME (needs the fq qdisc) instead of user-space timers\n");
+    printf("  -u  Receive ACKs on the UDP flow the data uses instead of a TCP connection from the daemon\n");
+    printf("  -f  Follow each block of packets with a parity packet, so the daemon can rebuild a lost one\n");
+    printf("  -z  Compress packets, sending those that do not shrink as they are\n");
+    printf("  -r  Never send faster than this many Mbps\n");
+    printf("  -n  Number of partitions to send in parallel (default: chosen from file size, cores and -r)\n");
+    printf("  -s  Rate one partition is expected to sustain in Mbps when choosing the count (default: %d)\n", PARTITION_STREAM_MBPS);
 }
 
 int main(int argc, char** argv) {
 
-    ucp_client_thread_context_t thread_ctx[NUM_THREADS];
+    bool use_gso = false;
+    bool use_mmap = false;
+    bool use_txtime = false;
+    bool inband_ctrl = false;
+    bool use_fec = false;
+    bool use_compression = false;
+    double max_rate = 0;
+    double max_mbps = 0;
+    double stream_mbps = PARTITION_STREAM_MBPS;
+    size_t num_partitions = 0;
+    const char* cc_algorithm = "bbr";
+
     // Parse the command line arguments
-    if (argc != 3) {
+    int opt;
+    while ((opt = getopt(argc, argv, "gmtufzc:r:n:s:")) != -1) {
+        switch (opt) {
+            case 'g':
+                use_gso = true;
+                break;
+            case 'm':
+                use_mmap = true;
+                break;
+            case 't':
+                use_txtime = true;
+                break;
+            case 'u':
+                inband_ctrl = true;
+                break;
+            case 'f':
+                use_fec = true;
+                break;
+            case 'z':
+                use_compression = true;
+                break;
+            case 'c':
+                cc_algorithm = optarg;
+                break;
+            case 'r':
+                // Mbps of full-sized datagrams to datagrams per second
+                max_mbps = atof(optarg);
+                max_rate = max_mbps * 1e6 / 8 / (UCP_DATA_HEADER_SIZE + UDP_PACKET_DATA_SIZE);
+                break;
+            case 'n':
+                num_partitions = (size_t)atoi(optarg);
+                if (num_partitions < 1 || num_partitions > PARTITION_MAX_COUNT) {
+                    fprintf(stderr, "The number of partitions must be between 1 and %d\n", PARTITION_MAX_COUNT);
+                    return -1;
+                }
+                break;
+            case 's':
+                stream_mbps = atof(optarg);
+                break;
+            default:
+                print_usage();
+                return -1;
+        }
+    }
+
+    if (argc - optind != 2) {
         print_usage();
         return -1;
     }
 
-    char* src = argv[1];
+    char* src = argv[optind];
     // TODO: Parse the destination 
-    char* dst = argv[2];
+    char* dst = argv[optind + 1];
     
-    thread_ctx->dst_ip = strdup(strtok(dst, ":"));
-    thread_ctx->dst_filename = strdup(strtok(NULL, ":"));
-    if (!thread_ctx->dst_ip || !thread_ctx->dst_filename) {
+    char* dst_ip = strtok(dst, ":");
+    char* dst_filename = strtok(NULL, ":");
+    if (!dst_ip || !dst_filename) {
         print_usage();
         return -1;
     }
 
-    // Create a window for the in-flight packets
-    memset(&in_flight_packet_list, 0, sizeof(LinkedList));
-    (void)LinkedListInit(&in_flight_packet_list);
+    // One controller paces all partitions, so they share the path instead of competing for it
+    congestion_t* cc = congestion_init(cc_algorithm);
+    if (!cc) {
+        print_usage();
+        return -1;
+    }
+
+    // Likewise one schedule spaces the datagrams of all partitions
+    pacer_clock_t pacer_clock;
+    pacer_clock_init(&pacer_clock);
 
-    // Create a window for the pending packets
-    memset(&pending_packet_list, 0, sizeof(LinkedList));
-    (void)LinkedListInit(&pending_packet_list);
+    // The daemon keys its sessions on our address and this ID, so that a rerun from the same
+    // ports is never mistaken for the transfer before it
+    uint32_t transfer_id = 0;
+    if (getrandom(&transfer_id, sizeof(transfer_id), 0) != sizeof(transfer_id)) {
+        transfer_id = (uint32_t)getpid() ^ (uint32_t)time(NULL);
+    }
+
+    uint64_t file_size = 0;
+    if (!file_io_get_size(src, &file_size)) {
+        return -1;
+    }
+    if (num_partitions == 0) {
+        num_partitions = choose_partition_count(file_size, stream_mbps, max_mbps);
+    }
+    // Give every partition at least one byte, leaving a single empty one for an empty file
+    if (num_partitions > file_size) {
+        num_partitions = file_size > 0 ? (size_t)file_size : 1;
+    }
+    printf("Sending %llu bytes in %zu partitions\n", (unsigned long long)file_size, num_partitions);
 
-    // Split the file into NUM_THREADS blocks
-    file_io_partition_handle_t* handles = file_io_partition_file(src, NUM_THREADS);
+    // Split the file into num_partitions blocks
+    file_io_partition_handle_t* handles = file_io_partition_file(src, num_partitions);
+    ucp_client_thread_context_t* thread_ctx = (ucp_client_thread_context_t*) aligned_alloc(CACHE_LINE_SIZE, num_partitions * sizeof(ucp_client_thread_context_t));
+    if (!handles || !thread_ctx) {
+        fprintf(stderr, "Failed to partition %s\n", src);
+        return -1;
+    }
+    memset(thread_ctx, 0, num_partitions * sizeof(ucp_client_thread_context_t));
 
     // Create a thread for each file block
-    for (uint8_t i = 0; i < NUM_THREADS; i++) {
+    for (size_t i = 0; i < num_partitions; i++) {
         thread_ctx[i].handles = &handles[i];
+        thread_ctx[i].dst_ip = dst_ip;
+        thread_ctx[i].dst_filename = dst_filename;
+        thread_ctx[i].transfer_id = transfer_id;
+        thread_ctx[i].use_gso = use_gso;
+        thread_ctx[i].inband_ctrl = inband_ctrl;
+        thread_ctx[i].connected = false;
+        thread_ctx[i].cc = cc;
+        thread_ctx[i].ctrl_len = 0;
+        thread_ctx[i].done = false;
+        thread_ctx[i].read_all = false;
+        thread_ctx[i].timeouts = 0;
+        thread_ctx[i].lost_before_us = 0;
+        thread_ctx[i].backoff_until_us = 0;
+        thread_ctx[i].retransmissions = 0;
+        rtt_estimator_init(&thread_ctx[i].rtt);
+        thread_ctx[i].pacer_clock = &pacer_clock;
+        thread_ctx[i].use_txtime = use_txtime;
+        thread_ctx[i].max_rate = max_rate;
+        // Each partition numbers its packets from 0, so each gets its own window
+        thread_ctx[i].window = send_window_init(SEND_WINDOW_PACKETS);
+        if (!thread_ctx[i].window) {
+            fprintf(stderr, "Failed to create send window\n");
+            return -1;
+        }
+        if (use_fec && !(thread_ctx[i].fec = fec_encoder_init())) {
+            return -1;
+        }
+        if (use_compression && !(thread_ctx[i].compressor = compressor_init())) {
+            return -1;
+        }
+        if (use_mmap && !file_io_map_partition(&handles[i])) {
+            fprintf(stderr, "Failed to map partition %zu. Falling back to reads\n", i);
+        }
         pthread_create(&thread_ctx[i].thread, NULL, block_thread, &thread_ctx[i]);
     }
 
     // Wait for each thread to close
-    for (uint8_t i = 0; i < NUM_THREADS; i++) {
+    for (size_t i = 0; i < num_partitions; i++) {
         pthread_join(thread_ctx[i].thread, NULL);
     }
 
     // Report statistics for the file transfer
-    report_statistics(thread_ctx, NUM_THREADS);
+    report_statistics(thread_ctx, num_partitions);
+    bool verified = verify_digests(thread_ctx, num_partitions);
 
     // Close the file handles
-    file_io_partition_release(handles, NUM_THREADS);
+    file_io_partition_release(handles, num_partitions);
+    congestion_destroy(cc);
+    free(thread_ctx);
 
-    return 0;
+    return verified ? 0 : -1;
 }
 
@@ -1,20 +1,78 @@
 #include "ucp_packet.h"
+#include "checksum.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
-static ucp_packet_t* ucp_packet_init(ucp_packet_type_t type) {
-    ucp_packet_t* pkt = (ucp_packet_t*) malloc(sizeof(ucp_packet_t));
-    if (!pkt) {
-        perror("malloc");
-        return NULL;
+// Packets are carved from per-thread pools in a few size classes, so that a control packet
+// does not carry a jumbo payload array and steady-state traffic never reaches malloc.
+typedef enum {
+    UCP_PACKET_CLASS_SMALL = 0,  // ctrl, metadata and data packets referencing external payloads
+    UCP_PACKET_CLASS_NACK,       // NACKs, and the smaller SACKs
+    UCP_PACKET_CLASS_DATA,       // data packets with an inline segment_data array
+    UCP_PACKET_NUM_CLASSES
+} ucp_packet_class_t;
+
+// Most blocks of each class a thread keeps for reuse; extra frees go back to malloc
+#define UCP_PACKET_POOL_MAX_FREE    8192
+
+#define UCP_PACKET_HEADER_SIZE      (offsetof(ucp_packet_t, data_packet))
+#define UCP_PACKET_DATA_REF_SIZE    (UCP_PACKET_HEADER_SIZE + offsetof(ucp_data_packet_t, segment_data))
+
+typedef union __ucp_packet_block_t {
+    struct {
+        union __ucp_packet_block_t* next;
+        ucp_packet_class_t size_class;
+    };
+    max_align_t align;
+} ucp_packet_block_t;
+
+static const size_t ucp_packet_class_size[UCP_PACKET_NUM_CLASSES] = {
+    [UCP_PACKET_CLASS_SMALL] = UCP_PACKET_DATA_REF_SIZE > UCP_PACKET_HEADER_SIZE + sizeof(ucp_metadata_packet_t)
+                             ? UCP_PACKET_DATA_REF_SIZE : UCP_PACKET_HEADER_SIZE + sizeof(ucp_metadata_packet_t),
+    [UCP_PACKET_CLASS_NACK]  = UCP_PACKET_HEADER_SIZE + sizeof(ucp_nack_packet_t),
+    [UCP_PACKET_CLASS_DATA]  = sizeof(ucp_packet_t),
+};
+
+_Static_assert(sizeof(ucp_sack_packet_t) <= sizeof(ucp_nack_packet_t), "SACKs are carved from the NACK class");
+
+static _Thread_local ucp_packet_block_t* pool_free_list[UCP_PACKET_NUM_CLASSES];
+static _Thread_local size_t pool_free_count[UCP_PACKET_NUM_CLASSES];
+
+// Get a packet of the given class, zeroing only the first clear_len bytes
+static ucp_packet_t* ucp_packet_alloc(ucp_packet_class_t size_class, ucp_packet_type_t type, size_t clear_len) {
+    ucp_packet_block_t* block = pool_free_list[size_class];
+    if (block) {
+        pool_free_list[size_class] = block->next;
+        pool_free_count[size_class]--;
+    } else {
+        block = (ucp_packet_block_t*) malloc(sizeof(ucp_packet_block_t) + ucp_packet_class_size[size_class]);
+        if (!block) {
+            perror("malloc");
+            return NULL;
+        }
+        block->size_class = size_class;
     }
-    memset(pkt, 0, sizeof(ucp_packet_t));
+    ucp_packet_t* pkt = (ucp_packet_t*)(block + 1);
+    memset(pkt, 0, clear_len);
     pkt->type = type;
     return pkt;
 }
 
+static ucp_packet_t* ucp_packet_init(ucp_packet_type_t type) {
+    if (type == UCP_PACKET_TYPE_DATA || type == UCP_PACKET_TYPE_PARITY) {
+        // segment_data is always overwritten by the caller
+        return ucp_packet_alloc(UCP_PACKET_CLASS_DATA, type, UCP_PACKET_DATA_REF_SIZE);
+    } else if (type == UCP_PACKET_TYPE_NACK) {
+        return ucp_packet_alloc(UCP_PACKET_CLASS_NACK, type, UCP_PACKET_HEADER_SIZE + offsetof(ucp_nack_packet_t, ranges));
+    } else if (type == UCP_PACKET_TYPE_SACK) {
+        return ucp_packet_alloc(UCP_PACKET_CLASS_NACK, type, UCP_PACKET_HEADER_SIZE + offsetof(ucp_sack_packet_t, bitmap));
+    }
+    return ucp_packet_alloc(UCP_PACKET_CLASS_SMALL, type, ucp_packet_class_size[UCP_PACKET_CLASS_SMALL]);
+}
+
 ucp_packet_t* ucp_packet_init_data(uint32_t seq_no, size_t offset, uint8_t* buf, size_t buf_len) {
     ucp_packet_t* pkt = ucp_packet_init(UCP_PACKET_TYPE_DATA);
     if (pkt) {
@@ -22,15 +80,47 @@ ucp_packet_t* ucp_packet_init_data(uint32_t seq_no, size_t offset, uint8_t* buf,
         pkt->data_packet.seg_len = buf_len;
         pkt->data_packet.offset = offset;
         memcpy(pkt->data_packet.segment_data, buf, buf_len);
+        pkt->data_packet.payload = pkt->data_packet.segment_data;
+    }
+    return pkt;
+}
+
+ucp_packet_t* ucp_packet_init_parity(uint32_t first_seq, uint32_t count, const uint8_t* buf, size_t buf_len) {
+    ucp_packet_t* pkt = ucp_packet_init(UCP_PACKET_TYPE_PARITY);
+    if (pkt) {
+        pkt->data_packet.flag = (ucp_flag_data_t)count;
+        pkt->data_packet.seq_no = first_seq;
+        pkt->data_packet.seg_len = buf_len;
+        pkt->data_packet.offset = 0;
+        memcpy(pkt->data_packet.segment_data, buf, buf_len);
+        pkt->data_packet.payload = pkt->data_packet.segment_data;
+    }
+    return pkt;
+}
+
+ucp_packet_t* ucp_packet_init_data_ref(uint32_t seq_no, size_t offset, const uint8_t* buf, size_t buf_len) {
+    // The payload lives outside the packet, so leave off the inline segment_data array
+    ucp_packet_t* pkt = ucp_packet_alloc(UCP_PACKET_CLASS_SMALL, UCP_PACKET_TYPE_DATA, UCP_PACKET_DATA_REF_SIZE);
+    if (!pkt) {
+        return NULL;
     }
+    pkt->data_packet.seq_no = seq_no;
+    pkt->data_packet.seg_len = buf_len;
+    pkt->data_packet.offset = offset;
+    pkt->data_packet.payload = buf;
     return pkt;
 }
 
-ucp_packet_t* ucp_packet_init_metadata(char* dst_name, size_t dst_len, uint8_t part_index, uint32_t part_size) {
+ucp_packet_t* ucp_packet_init_metadata(char* dst_name, size_t dst_len, uint16_t part_index, uint32_t part_size, uint32_t transfer_id,
+                                       uint64_t base_offset, uint64_t file_size) {
     ucp_packet_t* pkt = ucp_packet_init(UCP_PACKET_TYPE_METADATA);
     if (pkt) {
         pkt->metadata_packet.part_index = part_index;
         pkt->metadata_packet.part_size = part_size;
+        pkt->metadata_packet.transfer_id = transfer_id;
+        pkt->metadata_packet.base_offset = base_offset;
+        pkt->metadata_packet.file_size = file_size;
+        pkt->metadata_packet.flags = 0;
         (void) dst_len;
         strncpy(pkt->metadata_packet.desination_name, dst_name, sizeof(pkt->metadata_packet.desination_name) - 1);
     }
@@ -46,22 +136,87 @@ ucp_packet_t* ucp_packet_init_ctrl(uint32_t seq_no, ucp_flag_t flag) {
     return pkt;
 }
 
+ucp_packet_t* ucp_packet_init_nack(void) {
+    return ucp_packet_init(UCP_PACKET_TYPE_NACK);
+}
+
+ucp_packet_t* ucp_packet_init_sack(uint32_t cumulative) {
+    ucp_packet_t* pkt = ucp_packet_init(UCP_PACKET_TYPE_SACK);
+    if (pkt) {
+        pkt->sack_packet.cumulative = cumulative;
+    }
+    return pkt;
+}
+
+bool ucp_packet_nack_add_range(ucp_packet_t* packet, uint32_t first, uint32_t last) {
+    ucp_nack_packet_t* nack_packet = &packet->nack_packet;
+    if (nack_packet->num_ranges >= UCP_NACK_MAX_RANGES) {
+        return false;
+    }
+    nack_packet->ranges[nack_packet->num_ranges].first = first;
+    nack_packet->ranges[nack_packet->num_ranges].last = last;
+    nack_packet->num_ranges++;
+    return true;
+}
+
 void ucp_packet_free(ucp_packet_t* packet) {
-    free(packet);
+    if (!packet) {
+        return;
+    }
+    ucp_packet_block_t* block = (ucp_packet_block_t*)packet - 1;
+    ucp_packet_class_t size_class = block->size_class;
+    if (pool_free_count[size_class] >= UCP_PACKET_POOL_MAX_FREE) {
+        free(block);
+        return;
+    }
+    block->next = pool_free_list[size_class];
+    pool_free_list[size_class] = block;
+    pool_free_count[size_class]++;
 }
 
-static size_t ucp_packet_encode_data(ucp_packet_t* packet, uint8_t *buf, size_t buf_len) {
-    if (!packet || !buf || buf_len < (sizeof(ucp_packet_t)))
+void ucp_packet_pool_release(void) {
+    for (int size_class = 0; size_class < UCP_PACKET_NUM_CLASSES; size_class++) {
+        while (pool_free_list[size_class]) {
+            ucp_packet_block_t* block = pool_free_list[size_class];
+            pool_free_list[size_class] = block->next;
+            free(block);
+        }
+        pool_free_count[size_class] = 0;
+    }
+}
+
+static void ucp_packet_put_u32(uint8_t *buf, uint32_t value) {
+    buf[0] = value & 0xFF;
+    buf[1] = (value >> 8) & 0xFF;
+    buf[2] = (value >> 16) & 0xFF;
+    buf[3] = (value >> 24) & 0xFF;
+}
+
+static uint32_t ucp_packet_get_u32(const uint8_t *buf) {
+    return ((uint32_t)buf[3] << 24) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[1] << 8) | (buf[0]);
+}
+
+static void ucp_packet_put_u64(uint8_t *buf, uint64_t value) {
+    ucp_packet_put_u32(buf, value & 0xFFFFFFFF);
+    ucp_packet_put_u32(buf + 4, value >> 32);
+}
+
+static uint64_t ucp_packet_get_u64(const uint8_t *buf) {
+    return ((uint64_t)ucp_packet_get_u32(buf + 4) << 32) | ucp_packet_get_u32(buf);
+}
+
+size_t ucp_packet_encode_data_header(ucp_packet_t* packet, uint8_t *buf, size_t buf_len) {
+    if (!packet || !buf || buf_len < UCP_DATA_HEADER_SIZE)
         return -1;
 
-    if (packet->type != UCP_PACKET_TYPE_DATA)
+    if (packet->type != UCP_PACKET_TYPE_DATA && packet->type != UCP_PACKET_TYPE_PARITY)
         return -1;
 
     ucp_data_packet_t* data_packet = &packet->data_packet;
 
     buf[0] = packet->type;
 
-    buf[1] = data_packet->flag & 0xFF;
+    buf[1] = (data_packet->flag & 0xFF) | (data_packet->compressed ? UCP_DATA_FLAG_COMPRESSED : 0);
 
     // Insert Seq_no
     buf[2] = data_packet->seq_no & 0xFF;
@@ -78,20 +233,56 @@ static size_t ucp_packet_encode_data(ucp_packet_t* packet, uint8_t *buf, size_t
     buf[10] = data_packet->seg_len & 0xFF;
     buf[11] = (data_packet->seg_len >> 8) & 0xFF;
 
-    // Insert data
-    memcpy(buf + 12, data_packet->segment_data, data_packet->seg_len);
+    // Insert Transfer_id
+    buf[12] = data_packet->transfer_id & 0xFF;
+    buf[13] = (data_packet->transfer_id >> 8) & 0xFF;
+    buf[14] = (data_packet->transfer_id >> 16) & 0xFF;
+    buf[15] = (data_packet->transfer_id >> 24) & 0xFF;
 
-    return 12 + data_packet->seg_len;
+    // Insert Part_index
+    buf[UCP_DATA_PART_INDEX_OFFSET] = data_packet->part_index & 0xFF;
+    buf[UCP_DATA_PART_INDEX_OFFSET + 1] = (data_packet->part_index >> 8) & 0xFF;
+
+    // Insert CRC32C
+    uint32_t crc = checksum_crc32c(0, buf, UCP_DATA_CRC_OFFSET);
+    crc = checksum_crc32c(crc, data_packet->payload, data_packet->seg_len);
+    ucp_packet_put_u32(buf + UCP_DATA_CRC_OFFSET, crc);
 
+    return UCP_DATA_HEADER_SIZE;
 }
 
-static void ucp_packet_decode_data(uint8_t *buf, size_t buf_len, ucp_packet_t* packet) {
-    if (!packet || !buf || buf_len < (sizeof(ucp_packet_t)))
-        return;
+static size_t ucp_packet_encode_data(ucp_packet_t* packet, uint8_t *buf, size_t buf_len) {
+    if (!packet || !buf || buf_len < UCP_DATA_HEADER_SIZE + packet->data_packet.seg_len)
+        return -1;
+
+    size_t len = ucp_packet_encode_data_header(packet, buf, buf_len);
+    if (len != UCP_DATA_HEADER_SIZE)
+        return -1;
+
+    // Insert data
+    memcpy(buf + UCP_DATA_HEADER_SIZE, packet->data_packet.payload, packet->data_packet.seg_len);
+
+    return UCP_DATA_HEADER_SIZE + packet->data_packet.seg_len;
+}
+
+size_t ucp_packet_decode_data_header(uint8_t *buf, size_t buf_len, ucp_packet_t* packet) {
+    if (!packet || !buf || buf_len < UCP_DATA_HEADER_SIZE)
+        return 0;
+
+    // Drop datagrams whose advertised length does not fit in what was received
+    size_t seg_len = (buf[11] << 8) | (buf[10]);
+    if (seg_len > UDP_PACKET_DATA_SIZE || UCP_DATA_HEADER_SIZE + seg_len > buf_len)
+        return 0;
 
     packet->type = buf[0];
 
-    packet->data_packet.flag = buf[1];
+    if (packet->type == UCP_PACKET_TYPE_DATA) {
+        packet->data_packet.flag = buf[1] & ~UCP_DATA_FLAG_COMPRESSED;
+        packet->data_packet.compressed = (buf[1] & UCP_DATA_FLAG_COMPRESSED) != 0;
+    } else {
+        packet->data_packet.flag = buf[1];
+        packet->data_packet.compressed = false;
+    }
 
     // Insert Seq_no
 
@@ -103,11 +294,43 @@ static void ucp_packet_decode_data(uint8_t *buf, size_t buf_len, ucp_packet_t* p
     // fprintf(stderr, "Received Data Pkt: Seq No %d\n", packet->data_packet.seq_no);
 
     // Insert Segment_length
-    packet->data_packet.seg_len = (buf[11] << 8) | (buf[10]);
+    packet->data_packet.seg_len = seg_len;
+
+    // Insert Transfer_id
+    packet->data_packet.transfer_id = ((uint32_t)buf[15] << 24) | (buf[14] << 16) | (buf[13] << 8) | (buf[12]);
+
+    // Insert Part_index
+    packet->data_packet.part_index = (buf[UCP_DATA_PART_INDEX_OFFSET + 1] << 8) | buf[UCP_DATA_PART_INDEX_OFFSET];
+
+    packet->data_packet.payload = buf + UCP_DATA_HEADER_SIZE;
+    return UCP_DATA_HEADER_SIZE + seg_len;
+}
+
+bool ucp_packet_verify_data(const uint8_t *buf, size_t buf_len) {
+    if (!buf || buf_len < UCP_DATA_HEADER_SIZE)
+        return false;
+
+    size_t seg_len = (buf[11] << 8) | (buf[10]);
+    if (seg_len > UDP_PACKET_DATA_SIZE || UCP_DATA_HEADER_SIZE + seg_len > buf_len)
+        return false;
+
+    uint32_t crc = checksum_crc32c(0, buf, UCP_DATA_CRC_OFFSET);
+    crc = checksum_crc32c(crc, buf + UCP_DATA_HEADER_SIZE, seg_len);
+    return crc == ucp_packet_get_u32(buf + UCP_DATA_CRC_OFFSET);
+}
+
+static size_t ucp_packet_decode_data(uint8_t *buf, size_t buf_len, ucp_packet_t* packet) {
+    if (!ucp_packet_verify_data(buf, buf_len))
+        return 0;
+
+    size_t len = ucp_packet_decode_data_header(buf, buf_len, packet);
+    if (len == 0)
+        return 0;
 
     // Insert data
-    memcpy(packet->data_packet.segment_data, buf + 12, packet->data_packet.seg_len);
-    
+    memcpy(packet->data_packet.segment_data, buf + UCP_DATA_HEADER_SIZE, packet->data_packet.seg_len);
+    packet->data_packet.payload = packet->data_packet.segment_data;
+    return len;
 }
 
 static size_t ucp_packet_encode_ctrl_data(ucp_packet_t* packet, uint8_t *buf, size_t buf_len) {
@@ -129,12 +352,19 @@ static size_t ucp_packet_encode_ctrl_data(ucp_packet_t* packet, uint8_t *buf, si
     buf[4] = (ctrl_packet->seq_no >> 16) & 0xFF;
     buf[5] = (ctrl_packet->seq_no >> 24) & 0xFF;
 
-    return 6;
+    if (ctrl_packet->flag != UCP_FLAG_FIN)
+        return 6;
+
+    // Insert Digest
+    if (buf_len < 14)
+        return -1;
+    ucp_packet_put_u64(buf + 6, ctrl_packet->digest);
+    return 14;
 }
 
-void ucp_packet_decode_ctrl_data(uint8_t *buf, size_t buf_len, ucp_packet_t* packet) {
+size_t ucp_packet_decode_ctrl_data(uint8_t *buf, size_t buf_len, ucp_packet_t* packet) {
     if (!packet || !buf || buf_len < 6)
-        return;
+        return 0;
 
     (packet)->type = buf[0];
 
@@ -143,10 +373,97 @@ void ucp_packet_decode_ctrl_data(uint8_t *buf, size_t buf_len, ucp_packet_t* pac
 
     // Insert Seq_no
     packet->ctrl_packet.seq_no = (buf[5] << 24) | (buf[4] << 16) | (buf[3] << 8) | (buf[2]);
+
+    packet->ctrl_packet.digest = 0;
+    if (packet->ctrl_packet.flag != UCP_FLAG_FIN)
+        return 6;
+
+    // Insert Digest
+    if (buf_len < 14)
+        return 0;
+    packet->ctrl_packet.digest = ucp_packet_get_u64(buf + 6);
+    return 14;
+}
+
+static size_t ucp_packet_encode_nack(ucp_packet_t* packet, uint8_t *buf, size_t buf_len) {
+    ucp_nack_packet_t* nack_packet = &packet->nack_packet;
+    if (!buf || buf_len < UCP_NACK_HEADER_SIZE + (size_t)nack_packet->num_ranges * UCP_NACK_RANGE_SIZE)
+        return -1;
+
+    buf[0] = packet->type;
+
+    // Insert Range_count
+    buf[1] = nack_packet->num_ranges & 0xFF;
+    buf[2] = (nack_packet->num_ranges >> 8) & 0xFF;
+
+    // Insert Ranges
+    uint8_t* range = buf + UCP_NACK_HEADER_SIZE;
+    for (uint16_t i = 0; i < nack_packet->num_ranges; i++) {
+        ucp_packet_put_u32(range, nack_packet->ranges[i].first);
+        ucp_packet_put_u32(range + 4, nack_packet->ranges[i].last);
+        range += UCP_NACK_RANGE_SIZE;
+    }
+    return range - buf;
+}
+
+static size_t ucp_packet_decode_nack(uint8_t *buf, size_t buf_len, ucp_packet_t* packet) {
+    if (buf_len < UCP_NACK_HEADER_SIZE)
+        return 0;
+
+    uint16_t num_ranges = (buf[2] << 8) | buf[1];
+    if (num_ranges > UCP_NACK_MAX_RANGES || UCP_NACK_HEADER_SIZE + (size_t)num_ranges * UCP_NACK_RANGE_SIZE > buf_len)
+        return 0;
+
+    packet->type = buf[0];
+    packet->nack_packet.num_ranges = num_ranges;
+    uint8_t* range = buf + UCP_NACK_HEADER_SIZE;
+    for (uint16_t i = 0; i < num_ranges; i++) {
+        packet->nack_packet.ranges[i].first = ucp_packet_get_u32(range);
+        packet->nack_packet.ranges[i].last = ucp_packet_get_u32(range + 4);
+        range += UCP_NACK_RANGE_SIZE;
+    }
+    return range - buf;
+}
+
+static size_t ucp_packet_encode_sack(ucp_packet_t* packet, uint8_t *buf, size_t buf_len) {
+    ucp_sack_packet_t* sack_packet = &packet->sack_packet;
+    if (!buf || sack_packet->bitmap_len > UCP_SACK_MAX_BITMAP || buf_len < UCP_SACK_HEADER_SIZE + (size_t)sack_packet->bitmap_len)
+        return -1;
+
+    buf[0] = packet->type;
+
+    // Insert Cumulative
+    ucp_packet_put_u32(buf + 1, sack_packet->cumulative);
+
+    // Insert Bitmap_length and Bitmap
+    buf[5] = sack_packet->bitmap_len & 0xFF;
+    buf[6] = (sack_packet->bitmap_len >> 8) & 0xFF;
+    memcpy(buf + UCP_SACK_HEADER_SIZE, sack_packet->bitmap, sack_packet->bitmap_len);
+
+    return UCP_SACK_HEADER_SIZE + sack_packet->bitmap_len;
+}
+
+static size_t ucp_packet_decode_sack(uint8_t *buf, size_t buf_len, ucp_packet_t* packet) {
+    if (buf_len < UCP_SACK_HEADER_SIZE)
+        return 0;
+
+    uint16_t bitmap_len = (buf[6] << 8) | buf[5];
+    if (bitmap_len > UCP_SACK_MAX_BITMAP || UCP_SACK_HEADER_SIZE + (size_t)bitmap_len > buf_len)
+        return 0;
+
+    packet->type = buf[0];
+    packet->sack_packet.cumulative = ucp_packet_get_u32(buf + 1);
+    packet->sack_packet.bitmap_len = bitmap_len;
+    memcpy(packet->sack_packet.bitmap, buf + UCP_SACK_HEADER_SIZE, bitmap_len);
+    return UCP_SACK_HEADER_SIZE + bitmap_len;
 }
 
+// type, part_index, part_size, destination name, transfer_id, base_offset, file_size and flags
+#define UCP_METADATA_NAME_OFFSET    7
+#define UCP_METADATA_SIZE           (UCP_METADATA_NAME_OFFSET + sizeof(((ucp_metadata_packet_t*)0)->desination_name) + 21)
+
 static size_t ucp_packet_encode_meta_data(ucp_packet_t* packet, uint8_t *buf, size_t buf_len) {
-    if (!packet || !buf || buf_len < (sizeof(ucp_packet_t)))
+    if (!packet || !buf || buf_len < UCP_METADATA_SIZE)
         return -1;
 
     if (packet->type != UCP_PACKET_TYPE_METADATA)
@@ -157,35 +474,52 @@ static size_t ucp_packet_encode_meta_data(ucp_packet_t* packet, uint8_t *buf, si
     buf[0] = packet->type & 0xFF;
 
     // Insert Part_index
-    buf[1] = metadata_packet->part_index & 0xFF;
+    buf[UCP_METADATA_PART_INDEX_OFFSET] = metadata_packet->part_index & 0xFF;
+    buf[UCP_METADATA_PART_INDEX_OFFSET + 1] = (metadata_packet->part_index >> 8) & 0xFF;
 
     // Insert Part_size
-    buf[2] = (metadata_packet->part_size >> 24) & 0xFF;
-    buf[3] = (metadata_packet->part_size >> 16) & 0xFF;
-    buf[4] = (metadata_packet->part_size >> 8) & 0xFF;
-    buf[5] = (metadata_packet->part_size >> 0) & 0xFF;
+    buf[3] = (metadata_packet->part_size >> 24) & 0xFF;
+    buf[4] = (metadata_packet->part_size >> 16) & 0xFF;
+    buf[5] = (metadata_packet->part_size >> 8) & 0xFF;
+    buf[6] = (metadata_packet->part_size >> 0) & 0xFF;
 
     // Insert Destination_name
-    memcpy(buf + 6, metadata_packet->desination_name, sizeof(metadata_packet->desination_name));
-    return 6 + sizeof(metadata_packet->desination_name);
+    memcpy(buf + UCP_METADATA_NAME_OFFSET, metadata_packet->desination_name, sizeof(metadata_packet->desination_name));
+
+    // Insert Transfer_id
+    uint8_t* tail = buf + UCP_METADATA_NAME_OFFSET + sizeof(metadata_packet->desination_name);
+    ucp_packet_put_u32(tail, metadata_packet->transfer_id);
+
+    // Insert Base_offset and File_size
+    ucp_packet_put_u64(tail + 4, metadata_packet->base_offset);
+    ucp_packet_put_u64(tail + 12, metadata_packet->file_size);
+    tail[20] = metadata_packet->flags;
+    return UCP_METADATA_SIZE;
 }
 
-void ucp_packet_decode_meta_data(uint8_t *buf, size_t buf_len, ucp_packet_t* packet) {
-    if (!packet || !buf || buf_len < (sizeof(ucp_packet_t)))
-        return;
+size_t ucp_packet_decode_meta_data(uint8_t *buf, size_t buf_len, ucp_packet_t* packet) {
+    if (!packet || !buf || buf_len < UCP_METADATA_SIZE)
+        return 0;
 
     (packet)->type = buf[0];
 
     // Insert Part_index
-    packet->metadata_packet.part_index = buf[1];
+    packet->metadata_packet.part_index = (buf[UCP_METADATA_PART_INDEX_OFFSET + 1] << 8) | buf[UCP_METADATA_PART_INDEX_OFFSET];
 
-    packet->metadata_packet.part_size = (buf[2] << 24 );
-    packet->metadata_packet.part_size = (buf[3] << 16 ) | packet->metadata_packet.part_size;
-    packet->metadata_packet.part_size = (buf[4] << 8 ) | packet->metadata_packet.part_size;
-    packet->metadata_packet.part_size = (buf[5] << 0 ) | packet->metadata_packet.part_size;
+    packet->metadata_packet.part_size = ((uint32_t)buf[3] << 24) | (buf[4] << 16) | (buf[5] << 8) | buf[6];
 
     // Insert Destination_name
-    memcpy(packet->metadata_packet.desination_name, buf + 6, sizeof(packet->metadata_packet.desination_name));
+    memcpy(packet->metadata_packet.desination_name, buf + UCP_METADATA_NAME_OFFSET, sizeof(packet->metadata_packet.desination_name));
+
+    // Insert Transfer_id
+    uint8_t* tail = buf + UCP_METADATA_NAME_OFFSET + sizeof(packet->metadata_packet.desination_name);
+    packet->metadata_packet.transfer_id = ucp_packet_get_u32(tail);
+
+    // Insert Base_offset and File_size
+    packet->metadata_packet.base_offset = ucp_packet_get_u64(tail + 4);
+    packet->metadata_packet.file_size = ucp_packet_get_u64(tail + 12);
+    packet->metadata_packet.flags = tail[20];
+    return UCP_METADATA_SIZE;
 }
 
 size_t ucp_packet_encode(ucp_packet_t* packet, uint8_t *buf, size_t buf_len) {
@@ -198,23 +532,63 @@ size_t ucp_packet_encode(ucp_packet_t* packet, uint8_t *buf, size_t buf_len) {
         return ucp_packet_encode_ctrl_data(packet, buf, buf_len);
     } else if (packet->type == UCP_PACKET_TYPE_METADATA) {
         return ucp_packet_encode_meta_data(packet, buf, buf_len);
+    } else if (packet->type == UCP_PACKET_TYPE_NACK) {
+        return ucp_packet_encode_nack(packet, buf, buf_len);
+    } else if (packet->type == UCP_PACKET_TYPE_SACK) {
+        return ucp_packet_encode_sack(packet, buf, buf_len);
     }
     return -2;
 }
 
-void ucp_packet_decode(uint8_t *buf, size_t buf_len, ucp_packet_t* packet) {
-    if (!packet) {
-        return;
+size_t ucp_packet_decode(uint8_t *buf, size_t buf_len, ucp_packet_t* packet) {
+    if (!packet || !buf || buf_len == 0) {
+        return 0;
     }
     if (buf[0] == UCP_PACKET_TYPE_DATA) {
         // fprintf(stderr, "Received Data Pkt\n");
-        ucp_packet_decode_data(buf, buf_len, packet);
+        return ucp_packet_decode_data(buf, buf_len, packet);
     } else if (buf[0] == UCP_PACKET_TYPE_METADATA) {
         // fprintf(stderr, "Received <MEta> Pkt\n");
-        ucp_packet_decode_meta_data(buf, buf_len, packet);
+        return ucp_packet_decode_meta_data(buf, buf_len, packet);
     } else if (buf[0] == UCP_PACKET_TYPE_CTRL) {
         // fprintf(stderr, "Received Ctrl Pkt\n");
-        ucp_packet_decode_ctrl_data(buf, buf_len, packet);
+        return ucp_packet_decode_ctrl_data(buf, buf_len, packet);
+    } else if (buf[0] == UCP_PACKET_TYPE_NACK) {
+        return ucp_packet_decode_nack(buf, buf_len, packet);
+    } else if (buf[0] == UCP_PACKET_TYPE_SACK) {
+        return ucp_packet_decode_sack(buf, buf_len, packet);
+    }
+    return 0;
+}
+
+size_t ucp_packet_encode_frame(ucp_packet_t* packet, uint8_t *buf, size_t buf_len) {
+    if (!packet || !buf || buf_len <= UCP_FRAME_HEADER_SIZE) {
+        return 0;
+    }
+    // The encoders return (size_t)-1 when the packet does not fit
+    size_t len = ucp_packet_encode(packet, buf + UCP_FRAME_HEADER_SIZE, buf_len - UCP_FRAME_HEADER_SIZE);
+    if (len == 0 || len > buf_len - UCP_FRAME_HEADER_SIZE || len > UINT16_MAX) {
+        return 0;
+    }
+
+    // Insert Frame_length
+    buf[0] = len & 0xFF;
+    buf[1] = (len >> 8) & 0xFF;
+    return UCP_FRAME_HEADER_SIZE + len;
+}
+
+size_t ucp_packet_decode_frame(uint8_t *buf, size_t buf_len, ucp_packet_t* packet) {
+    if (!packet || !buf || buf_len < UCP_FRAME_HEADER_SIZE) {
+        return 0;
+    }
+    size_t len = (buf[1] << 8) | buf[0];
+    if (buf_len - UCP_FRAME_HEADER_SIZE < len) {
+        return 0;
+    }
+
+    packet->type = 0;
+    if (ucp_packet_decode(buf + UCP_FRAME_HEADER_SIZE, len, packet) != len) {
+        packet->type = 0;
     }
-    return;
+    return UCP_FRAME_HEADER_SIZE + len;
 }
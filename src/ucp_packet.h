@@ -1,6 +1,7 @@
 #ifndef UCP_PACKET_H
 #define UCP_PACKET_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -10,6 +11,9 @@ typedef enum {
     UCP_PACKET_TYPE_CTRL = 0x01,
     UCP_PACKET_TYPE_DATA = 0x02,
     UCP_PACKET_TYPE_METADATA = 0x03,
+    UCP_PACKET_TYPE_NACK = 0x04,
+    UCP_PACKET_TYPE_SACK = 0x05,
+    UCP_PACKET_TYPE_PARITY = 0x06,
 } ucp_packet_type_t;
 
 typedef enum {
@@ -24,23 +28,85 @@ typedef enum {
     UCP_FLAG_DATA_END
 } ucp_flag_data_t;
 
+// type, flag, seq_no, offset, seg_len, transfer_id, part_index and a CRC32C precede the segment data on
+// the wire. Parity packets share the header: flag holds how many data packets they cover, from seq_no on.
+#define UCP_DATA_HEADER_SIZE    22
+// Where the CRC32C sits in an encoded data header. It covers the bytes before it and the segment data.
+#define UCP_DATA_CRC_OFFSET     18
+// Set in the flag byte of a data packet whose segment data is compressed. offset and the length
+// the daemon writes are those of the original data; seg_len is the compressed length.
+#define UCP_DATA_FLAG_COMPRESSED    0x80
+// Where part_index sits in an encoded data header, for steering datagrams before they are decoded
+#define UCP_DATA_PART_INDEX_OFFSET  16
+// Where the little-endian 16-bit part_index sits in an encoded metadata packet
+#define UCP_METADATA_PART_INDEX_OFFSET  1
+
 typedef struct __ucp_data_packet_t {
     ucp_flag_data_t flag;
     uint32_t        seq_no;
     uint32_t        offset;
     size_t        seg_len;
+    // Chosen by the client for each run, so that the daemon can tell concurrent transfers apart
+    uint32_t        transfer_id;
+    uint16_t        part_index;
+    bool            compressed;
+    // Bytes to send: segment_data, or memory owned elsewhere (e.g. a mapped file)
+    const uint8_t*  payload;
     uint8_t         segment_data[UDP_PACKET_DATA_SIZE];
 } ucp_data_packet_t;
 
 typedef struct __ucp_ctrl_packet_t {
     uint32_t    seq_no;
     ucp_flag_t  flag;
+    // A FIN carries the digest of the partition as the daemon wrote it (see checksum.h)
+    uint64_t    digest;
 } ucp_ctrl_packet_t;
 
+// A NACK carries runs of missing sequence numbers. Encoded as type, a 16-bit range
+// count, then the first and last sequence number of each range, so that it fits in
+// a single TCP segment.
+#define UCP_NACK_HEADER_SIZE    3
+#define UCP_NACK_RANGE_SIZE     8
+#define UCP_NACK_MAX_RANGES     127
+
+typedef struct __ucp_seq_range_t {
+    uint32_t first;
+    uint32_t last;
+} ucp_seq_range_t;
+
+typedef struct __ucp_nack_packet_t {
+    uint16_t        num_ranges;
+    ucp_seq_range_t ranges[UCP_NACK_MAX_RANGES];
+} ucp_nack_packet_t;
+
+// A SACK acknowledges every sequence number below cumulative, and those after it set in a
+// bitmap: bit i of byte j stands for cumulative + 1 + 8 * j + i. Encoded as type, cumulative,
+// a 16-bit bitmap length in bytes, then the bitmap, which is cut after its last set bit.
+#define UCP_SACK_HEADER_SIZE    7
+#define UCP_SACK_MAX_BITMAP     128
+
+typedef struct __ucp_sack_packet_t {
+    uint32_t    cumulative;
+    uint16_t    bitmap_len;
+    uint8_t     bitmap[UCP_SACK_MAX_BITMAP];
+} ucp_sack_packet_t;
+
+typedef enum {
+    // Control messages come back on the UDP flow the data uses, not on a TCP connection
+    UCP_METADATA_FLAG_INBAND_CTRL = 0x01,
+    // Data is followed by parity packets, so losses are only reported once parity is in
+    UCP_METADATA_FLAG_FEC = 0x02,
+} ucp_metadata_flag_t;
+
 typedef struct __ucp_metadata_packet_t {
     char desination_name[20];
-    uint8_t part_index;
+    uint16_t part_index;
     uint32_t part_size;
+    uint32_t transfer_id;
+    // Where the partition starts in the destination, and how large the whole file is
+    uint64_t base_offset;
+    uint64_t file_size;
+    uint8_t flags;
 } ucp_metadata_packet_t;
 
 typedef struct __ucp_packet_t {
@@ -49,19 +115,68 @@ typedef struct __ucp_packet_t {
         ucp_ctrl_packet_t ctrl_packet;
         ucp_data_packet_t data_packet;
         ucp_metadata_packet_t metadata_packet;
+        ucp_nack_packet_t nack_packet;
+        ucp_sack_packet_t sack_packet;
     };
 } ucp_packet_t;
 
-ucp_packet_t* ucp_packet_init_metadata(char* dst_name, size_t dst_len, uint8_t part_index, uint32_t part_size);
+ucp_packet_t* ucp_packet_init_metadata(char* dst_name, size_t dst_len, uint16_t part_index, uint32_t part_size, uint32_t transfer_id,
+                                       uint64_t base_offset, uint64_t file_size);
 
 ucp_packet_t* ucp_packet_init_data(uint32_t seq_no, size_t offset, uint8_t* buf, size_t buf_len);
 
+// Create a data packet that references buf instead of copying it. buf must outlive the packet.
+ucp_packet_t* ucp_packet_init_data_ref(uint32_t seq_no, size_t offset, const uint8_t* buf, size_t buf_len);
+
 ucp_packet_t* ucp_packet_init_ctrl(uint32_t seq_no, ucp_flag_t flag);
 
+// Create a parity packet for the count data packets from first_seq on, copying buf
+ucp_packet_t* ucp_packet_init_parity(uint32_t first_seq, uint32_t count, const uint8_t* buf, size_t buf_len);
+
+// Create an empty NACK. Ranges are added with ucp_packet_nack_add_range.
+ucp_packet_t* ucp_packet_init_nack(void);
+
+// Append a range of missing sequence numbers. Returns false when the NACK is full.
+bool ucp_packet_nack_add_range(ucp_packet_t* packet, uint32_t first, uint32_t last);
+
+// Create a SACK for everything below cumulative. The caller fills in the bitmap.
+ucp_packet_t* ucp_packet_init_sack(uint32_t cumulative);
+
+// Return a packet to the calling thread's pool
 void ucp_packet_free(ucp_packet_t* packet);
 
+// Free the packets cached in the calling thread's pool. Call before a thread exits.
+void ucp_packet_pool_release(void);
+
 size_t ucp_packet_encode(ucp_packet_t* packet, uint8_t *buf, size_t buf_len);
 
-void ucp_packet_decode(uint8_t *buf, size_t buf_len, ucp_packet_t* packet);
+// Encode only the header of a data or parity packet. The caller sends data_packet.payload after it.
+size_t ucp_packet_encode_data_header(ucp_packet_t* packet, uint8_t *buf, size_t buf_len);
+
+// Decode only the header of a data or parity packet. data_packet.payload is left pointing into buf rather
+// than copied, so buf must outlive the packet. Returns the size of the whole packet, or 0. The CRC is
+// not checked, so that datagrams can be steered cheaply; check it with ucp_packet_verify_data.
+size_t ucp_packet_decode_data_header(uint8_t *buf, size_t buf_len, ucp_packet_t* packet);
+
+// True if the data or parity packet at the start of buf is complete and matches its CRC
+bool ucp_packet_verify_data(const uint8_t *buf, size_t buf_len);
+
+// Decode the packet at the start of buf. Returns the number of bytes it occupied, or 0 if buf
+// does not start with a complete, valid packet.
+size_t ucp_packet_decode(uint8_t *buf, size_t buf_len, ucp_packet_t* packet);
+
+// Control messages on the TCP stream are framed as a little-endian 16-bit length followed by the
+// encoded packet, so that a reader can take many per read and step over ones it does not know
+#define UCP_FRAME_HEADER_SIZE   2
+
+// Control messages carried in-band go as datagrams of whole frames, no larger than a data datagram
+#define UCP_CTRL_DATAGRAM_MAX_SIZE  (UCP_DATA_HEADER_SIZE + UDP_PACKET_DATA_SIZE)
+
+// Encode packet as one frame. Returns the size of the frame, or 0 if it does not fit in buf.
+size_t ucp_packet_encode_frame(ucp_packet_t* packet, uint8_t *buf, size_t buf_len);
+
+// Decode the frame at the start of buf. Returns its size once all of it is in buf, or 0 while it is
+// incomplete. packet->type is left 0 if the frame holds a message that could not be decoded.
+size_t ucp_packet_decode_frame(uint8_t *buf, size_t buf_len, ucp_packet_t* packet);
 
 #endif // UCP_PACKET_H
@@ -1,88 +1,135 @@
+#define _GNU_SOURCE
 #include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <string.h>
 #include <stdio.h>
+#include <signal.h>
+#include <time.h>
 #if defined(__linux__)
 #include <sys/sysinfo.h>
 #endif // __linux__
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "defines.h"
-#include "linked_list.h"
 #include "udp_socket.h"
 #include "tcp_socket.h"
 #include "ucp_packet.h"
 #include "file_io.h"
 #include "sequencer.h"
+#include "checksum.h"
+#include "compress.h"
+#include "fec.h"
+#include "spsc_ring.h"
+#include "session_table.h"
 
-typedef struct __ucp_server_thread_context {
-    pthread_t rcv_thread;
-    pthread_t seq_thread;
+// Most transfer partitions each receive path serves at once; metadata for further ones is ignored
+#define DAEMON_MAX_SESSIONS         256
+// Memory set aside for receive buffers on each receive path, shared by its sessions
+#define DAEMON_RECV_MEMORY          (64 * 1024 * 1024)
+// Most receive buffer memory one session may hold while its worker catches up. Datagrams
+// beyond it are dropped and recovered by the client, so that one fast sender cannot starve
+// the others.
+#define SESSION_MEMORY_BUDGET       (32 * 1024 * 1024)
+// Sessions that receive nothing for this long are torn down
+#define SESSION_IDLE_TIMEOUT_US     (30 * 1000000ULL)
+// Finished sessions whose control goes in-band are kept until quiet for this long, to answer
+// a client that missed the final SACK or the FIN
+#define SESSION_LINGER_US           (5 * 1000000ULL)
+// How often finished and idle sessions are looked for
+#define DAEMON_REAP_INTERVAL_MS     1000
+// Receive batches taken per wakeup before the event loop checks its other sources
+#define DAEMON_RECV_ROUNDS          8
+// Items a worker handles per wakeup
+#define WORKER_BATCH_SIZE           256
+// How long a worker spins on an empty queue before sleeping
+#define WORKER_SPIN_US              50
+// A session acknowledges at least every this many data packets...
+#define SESSION_ACK_EVERY           64
+// ...and holds back an acknowledgement no longer than this while its worker stays busy
+#define SESSION_ACK_DELAY_US        1000
+// Losses left to parity are reported anyway once parity has covered nothing new for this long,
+// in case the parity packet itself was lost
+#define SESSION_FEC_WAIT_US         (20 * 1000)
+
+// Control messages for one client, framed back to back so that a batch goes out in one send().
+// They go over the reverse TCP connection, or, when client is NULL, as datagrams from the
+// daemon's UDP socket back to the address the data comes from.
+typedef struct __ctrl_writer_t {
     tcp_client_t* client;
-    uint16_t client_port;
     int udp_fd;
-    LinkedList seq_queue;
-    file_io_partition_handle_t handle;
-} ucp_server_thread_context_t;
-
-static void send_ctrl_packet(uint32_t seq_no, ucp_flag_t flag, void* arg) {
-    uint8_t buf[10];
-    tcp_sgmnt_t sgmnt;
-    tcp_client_t* client = (tcp_client_t*)arg;
-
-    ucp_packet_t *ctrl_packet = ucp_packet_init_ctrl(seq_no, flag);
-    sgmnt.data_len = ucp_packet_encode(ctrl_packet, buf, sizeof(buf));
-    memcpy(sgmnt.data, buf, sgmnt.data_len);
-    
-    tcp_client_send(client, &sgmnt);
-    ucp_packet_free(ctrl_packet);
-}
-
+    struct sockaddr_in addr;
+    size_t capacity;                // most bytes sent at once
+    tcp_sgmnt_t out;
+} ctrl_writer_t;
 
-static void send_ack(uint32_t seq_no, void* arg) {
-    send_ctrl_packet(seq_no, UCP_FLAG_ACK, arg);
-}
-
-static void send_nack(uint32_t seq_no, void* arg) {
-    send_ctrl_packet(seq_no, UCP_FLAG_NACK, arg);
+// Send the queued control messages
+static void ctrl_flush(ctrl_writer_t* writer) {
+    if (writer->out.data_len > 0) {
+        if (writer->client) {
+            tcp_client_send(writer->client, &writer->out);
+        } else if (udp_socket_send(writer->udp_fd, &writer->addr, writer->out.data, writer->out.data_len) < 0) {
+            perror("sendto");
+        }
+        writer->out.data_len = 0;
+    }
 }
 
-static void send_fin(uint32_t seq_no, void* arg) {
-    send_ctrl_packet(seq_no, UCP_FLAG_FIN, arg);
+// Queue a control message, first sending what is queued if it does not fit
+static void ctrl_queue(ctrl_writer_t* writer, ucp_packet_t* packet) {
+    size_t len = ucp_packet_encode_frame(packet, writer->out.data + writer->out.data_len, writer->capacity - writer->out.data_len);
+    if (len == 0) {
+        ctrl_flush(writer);
+        len = ucp_packet_encode_frame(packet, writer->out.data, writer->capacity);
+    }
+    writer->out.data_len += len;
 }
 
-
-typedef struct __socket_ctx {
-    int sock_fd;
-    struct sockaddr_in* client_addr;
-} socket_ctx_t;
-
-static void send_ctrl_packet(uint16_t seq_no, ucp_flag_t flag, void* arg) {
-    socket_ctx_t* ctx = (socket_ctx_t*)arg;
+static void queue_ctrl_packet(ctrl_writer_t* writer, uint32_t seq_no, ucp_flag_t flag) {
     ucp_packet_t *ctrl_packet = ucp_packet_init_ctrl(seq_no, flag);
-    uint8_t buf[5];
-    size_t len = ucp_packet_encode(ctrl_packet, buf, sizeof(buf));
-    // Print client address
-    // printf("Client address: %s\n", inet_ntoa(ctx->client_addr->sin_addr));
-    udp_socket_send(ctx->sock_fd, ctx->client_addr, (void *)buf, len);
-    ucp_packet_free(ctrl_packet);
+    if (ctrl_packet) {
+        ctrl_queue(writer, ctrl_packet);
+        ucp_packet_free(ctrl_packet);
+    }
 }
 
-static void send_ack(uint16_t seq_no, void* arg) {
-    // printf("Received %d\n", seq_no);
-    send_ctrl_packet(seq_no, UCP_FLAG_ACK, arg);
-}
+typedef struct __nack_ctx_t {
+    ctrl_writer_t* writer;
+    ucp_packet_t* nack;
+    uint32_t limit;                 // packets from here on are not reported yet
+    bool held;                      // missing packets past limit were left out
+} nack_ctx_t;
 
-static void send_nack(uint16_t seq_no, void* arg) {
-    send_ctrl_packet(seq_no, UCP_FLAG_NACK, arg);
+// Queue the ranges gathered so far as one NACK and start a new one
+static void flush_nack(nack_ctx_t* ctx) {
+    if (ctx->nack->nack_packet.num_ranges > 0) {
+        ctrl_queue(ctx->writer, ctx->nack);
+        ctx->nack->nack_packet.num_ranges = 0;
+    }
 }
 
-static void send_fin(uint16_t seq_no, void* arg) {
-    // fprintf(stderr, "Completed. Sending FIN. \n");
-    send_ctrl_packet(seq_no, UCP_FLAG_FIN, arg);
+static void add_nack_range(uint32_t first, uint32_t last, void* arg) {
+    nack_ctx_t* ctx = (nack_ctx_t*)arg;
+    if (last >= ctx->limit) {
+        ctx->held = true;
+        if (first >= ctx->limit) {
+            return;
+        }
+        last = ctx->limit - 1;
+    }
+    if (!ucp_packet_nack_add_range(ctx->nack, first, last)) {
+        flush_nack(ctx);
+        ucp_packet_nack_add_range(ctx->nack, first, last);
+    }
 }
 
 
@@ -105,158 +152,1094 @@ int create_udp_socket_and_bind(int port, struct sockaddr_in *server_addr) {
     return sock_fd;
 }
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-
-typedef struct __sequencing_queue_item_t {
-    uint32_t seq_no;
-    ucp_flag_t flag;
-    bool is_last;
-} sequencing_queue_item_t;
-
-static void sequencing_queue_push(LinkedList* queue, uint32_t seq_no, ucp_flag_t flag, bool is_last) {
-    pthread_mutex_lock(&mutex);
-    sequencing_queue_item_t* item = (sequencing_queue_item_t*)malloc(sizeof(sequencing_queue_item_t));
-    item->seq_no = seq_no;
-    item->flag = flag;
-    item->is_last = is_last;
-    LinkedListAppend(queue, (void*)item);
-    pthread_mutex_unlock(&mutex);
-}
-
-static int sequencing_queue_pop(LinkedList* queue, uint32_t* seq_no, ucp_flag_t* flag, bool* is_last) {
-    int ret = 0;
-    pthread_mutex_lock(&mutex);
-    LinkedListElem* elem = LinkedListFirst(queue);
-    if (elem) {
-        sequencing_queue_item_t* item = (sequencing_queue_item_t*)elem->obj;
-        *seq_no = item->seq_no;
-        *flag = item->flag;
-        *is_last = item->is_last;
-        LinkedListUnlink(queue, elem);
-        free(item);
-        ret = 1;
-    }
-    pthread_mutex_unlock(&mutex);
-    return ret;
-}
-
-static void* receiving_thread(void* arg) {    
-    ucp_server_thread_context_t* curr_thread = (ucp_server_thread_context_t*)arg;
-    uint8_t recv_buffer[UDP_PACKET_SIZE] = {0};
-    ucp_packet_t rcv_pkt = {0};
-    struct sockaddr_in* client_addr = (struct sockaddr_in*)malloc(sizeof(struct sockaddr_in));
-
-    while (udp_socket_receive_from(curr_thread->udp_fd, &client_addr, recv_buffer, sizeof(recv_buffer), true) > 0) {
-        ucp_packet_decode(recv_buffer, sizeof(recv_buffer), &rcv_pkt);
-        if (rcv_pkt.type == UCP_PACKET_TYPE_DATA) {
-            fprintf(stdout, "seq_no: %u\n", rcv_pkt.data_packet.seq_no);
-            if (!file_io_save_packet(&(curr_thread->handle), &rcv_pkt)) {
-                sequencing_queue_push(&(curr_thread->seq_queue), rcv_pkt.data_packet.seq_no, UCP_FLAG_NACK, false);
-                fprintf(stderr, "Error saving packet\n");
-                return NULL;
-            } else {
-                sequencing_queue_push(&(curr_thread->seq_queue), rcv_pkt.data_packet.seq_no, UCP_FLAG_ACK, rcv_pkt.data_packet.flag == UCP_FLAG_DATA_END);
+typedef enum {
+    SESSION_OPENING = 0,
+    SESSION_ACTIVE,
+    SESSION_DONE,       // received in full, or failed; waiting to be reaped
+} session_state_t;
+
+typedef struct __daemon_worker_t daemon_worker_t;
+
+// One transfer partition. The event loop owns the table entry and the fields it routes by;
+// everything else belongs to the session's worker.
+typedef struct __ucp_session_t {
+    session_key_t key;
+    struct sockaddr_in client_addr;
+    daemon_worker_t* worker;
+    uint64_t last_active_us;
+    uint64_t dropped;               // datagrams over the memory budget
+    bool connecting;                // reverse connection forming, watched by the event loop
+    atomic_size_t queued_bytes;     // receive buffers waiting for the worker
+    atomic_int state;
+
+    char filename[21];
+    uint16_t part_index;
+    uint32_t part_size;
+    uint64_t base_offset;
+    uint64_t file_size;
+    bool inband_ctrl;               // control goes back on the data's UDP flow
+    bool use_fec;                   // data is followed by parity packets
+    tcp_endpoint_t endpoint;
+    tcp_client_t* client;
+    file_io_partition_handle_t handle;
+    sequencer_t* sequencer;
+    ctrl_writer_t ctrl;             // SACKs, NACKs and the FIN, sent once per worker batch
+    nack_ctx_t nack_ctx;
+    fec_decoder_t* fec;             // parity held until its block can be rebuilt
+    bool parity_held;               // parity arrived since the blocks were last checked
+    uint64_t rebuilt;               // packets rebuilt from parity
+    uint64_t corrupt;               // datagrams dropped for failing their CRC
+    uint64_t digest;                // of every packet written once, returned in the FIN
+    uint32_t unacked;               // data packets received since the last SACK
+    uint64_t ack_due_us;            // when the oldest of them must be acknowledged by
+    uint64_t fec_wait_us;           // when losses held back for parity are reported anyway
+    bool touched;                   // on its worker's list of sessions owing a SACK
+} ucp_session_t;
+
+typedef enum {
+    WORK_OPEN,
+    WORK_REOPEN,    // the client sent its metadata again, having heard nothing back
+    WORK_DATA,
+    WORK_CLOSE,
+    WORK_STOP,
+} work_type_t;
+
+typedef struct __work_item_t {
+    work_type_t type;
+    ucp_session_t* session;
+    uint8_t* buf;
+    size_t len;
+    uint16_t segment_size;
+} work_item_t;
+
+// Sessions are pinned to a worker, so a session's datagrams are handled in order by one thread
+struct __daemon_worker_t {
+    pthread_t thread;
+    spsc_ring_t* queue;         // work from the event loop
+    spsc_ring_t* returns;       // receive buffers handed back to the event loop
+    size_t buffer_size;
+    size_t num_sessions;        // owned by the event loop
+    int udp_fd;                 // the path's socket, for in-band control
+};
+
+// One receive path: a socket in the daemon's SO_REUSEPORT group, the event loop that drains it
+// on its own core, and the workers for the sessions steered to it. Paths share nothing.
+typedef struct __daemon_path_t {
+    pthread_t thread;
+    size_t index;
+    int udp_fd;
+    int epoll_fd;
+    int timer_fd;
+    int wake_fd;
+    bool started;
+    atomic_bool running;
+    size_t buffer_size;
+    size_t num_buffers;
+    uint8_t* buffer_memory;
+    uint8_t** free_buffers;
+    size_t num_free;
+    bool receive_paused;            // out of buffers: the socket is unwatched until one comes back
+    daemon_worker_t* workers;
+    size_t num_workers;
+    session_table_t* sessions;
+} daemon_path_t;
+
+typedef struct __ucp_daemon_t {
+    daemon_path_t* paths;
+    size_t num_paths;
+} ucp_daemon_t;
+
+static uint64_t daemon_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Queue a SACK for everything received so far
+static void session_queue_sack(ucp_session_t* session) {
+    uint32_t cumulative = sequencer_cumulative(session->sequencer);
+    ucp_packet_t* sack = ucp_packet_init_sack(cumulative);
+    if (sack) {
+        sack->sack_packet.bitmap_len = sequencer_get_bitmap(session->sequencer, cumulative + 1, sack->sack_packet.bitmap, UCP_SACK_MAX_BITMAP);
+        ctrl_queue(&session->ctrl, sack);
+        ucp_packet_free(sack);
+    }
+    session->unacked = 0;
+    session->ack_due_us = 0;
+}
+
+// The FIN carries the partition's digest for the client to check against the file it read
+static void session_queue_fin(ucp_session_t* session) {
+    ucp_packet_t *fin = ucp_packet_init_ctrl(session->sequencer->expectedLastSeqNo, UCP_FLAG_FIN);
+    if (fin) {
+        fin->ctrl_packet.digest = session->digest;
+        ctrl_queue(&session->ctrl, fin);
+        ucp_packet_free(fin);
+    }
+}
+
+// Every packet is in: send the final SACK and the FIN, and flush the partition to disk
+static void session_finish(ucp_session_t* session) {
+    // The client retires its window from the SACK; the FIN only tells it to stop
+    session_queue_sack(session);
+    session_queue_fin(session);
+    ctrl_flush(&session->ctrl);
+    if (!file_io_close_file(&session->handle)) {
+        fprintf(stderr, "Error writing part %u of %s\n", session->part_index, session->filename);
+    } else {
+        printf("Part %u of %s received successfully\n", session->part_index, session->filename);
+    }
+    atomic_store(&session->state, SESSION_DONE);
+}
+
+// Open the destination. The event loop has already formed the reverse connection the client
+// listens on for ACKs, unless they go back in-band.
+static void session_open(ucp_session_t* session) {
+    fprintf(stderr, "Received metadata: %.*s part %u\n", 20, session->filename, session->part_index);
+    printf("Received connection from client " IP_ADDR_FORMAT "\n", IP_ADDR(session->client_addr));
+
+    // All partitions of a transfer write into the one destination file
+    if (!file_io_open_file_part(&session->handle, session->filename, session->file_size, session->base_offset, session->part_size)) {
+        atomic_store(&session->state, SESSION_DONE);
+        return;
+    }
+
+    // One sequence number per UDP_PACKET_DATA_SIZE bytes of the partition
+    uint32_t num_packets = (session->part_size + UDP_PACKET_DATA_SIZE - 1) / UDP_PACKET_DATA_SIZE;
+    session->sequencer = sequencer_init_sized(num_packets);
+
+    session->ctrl.client = session->client;
+    session->ctrl.udp_fd = session->worker->udp_fd;
+    session->ctrl.addr = session->client_addr;
+    session->ctrl.capacity = session->client ? sizeof(session->ctrl.out.data) : UCP_CTRL_DATAGRAM_MAX_SIZE;
+    session->ctrl.out.data_len = 0;
+
+    // Missing runs are reported as ranges, many per NACK
+    session->nack_ctx.writer = &session->ctrl;
+    session->nack_ctx.nack = ucp_packet_init_nack();
+    session->nack_ctx.limit = UINT32_MAX;
+    session->fec = NULL;
+    if (session->use_fec) {
+        // Losses are left to the parity until it has had the chance to cover them
+        session->nack_ctx.limit = 0;
+        session->fec = fec_decoder_init();
+    }
+    if (!session->sequencer || !session->nack_ctx.nack || (session->use_fec && !session->fec)) {
+        atomic_store(&session->state, SESSION_DONE);
+        return;
+    }
+    atomic_store(&session->state, SESSION_ACTIVE);
+
+    // An empty partition has no packets to wait for
+    if (session->part_size == 0) {
+        session_finish(session);
+    }
+}
+
+// Tell a client whose control goes in-band where its session stands: it may have missed the
+// answer to its metadata, the final SACK or the FIN. The TCP connection loses nothing.
+static void session_answer(ucp_session_t* session) {
+    if (!session->inband_ctrl || !session->sequencer) {
+        return;
+    }
+    int state = atomic_load(&session->state);
+    if (state == SESSION_ACTIVE) {
+        session_queue_sack(session);
+    } else if (state == SESSION_DONE && sequencer_complete(session->sequencer)) {
+        session_queue_sack(session);
+        session_queue_fin(session);
+    } else {
+        return;
+    }
+    ctrl_flush(&session->ctrl);
+}
+
+// Every packet of a partition but the last is UDP_PACKET_DATA_SIZE long. Returns the length of
+// packet seq_no, or 0 if the partition has no such packet.
+static size_t session_packet_len(ucp_session_t* session, uint32_t seq_no) {
+    uint64_t offset = (uint64_t)seq_no * UDP_PACKET_DATA_SIZE;
+    if (offset >= session->part_size) {
+        return 0;
+    }
+    return session->part_size - offset < UDP_PACKET_DATA_SIZE ? session->part_size - offset : UDP_PACKET_DATA_SIZE;
+}
+
+// Expand a compressed packet into its own segment_data. Decoding runs here, on the session's
+// worker, rather than on the path's receive loop, so it never holds up receiving.
+static bool session_expand(ucp_session_t* session, ucp_packet_t* rcv_pkt) {
+    ucp_data_packet_t* data_packet = &rcv_pkt->data_packet;
+    size_t expected = session_packet_len(session, data_packet->seq_no);
+    size_t len = compress_expand(data_packet->payload, data_packet->seg_len, data_packet->segment_data, expected);
+    if (expected == 0 || len != expected) {
+        return false;
+    }
+    data_packet->payload = data_packet->segment_data;
+    data_packet->seg_len = len;
+    data_packet->compressed = false;
+    return true;
+}
+
+// Store each ucp packet in a receive buffer. Returns true if any are waiting to be acknowledged
+// or parity arrived, so the session has progress to report.
+static bool session_receive(ucp_session_t* session, work_item_t* item, ucp_packet_t* rcv_pkt, uint64_t now_us) {
+    if (atomic_load(&session->state) != SESSION_ACTIVE) {
+        // A retransmission after the transfer finished: the client missed how it ended
+        session_answer(session);
+        return false;
+    }
+
+    bool held_parity = false;
+    // Split coalesced receives back into the individual ucp packets
+    size_t segment_size = item->segment_size ? item->segment_size : item->len;
+    for (size_t offset = 0; offset < item->len; offset += segment_size) {
+        size_t len = item->len - offset < segment_size ? item->len - offset : segment_size;
+        rcv_pkt->type = 0;
+        if (ucp_packet_decode_data_header(item->buf + offset, len, rcv_pkt) == 0 ||
+            (rcv_pkt->type != UCP_PACKET_TYPE_DATA && rcv_pkt->type != UCP_PACKET_TYPE_PARITY)) {
+            fprintf(stderr, "Unknown packet type\n");
+            continue;
+        }
+        // A straggler from an earlier transfer on the same port, coalesced with this one's
+        if (rcv_pkt->data_packet.transfer_id != session->key.transfer_id) {
+            continue;
+        }
+        // Checked here rather than when the datagram was steered, to keep it off the receive loop
+        if (!ucp_packet_verify_data(item->buf + offset, len)) {
+            session->corrupt++;
+            continue;
+        }
+        if (rcv_pkt->type == UCP_PACKET_TYPE_PARITY) {
+            // Used when the session next reports progress, once the rest of the block is saved
+            if (session->fec) {
+                fec_decoder_add(session->fec, rcv_pkt);
+                session->parity_held = true;
+                held_parity = true;
+            }
+            continue;
+        }
+        if (rcv_pkt->data_packet.compressed && !session_expand(session, rcv_pkt)) {
+            fprintf(stderr, "Dropping malformed compressed packet %u\n", rcv_pkt->data_packet.seq_no);
+            continue;
+        }
+        bool fresh = !sequencer_check(session->sequencer, rcv_pkt->data_packet.seq_no);
+        if (!file_io_save_packet(&session->handle, rcv_pkt)) {
+            fprintf(stderr, "Error saving packet\n");
+            queue_ctrl_packet(&session->ctrl, rcv_pkt->data_packet.seq_no, UCP_FLAG_NACK);
+            ctrl_flush(&session->ctrl);
+            atomic_store(&session->state, SESSION_DONE);
+            return false;
+        }
+        sequencer_add(session->sequencer, rcv_pkt->data_packet.seq_no, rcv_pkt->data_packet.flag == UCP_FLAG_DATA_END);
+        if (fresh) {
+            session->digest += checksum_packet_digest(session->base_offset + rcv_pkt->data_packet.offset,
+                                                      rcv_pkt->data_packet.payload, rcv_pkt->data_packet.seg_len);
+        }
+
+        // Duplicates are acknowledged too: the client resent them because it missed an ACK
+        if (session->unacked++ == 0) {
+            session->ack_due_us = now_us + SESSION_ACK_DELAY_US;
+        }
+        if (session->unacked >= SESSION_ACK_EVERY) {
+            session_queue_sack(session);
+            ctrl_flush(&session->ctrl);
+        }
+    }
+    return session->unacked > 0 || held_parity;
+}
+
+static bool session_fec_has(void* ctx, uint32_t seq_no) {
+    ucp_session_t* session = (ucp_session_t*)ctx;
+    return sequencer_check(session->sequencer, seq_no);
+}
+
+static size_t session_fec_load(void* ctx, uint32_t seq_no, uint8_t* buf) {
+    ucp_session_t* session = (ucp_session_t*)ctx;
+    size_t len = session_packet_len(session, seq_no);
+    if (len == 0 || file_io_read_saved(&session->handle, buf, len, (size_t)seq_no * UDP_PACKET_DATA_SIZE) != (ssize_t)len) {
+        return 0;
+    }
+    return len;
+}
+
+static bool session_fec_restore(void* ctx, uint32_t seq_no, const uint8_t* payload, size_t len) {
+    ucp_session_t* session = (ucp_session_t*)ctx;
+    size_t seg_len = session_packet_len(session, seq_no);
+    if (seg_len == 0 || seg_len > len) {
+        return false;
+    }
+    ucp_packet_t* packet = ucp_packet_init_data(seq_no, (size_t)seq_no * UDP_PACKET_DATA_SIZE, (uint8_t*)payload, seg_len);
+    if (!packet) {
+        return false;
+    }
+    bool saved = file_io_save_packet(&session->handle, packet);
+    ucp_packet_free(packet);
+    if (!saved) {
+        return false;
+    }
+    sequencer_add(session->sequencer, seq_no, seq_no == session->sequencer->expectedLastSeqNo);
+    session->digest += checksum_packet_digest(session->base_offset + (uint64_t)seq_no * UDP_PACKET_DATA_SIZE, payload, seg_len);
+    session->unacked++;
+    session->rebuilt++;
+    return true;
+}
+
+// Rebuild what the parity received so far allows, and let losses it cannot cover be reported
+static void session_recover(ucp_session_t* session, uint64_t now_us) {
+    if (!session->fec) {
+        return;
+    }
+    fec_source_t source = {
+        .has = session_fec_has,
+        .load = session_fec_load,
+        .restore = session_fec_restore,
+        .ctx = session,
+    };
+    fec_decoder_recover(session->fec, &source);
+    session->parity_held = false;
+
+    // A block's parity is sent before any packet of the next block, so once data from further
+    // on than the longest block has arrived, parity still missing for a packet was lost too
+    uint32_t limit = session->fec->covered;
+    uint32_t newest = session->sequencer->maxSeqNo;
+    if (newest >= FEC_MAX_BLOCK && newest - FEC_MAX_BLOCK + 1 > limit) {
+        limit = newest - FEC_MAX_BLOCK + 1;
+    }
+    if (limit > session->nack_ctx.limit) {
+        // Parity is still arriving; wait afresh for what remains held back
+        session->fec_wait_us = 0;
+    } else if (session->fec_wait_us > 0 && now_us >= session->fec_wait_us) {
+        // Nothing comes after the last block's parity to show it was lost
+        limit = UINT32_MAX;
+        session->fec_wait_us = 0;
+    }
+    session->nack_ctx.limit = limit;
+}
+
+// After a batch: acknowledge what arrived and report what is still missing, or finish the
+// transfer. Unless idle, a SACK that is not yet due is held back to cover more packets.
+// Returns when the session must progress again even if nothing arrives, for a SACK held back
+// or losses held back for parity, or 0 if it need not.
+static uint64_t session_progress(ucp_session_t* session, uint64_t now_us, bool idle) {
+    if (atomic_load(&session->state) != SESSION_ACTIVE) {
+        return 0;
+    }
+    if (!sequencer_complete(session->sequencer)) {
+        bool fec_due = session->fec_wait_us > 0 && now_us >= session->fec_wait_us;
+        if (session->unacked == 0 && !session->parity_held && !fec_due) {
+            return session->fec_wait_us;
+        }
+        if (!idle && now_us < session->ack_due_us) {
+            return session->ack_due_us;
+        }
+        session_recover(session, now_us);
+    }
+    if (!sequencer_complete(session->sequencer)) {
+        session->nack_ctx.held = false;
+        session_queue_sack(session);
+        sequencer_iterate_missing_ranges(session->sequencer, add_nack_range, &session->nack_ctx);
+        flush_nack(&session->nack_ctx);
+        ctrl_flush(&session->ctrl);
+        if (!session->nack_ctx.held) {
+            session->fec_wait_us = 0;
+        } else if (session->fec_wait_us == 0) {
+            session->fec_wait_us = now_us + SESSION_FEC_WAIT_US;
+        }
+        return session->fec_wait_us;
+    }
+
+    session_finish(session);
+    return 0;
+}
+
+static void session_close(ucp_session_t* session) {
+    if (atomic_load(&session->state) != SESSION_DONE) {
+        fprintf(stderr, "Abandoning unfinished transfer of %s from " IP_ADDR_FORMAT "\n",
+                session->filename, IP_ADDR(session->client_addr));
+    }
+    if (session->handle.fd >= 0 && !file_io_close_file(&session->handle)) {
+        fprintf(stderr, "Error writing file %s\n", session->filename);
+    }
+    if (session->rebuilt > 0) {
+        printf("Rebuilt %llu packets of part %u of %s from parity\n", (unsigned long long)session->rebuilt,
+               session->part_index, session->filename);
+    }
+    if (session->corrupt > 0) {
+        printf("Dropped %llu corrupt packets of part %u of %s\n", (unsigned long long)session->corrupt,
+               session->part_index, session->filename);
+    }
+    tcp_client_disconnect(session->client);
+    sequencer_destroy(session->sequencer);
+    fec_decoder_destroy(session->fec);
+    ucp_packet_free(session->nack_ctx.nack);
+    free(session);
+}
+
+static void worker_return_buffer(daemon_worker_t* worker, uint8_t* buf) {
+    // The ring holds every buffer the daemon owns, so this only waits on a slow event loop
+    while (!spsc_ring_push(worker->returns, &buf)) {
+        sched_yield();
+    }
+}
+
+// Progress the sessions owing a SACK, keeping on the list those that hold something back.
+// Returns the earliest time one of them must progress again, or 0 if none is kept.
+static uint64_t worker_flush(ucp_session_t** touched, size_t* num_touched, bool idle) {
+    uint64_t now_us = daemon_now_us();
+    uint64_t next_us = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < *num_touched; i++) {
+        uint64_t due_us = session_progress(touched[i], now_us, idle);
+        if (due_us > 0) {
+            touched[kept++] = touched[i];
+            if (next_us == 0 || due_us < next_us) {
+                next_us = due_us;
             }
         } else {
-            fprintf(stderr, "Unknown packet type\n");
+            touched[i]->touched = false;
+        }
+    }
+    *num_touched = kept;
+    return next_us;
+}
+
+static void* worker_thread(void* arg) {
+    daemon_worker_t* worker = (daemon_worker_t*)arg;
+    work_item_t items[WORKER_BATCH_SIZE];
+    ucp_session_t* touched[DAEMON_MAX_SESSIONS];
+    size_t num_touched = 0;
+    ucp_packet_t rcv_pkt = {0};
+
+    bool running = true;
+    uint64_t next_us = 0;
+    while (running) {
+        // Sleep no later than a session holding something back must progress again
+        long wait_us = -1;
+        if (next_us > 0) {
+            uint64_t now_us = daemon_now_us();
+            wait_us = next_us > now_us ? (long)(next_us - now_us) : 0;
+        }
+        size_t count = spsc_ring_pop_batch(worker->queue, items, WORKER_BATCH_SIZE, WORKER_SPIN_US, wait_us);
+        uint64_t now_us = daemon_now_us();
+        for (size_t i = 0; i < count; i++) {
+            ucp_session_t* session = items[i].session;
+            switch (items[i].type) {
+                case WORK_OPEN:
+                    session_open(session);
+                    session_answer(session);
+                    break;
+                case WORK_REOPEN:
+                    session_answer(session);
+                    break;
+                case WORK_DATA:
+                    if (session_receive(session, &items[i], &rcv_pkt, now_us) && !session->touched) {
+                        if (num_touched == DAEMON_MAX_SESSIONS) {
+                            worker_flush(touched, &num_touched, true);
+                        }
+                        session->touched = true;
+                        touched[num_touched++] = session;
+                    }
+                    atomic_fetch_sub(&session->queued_bytes, worker->buffer_size);
+                    worker_return_buffer(worker, items[i].buf);
+                    break;
+                case WORK_CLOSE:
+                    // The session may have data from this batch still to account for
+                    worker_flush(touched, &num_touched, true);
+                    for (size_t j = 0; session->touched && j < num_touched; j++) {
+                        if (touched[j] == session) {
+                            touched[j] = touched[--num_touched];
+                            session->touched = false;
+                        }
+                    }
+                    session_close(session);
+                    break;
+                case WORK_STOP:
+                    running = false;
+                    break;
+            }
         }
+        // A short batch drained the queue, so the worker is about to go idle and must not
+        // sit on any SACK
+        next_us = worker_flush(touched, &num_touched, count < WORKER_BATCH_SIZE);
     }
+
+    ucp_packet_pool_release();
     return NULL;
 }
 
-static void* sequencing_thread(void* arg) {
+static void daemon_dispatch(daemon_worker_t* worker, work_item_t* item) {
+    // Queues are sized for every buffer plus an open and close per session, so this only
+    // waits on a slow worker
+    while (!spsc_ring_push(worker->queue, item)) {
+        sched_yield();
+    }
+}
 
-    ucp_server_thread_context_t* curr_thread = (ucp_server_thread_context_t*)arg;
+static void daemon_open_session(daemon_path_t* path, struct sockaddr_in* addr, ucp_metadata_packet_t* metadata, uint64_t now_us) {
+    session_key_t key = session_key_make(addr, metadata->transfer_id);
+    ucp_session_t* existing = (ucp_session_t*) session_table_find(path->sessions, &key);
+    if (existing) {
+        // A repeat: the client has not heard back. Over TCP it will once the connection forms.
+        if (existing->inband_ctrl) {
+            existing->last_active_us = now_us;
+            work_item_t item = { .type = WORK_REOPEN, .session = existing };
+            daemon_dispatch(existing->worker, &item);
+        }
+        return;
+    }
+    if (path->sessions->count >= DAEMON_MAX_SESSIONS) {
+        fprintf(stderr, "Session limit reached, ignoring transfer from " IP_ADDR_FORMAT "\n", IP_ADDR((*addr)));
+        return;
+    }
 
-    uint32_t seq_no = 0;
-    ucp_flag_t flag = 0;
-    bool is_last = false;
+    ucp_session_t* session = (ucp_session_t*) calloc(1, sizeof(ucp_session_t));
+    if (!session) {
+        perror("calloc");
+        return;
+    }
+    session->key = key;
+    session->client_addr = *addr;
+    session->last_active_us = now_us;
+    session->handle.fd = -1;
+    atomic_init(&session->queued_bytes, 0);
+    atomic_init(&session->state, SESSION_OPENING);
+    memcpy(session->filename, metadata->desination_name, sizeof(metadata->desination_name));
+    session->part_index = metadata->part_index;
+    session->part_size = metadata->part_size;
+    session->base_offset = metadata->base_offset;
+    session->file_size = metadata->file_size;
+    session->inband_ctrl = (metadata->flags & UCP_METADATA_FLAG_INBAND_CTRL) != 0;
+    session->use_fec = (metadata->flags & UCP_METADATA_FLAG_FEC) != 0;
+    if (session->base_offset > session->file_size || session->part_size > session->file_size - session->base_offset) {
+        fprintf(stderr, "Partition %u of %.*s lies outside the file\n", session->part_index, 20, session->filename);
+        free(session);
+        return;
+    }
 
-    sequencer_t* sequencer = sequencer_init();
+    // Spread sessions over the workers
+    session->worker = &path->workers[0];
+    for (size_t i = 1; i < path->num_workers; i++) {
+        if (path->workers[i].num_sessions < session->worker->num_sessions) {
+            session->worker = &path->workers[i];
+        }
+    }
 
-    while(/*true || */!sequencer_complete(sequencer)) {
-        if (sequencing_queue_pop(&(curr_thread->seq_queue), &seq_no, &flag, &is_last)) {
-            send_ctrl_packet(seq_no, flag, curr_thread->client);
-            sequencer_add(sequencer, seq_no, flag == UCP_FLAG_DATA_END);
-            sequencer_iterate_missing_segments(sequencer, send_nack, curr_thread->client);
+    // The reverse connection forms without blocking; the session opens once it has
+    if (!session->inband_ctrl) {
+        session->endpoint.addr = session->client_addr;
+        session->endpoint.sd = -1;
+        session->endpoint.next = NULL;
+        session->client = tcp_client_connect(&session->endpoint, NULL, NULL);
+        struct epoll_event event = { .events = EPOLLOUT, .data.ptr = session };
+        if (!session->client || epoll_ctl(path->epoll_fd, EPOLL_CTL_ADD, session->client->sd, &event) < 0) {
+            fprintf(stderr, "Error forming reverse connection to client\n");
+            tcp_client_disconnect(session->client);
+            free(session);
+            return;
         }
+        session->connecting = true;
     }
 
-    send_fin(sequencer->expectedLastSeqNo, curr_thread->client);
+    if (!session_table_insert(path->sessions, &key, session)) {
+        if (session->connecting) {
+            epoll_ctl(path->epoll_fd, EPOLL_CTL_DEL, session->client->sd, NULL);
+        }
+        tcp_client_disconnect(session->client);
+        free(session);
+        return;
+    }
+    session->worker->num_sessions++;
 
-    pthread_cancel(curr_thread->rcv_thread);
-    sequencer_destroy(sequencer);
+    if (!session->connecting) {
+        work_item_t item = { .type = WORK_OPEN, .session = session };
+        daemon_dispatch(session->worker, &item);
+    }
+}
 
-    return NULL;
+// The reverse connection of a session has formed or failed
+static void daemon_session_connected(daemon_path_t* path, ucp_session_t* session) {
+    epoll_ctl(path->epoll_fd, EPOLL_CTL_DEL, session->client->sd, NULL);
+    session->connecting = false;
+    if (!tcp_client_connect_finish(session->client)) {
+        // Left for the reaper, which closes the connection
+        fprintf(stderr, "Error forming reverse connection to client " IP_ADDR_FORMAT "\n", IP_ADDR(session->client_addr));
+        atomic_store(&session->state, SESSION_DONE);
+        return;
+    }
+    work_item_t item = { .type = WORK_OPEN, .session = session };
+    daemon_dispatch(session->worker, &item);
 }
 
-int main(void) {
-    ucp_server_thread_context_t thread_ctx;
+// Route a received buffer. Returns true if it was handed to a worker, which now owns it.
+static bool daemon_route(daemon_path_t* path, udp_datagram_t* dgram, ucp_packet_t* header, uint64_t now_us) {
+    if (dgram->data_len == 0) {
+        return false;
+    }
+    if (dgram->buf[0] == UCP_PACKET_TYPE_METADATA) {
+        if (ucp_packet_decode(dgram->buf, dgram->data_len, header) > 0) {
+            daemon_open_session(path, &dgram->addr, &header->metadata_packet, now_us);
+        }
+        return false;
+    }
 
-    LinkedListInit(&(thread_ctx.seq_queue));
+    // Only the header is decoded here; the worker stores the payload straight from the buffer
+    size_t first_len = dgram->segment_size && dgram->segment_size < dgram->data_len ? dgram->segment_size : dgram->data_len;
+    header->type = 0;
+    if (ucp_packet_decode_data_header(dgram->buf, first_len, header) == 0 ||
+        (header->type != UCP_PACKET_TYPE_DATA && header->type != UCP_PACKET_TYPE_PARITY)) {
+        fprintf(stderr, "Unknown packet type\n");
+        return false;
+    }
 
-    struct sockaddr_in* server_addr = (struct sockaddr_in*) malloc(sizeof(struct sockaddr_in));
-    struct sockaddr_in* client_addr = (struct sockaddr_in*) malloc(sizeof(struct sockaddr_in));
+    session_key_t key = session_key_make(&dgram->addr, header->data_packet.transfer_id);
+    ucp_session_t* session = (ucp_session_t*) session_table_find(path->sessions, &key);
+    if (!session) {
+        return false;
+    }
+    session->last_active_us = now_us;
 
-    thread_ctx.udp_fd = udp_socket_initialise(&server_addr, SERVER_BASE_PORT);
-    if (thread_ctx.udp_fd < 0) {
-        fprintf(stderr, "Error creating socket\n");
-        return -1;
+    if (atomic_load(&session->queued_bytes) + path->buffer_size > SESSION_MEMORY_BUDGET) {
+        session->dropped++;
+        return false;
+    }
+    atomic_fetch_add(&session->queued_bytes, path->buffer_size);
+
+    work_item_t item = {
+        .type = WORK_DATA,
+        .session = session,
+        .buf = dgram->buf,
+        .len = dgram->data_len,
+        .segment_size = dgram->segment_size,
+    };
+    daemon_dispatch(session->worker, &item);
+    return true;
+}
+
+// Take back the buffers the workers are done with
+static void daemon_reclaim_buffers(daemon_path_t* path) {
+    for (size_t i = 0; i < path->num_workers; i++) {
+        path->num_free += spsc_ring_try_pop_batch(path->workers[i].returns, path->free_buffers + path->num_free,
+                                                    path->num_buffers - path->num_free);
+    }
+}
+
+// Every buffer is queued. Stop watching the socket, which stays readable, until a worker hands
+// a buffer back. Returns false if one came back meanwhile.
+static bool daemon_pause_receive(daemon_path_t* path) {
+    size_t armed = 0;
+    while (armed < path->num_workers && spsc_ring_arm(path->workers[armed].returns)) {
+        armed++;
+    }
+    struct epoll_event event = { .events = 0, .data.ptr = &path->udp_fd };
+    if (armed < path->num_workers || epoll_ctl(path->epoll_fd, EPOLL_CTL_MOD, path->udp_fd, &event) < 0) {
+        for (size_t i = 0; i < armed; i++) {
+            spsc_ring_disarm(path->workers[i].returns);
+        }
+        return false;
     }
+    path->receive_paused = true;
+    return true;
+}
+
+// A worker handed back a buffer
+static void daemon_resume_receive(daemon_path_t* path) {
+    for (size_t i = 0; i < path->num_workers; i++) {
+        spsc_ring_disarm(path->workers[i].returns);
+    }
+    if (path->receive_paused) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = &path->udp_fd };
+        if (epoll_ctl(path->epoll_fd, EPOLL_CTL_MOD, path->udp_fd, &event) < 0) {
+            perror("epoll_ctl");
+        }
+        path->receive_paused = false;
+    }
+}
+
+static void daemon_receive(daemon_path_t* path) {
+    udp_datagram_t batch[UDP_BATCH_SIZE];
+    ucp_packet_t header;
+
+    for (int round = 0; round < DAEMON_RECV_ROUNDS; round++) {
+        daemon_reclaim_buffers(path);
+        if (path->num_free == 0) {
+            if (daemon_pause_receive(path)) {
+                return;
+            }
+            continue;
+        }
+
+        size_t want = path->num_free < UDP_BATCH_SIZE ? path->num_free : UDP_BATCH_SIZE;
+        path->num_free -= want;
+        for (size_t i = 0; i < want; i++) {
+            batch[i].buf = path->free_buffers[path->num_free + i];
+            batch[i].buf_len = path->buffer_size;
+        }
+
+        int count = udp_socket_receive_batch(path->udp_fd, batch, want, false);
+        uint64_t now_us = daemon_now_us();
+        for (size_t i = 0; i < want; i++) {
+            if ((int)i >= count || !daemon_route(path, &batch[i], &header, now_us)) {
+                path->free_buffers[path->num_free++] = batch[i].buf;
+            }
+        }
+        if (count < (int)want) {
+            return;
+        }
+    }
+}
+
+static bool daemon_reap_session(const session_key_t* key, void* value, void* ctx) {
+    daemon_path_t* path = (daemon_path_t*)ctx;
+    ucp_session_t* session = (ucp_session_t*)value;
+    (void)key;
+
+    uint64_t quiet_us = daemon_now_us() - session->last_active_us;
+    bool done = atomic_load(&session->state) == SESSION_DONE && (!session->inband_ctrl || quiet_us > SESSION_LINGER_US);
+    bool idle = quiet_us > SESSION_IDLE_TIMEOUT_US;
+    if (atomic_load(&path->running) && !done && !idle) {
+        return false;
+    }
+    if (session->dropped > 0) {
+        fprintf(stderr, "Dropped %llu datagrams from " IP_ADDR_FORMAT " over its memory budget\n",
+                (unsigned long long)session->dropped, IP_ADDR(session->client_addr));
+    }
+
+    // The worker frees the session once it has handled everything queued before this, so
+    // the event loop must not hear about its connection any more
+    if (session->connecting) {
+        epoll_ctl(path->epoll_fd, EPOLL_CTL_DEL, session->client->sd, NULL);
+        session->connecting = false;
+    }
+    session->worker->num_sessions--;
+    work_item_t item = { .type = WORK_CLOSE, .session = session };
+    daemon_dispatch(session->worker, &item);
+    return true;
+}
+
+// Steer each datagram to receive path part_index % num_paths, so that a partition's metadata and
+// data always reach the same path and the partitions of a transfer are spread over the cores
+static bool daemon_attach_steering(int sock_fd, uint32_t num_paths) {
+    // Both packet types carry a little-endian 16-bit index, at different offsets
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, UCP_PACKET_TYPE_METADATA, 0, 5),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, UCP_METADATA_PART_INDEX_OFFSET + 1),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, UCP_METADATA_PART_INDEX_OFFSET),
+        BPF_JUMP(BPF_JMP | BPF_JA, 4, 0, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, UCP_DATA_PART_INDEX_OFFSET + 1),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, UCP_DATA_PART_INDEX_OFFSET),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num_paths),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    return udp_socket_attach_reuseport_filter(sock_fd, code, sizeof(code) / sizeof(code[0]));
+}
+
+static bool daemon_path_init(daemon_path_t* path, size_t index, size_t num_workers) {
+    memset(path, 0, sizeof(daemon_path_t));
+    path->index = index;
+    path->udp_fd = path->epoll_fd = path->timer_fd = path->wake_fd = -1;
+    atomic_init(&path->running, true);
 
-    if (udp_socket_bind(thread_ctx.udp_fd, server_addr)) {
+    // Paths join the SO_REUSEPORT group in index order, which is the order steering counts in
+    struct sockaddr_in server_addr;
+    struct sockaddr_in* addr = &server_addr;
+    path->udp_fd = udp_socket_initialise(&addr, SERVER_BASE_PORT);
+    if (path->udp_fd < 0) {
+        fprintf(stderr, "Error creating socket\n");
+        return false;
+    }
+    if (!udp_socket_enable_reuseport(path->udp_fd) || udp_socket_bind(path->udp_fd, addr)) {
         fprintf(stderr, "Error binding socket\n");
-        return -1;
+        return false;
     }
 
-    uint8_t recv_buffer[UDP_PACKET_SIZE];
+    // With GRO the kernel may hand back several coalesced datagrams per buffer
+    bool use_gro = udp_socket_enable_gro(path->udp_fd);
+    path->buffer_size = use_gro ? UDP_GRO_BUFFER_SIZE : UDP_PACKET_SIZE;
+    path->num_buffers = DAEMON_RECV_MEMORY / path->buffer_size;
+    path->buffer_memory = (uint8_t*) malloc(path->num_buffers * path->buffer_size);
+    path->free_buffers = (uint8_t**) malloc(path->num_buffers * sizeof(uint8_t*));
+    if (!path->buffer_memory || !path->free_buffers) {
+        perror("malloc");
+        return false;
+    }
+    for (size_t i = 0; i < path->num_buffers; i++) {
+        path->free_buffers[i] = path->buffer_memory + i * path->buffer_size;
+    }
+    path->num_free = path->num_buffers;
 
-    if (udp_socket_receive_from(thread_ctx.udp_fd, &client_addr, recv_buffer, sizeof(recv_buffer), true) < 0) {
-        fprintf(stderr, "Error receiving data\n");
-        return -1;
+    path->sessions = session_table_init(DAEMON_MAX_SESSIONS);
+    if (!path->sessions) {
+        return false;
     }
 
-    ucp_packet_t rcv_pkt;
-    ucp_packet_decode(recv_buffer, sizeof(recv_buffer), &rcv_pkt);
-    if (rcv_pkt.type == UCP_PACKET_TYPE_METADATA) {
-        fprintf(stderr, "Received metadata: %.*s\n", 20, rcv_pkt.metadata_packet.desination_name);
-        file_io_open_file_of_size(&(thread_ctx.handle), rcv_pkt.metadata_packet.desination_name, rcv_pkt.metadata_packet.part_size);
+    path->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct itimerspec interval = {
+        .it_interval = { .tv_sec = DAEMON_REAP_INTERVAL_MS / 1000, .tv_nsec = (DAEMON_REAP_INTERVAL_MS % 1000) * 1000000L },
+        .it_value = { .tv_sec = DAEMON_REAP_INTERVAL_MS / 1000, .tv_nsec = (DAEMON_REAP_INTERVAL_MS % 1000) * 1000000L },
+    };
+    if (path->timer_fd < 0 || timerfd_settime(path->timer_fd, 0, &interval, NULL) < 0) {
+        perror("timerfd");
+        return false;
+    }
+    path->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (path->wake_fd < 0) {
+        perror("eventfd");
+        return false;
     }
 
-    printf("Received connection from client " IP_ADDR_FORMAT "\n", IP_ADDR((*client_addr)));
+    path->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (path->epoll_fd < 0) {
+        perror("epoll_create1");
+        return false;
+    }
+    // Each fd is registered with a pointer to where it is kept, the workers' return rings with
+    // the worker and sessions whose reverse connection is forming with the session
+    int* fds[] = { &path->udp_fd, &path->timer_fd, &path->wake_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = fds[i] };
+        if (epoll_ctl(path->epoll_fd, EPOLL_CTL_ADD, *fds[i], &event) < 0) {
+            perror("epoll_ctl");
+            return false;
+        }
+    }
 
+    path->workers = (daemon_worker_t*) calloc(num_workers, sizeof(daemon_worker_t));
+    if (!path->workers) {
+        perror("calloc");
+        return false;
+    }
+    for (size_t i = 0; i < num_workers; i++) {
+        daemon_worker_t* worker = &path->workers[i];
+        worker->buffer_size = path->buffer_size;
+        worker->udp_fd = path->udp_fd;
+        worker->queue = spsc_ring_init(path->num_buffers + 2 * DAEMON_MAX_SESSIONS + 1, sizeof(work_item_t));
+        worker->returns = spsc_ring_init(path->num_buffers, sizeof(uint8_t*));
+        if (!worker->queue || !worker->returns) {
+            fprintf(stderr, "Error creating worker queues\n");
+            spsc_ring_destroy(worker->queue);
+            spsc_ring_destroy(worker->returns);
+            return false;
+        }
+        // Watched only while the path waits for its buffers to come back
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = worker };
+        if (epoll_ctl(path->epoll_fd, EPOLL_CTL_ADD, spsc_ring_wake_fd(worker->returns), &event) < 0) {
+            perror("epoll_ctl");
+            spsc_ring_destroy(worker->queue);
+            spsc_ring_destroy(worker->returns);
+            return false;
+        }
+        if (pthread_create(&worker->thread, NULL, worker_thread, worker)) {
+            fprintf(stderr, "Error creating worker thread\n");
+            spsc_ring_destroy(worker->queue);
+            spsc_ring_destroy(worker->returns);
+            return false;
+        }
+        path->num_workers++;
+    }
+    return true;
+}
 
-    thread_ctx.client_port = ntohs(client_addr->sin_port);
+static bool daemon_is_worker(daemon_path_t* path, void* ptr) {
+    for (size_t i = 0; i < path->num_workers; i++) {
+        if (ptr == &path->workers[i]) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    tcp_endpoint_t* tcp_endpoint = (tcp_endpoint_t*)malloc(sizeof(tcp_endpoint_t));
-    
-    tcp_endpoint->addr.sin_family = client_addr->sin_family;
-    tcp_endpoint->addr.sin_addr.s_addr = client_addr->sin_addr.s_addr;
-    tcp_endpoint->addr.sin_port = htons(thread_ctx.client_port);
+static void daemon_path_run(daemon_path_t* path) {
+    struct epoll_event events[4];
+    while (atomic_load(&path->running)) {
+        int count = epoll_wait(path->epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        bool reap = false;
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == &path->udp_fd) {
+                daemon_receive(path);
+            } else if (events[i].data.ptr == &path->timer_fd) {
+                uint64_t expirations;
+                reap = read(path->timer_fd, &expirations, sizeof(expirations)) > 0;
+            } else if (daemon_is_worker(path, events[i].data.ptr)) {
+                daemon_resume_receive(path);
+            } else if (events[i].data.ptr != &path->wake_fd) {
+                daemon_session_connected(path, (ucp_session_t*)events[i].data.ptr);
+            }
+        }
+        // Reaped only after the batch, which may still hold events for the sessions reaped
+        if (reap) {
+            session_table_sweep(path->sessions, daemon_reap_session, path);
+        }
+    }
+}
+
+static void daemon_path_shutdown(daemon_path_t* path) {
+    atomic_store(&path->running, false);
+    if (path->sessions) {
+        // Close every session, then let the workers finish their queues and exit
+        session_table_sweep(path->sessions, daemon_reap_session, path);
+    }
+    for (size_t i = 0; i < path->num_workers; i++) {
+        work_item_t item = { .type = WORK_STOP };
+        daemon_dispatch(&path->workers[i], &item);
+    }
+    for (size_t i = 0; i < path->num_workers; i++) {
+        pthread_join(path->workers[i].thread, NULL);
+        spsc_ring_destroy(path->workers[i].queue);
+        spsc_ring_destroy(path->workers[i].returns);
+    }
+    free(path->workers);
+    session_table_destroy(path->sessions);
+    free(path->free_buffers);
+    free(path->buffer_memory);
+    int fds[] = { path->epoll_fd, path->timer_fd, path->wake_fd, path->udp_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+}
 
-    tcp_endpoint->sd = -1;
-    tcp_endpoint->next = NULL;
+static void* daemon_path_thread(void* arg) {
+    daemon_path_t* path = (daemon_path_t*)arg;
 
-    thread_ctx.client = tcp_client_connect(tcp_endpoint, NULL, NULL);
-    if (!thread_ctx.client) {
-        fprintf(stderr, "Error forming reverse connection to client\n");
-        return -1;
+#if defined(__linux__)
+    // Keep the path on the core its datagrams are steered to
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(path->index % (size_t)get_nprocs(), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif // __linux__
+
+    daemon_path_run(path);
+    daemon_path_shutdown(path);
+    ucp_packet_pool_release();
+    return NULL;
+}
+
+static bool daemon_init(ucp_daemon_t* daemon, size_t num_paths, size_t num_workers) {
+    daemon->paths = (daemon_path_t*) calloc(num_paths, sizeof(daemon_path_t));
+    daemon->num_paths = 0;
+    if (!daemon->paths) {
+        perror("calloc");
+        return false;
+    }
+
+    for (size_t i = 0; i < num_paths; i++) {
+        bool ok = daemon_path_init(&daemon->paths[i], i, num_workers);
+        daemon->num_paths++;
+        if (!ok) {
+            return false;
+        }
     }
 
-    if (pthread_create(&(thread_ctx.rcv_thread), NULL, receiving_thread, &thread_ctx)) {
-        fprintf(stderr, "Error creating receiving thread\n");
+    // Without steering the kernel spreads datagrams by address hash, which still keeps each
+    // partition on one path
+    if (num_paths > 1 && !daemon_attach_steering(daemon->paths[0].udp_fd, num_paths)) {
+        fprintf(stderr, "Falling back to hashing partitions over receive paths\n");
     }
 
-  if (pthread_create(&(thread_ctx.seq_thread), NULL, sequencing_thread, &thread_ctx)) {
-        fprintf(stderr, "Error creating sequencing thread\n");
+    for (size_t i = 0; i < num_paths; i++) {
+        if (pthread_create(&daemon->paths[i].thread, NULL, daemon_path_thread, &daemon->paths[i])) {
+            fprintf(stderr, "Error creating receive thread\n");
+            return false;
+        }
+        daemon->paths[i].started = true;
     }
+    return true;
+}
 
-    pthread_join(thread_ctx.seq_thread, NULL);
-    pthread_join(thread_ctx.rcv_thread, NULL);
+// Stop every receive path. Running paths close their own sessions on the way out.
+static void daemon_stop(ucp_daemon_t* daemon) {
+    for (size_t i = 0; i < daemon->num_paths; i++) {
+        daemon_path_t* path = &daemon->paths[i];
+        if (!path->started) {
+            daemon_path_shutdown(path);
+            continue;
+        }
+        atomic_store(&path->running, false);
+        uint64_t one = 1;
+        if (write(path->wake_fd, &one, sizeof(one)) < 0) {
+            perror("write");
+        }
+    }
+    for (size_t i = 0; i < daemon->num_paths; i++) {
+        if (daemon->paths[i].started) {
+            pthread_join(daemon->paths[i].thread, NULL);
+        }
+    }
+    free(daemon->paths);
+}
+
+static void print_usage(void) {
+    printf("Usage: ucp-daemon [-p paths] [-w workers]\n");
+    printf("  -p  Number of receive paths (default: one per CPU)\n");
+    printf("  -w  Number of worker threads per receive path (default: 1)\n");
+}
+
+int main(int argc, char** argv) {
+    size_t num_paths = 0;
+    size_t num_workers = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:w:")) != -1) {
+        switch (opt) {
+            case 'p':
+                num_paths = (size_t)atoi(optarg);
+                break;
+            case 'w':
+                num_workers = (size_t)atoi(optarg);
+                break;
+            default:
+                print_usage();
+                return -1;
+        }
+    }
+    if (num_paths == 0) {
+#if defined(__linux__)
+        num_paths = (size_t)get_nprocs();
+#else
+        num_paths = 1;
+#endif // __linux__
+    }
+    if (num_workers == 0) {
+        num_workers = 1;
+    }
+
+    // A client that goes away must not take the daemon with it
+    signal(SIGPIPE, SIG_IGN);
+
+    // Shutdown signals are taken by this thread alone; every other thread inherits the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    ucp_daemon_t daemon;
+    if (!daemon_init(&daemon, num_paths, num_workers)) {
+        daemon_stop(&daemon);
+        return -1;
+    }
 
-    tcp_client_disconnect(thread_ctx.client);
+    printf("Listening on port %d with %zu receive paths of %zu workers\n", SERVER_BASE_PORT, daemon.num_paths, num_workers);
+    fflush(stdout);
 
-    printf("File received successfully\n");
+    int sig = 0;
+    sigwait(&signals, &sig);
+    fprintf(stderr, "Received signal %d, shutting down\n", sig);
+    daemon_stop(&daemon);
 
     return 0;
 }
@@ -1,7 +1,36 @@
+#define _GNU_SOURCE
 #include "udp_socket.h"
 
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <netinet/udp.h>
+#include <time.h>
+#include <linux/net_tstamp.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO     104
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME   61
+#endif
+#ifndef SCM_TXTIME
+#define SCM_TXTIME  SO_TXTIME
+#endif
+
+// Room for a UDP_SEGMENT and an SCM_TXTIME control message
+#define UDP_SEND_CTRL_SIZE  (CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t)))
+
+#include "defines.h"
+
+// Counted per thread so that partitions sending in parallel never share the cache line
+static _Thread_local uint64_t syscall_count = 0;
 
 int udp_socket_initialise(struct sockaddr_in **addr, int port) {
     int sock_fd = -1;
@@ -30,10 +59,240 @@ int udp_socket_bind(int sock_fd, struct sockaddr_in *addr) {
 }
 
 int udp_socket_send(int sock_fd, struct sockaddr_in *addr, uint8_t *buffer, size_t buf_len) {
+    syscall_count++;
     return sendto(sock_fd, (const void *)buffer, buf_len, 0, (const struct sockaddr *)addr, sizeof(struct sockaddr_in));
 }
 
 int udp_socket_receive_from(int sock_fd, struct sockaddr_in **addr, uint8_t *buffer, size_t buf_len, bool blocking) {
     socklen_t len = sizeof(struct sockaddr_in);
+    syscall_count++;
     return recvfrom(sock_fd, (void *)buffer, buf_len, blocking ? MSG_WAITALL : MSG_DONTWAIT, (struct sockaddr *)(*addr), &len);
 }
+
+// Point iov at the buffers of a datagram. Returns the number of iovecs used.
+static size_t udp_datagram_iov(udp_datagram_t *dgram, struct iovec *iov) {
+    iov[0].iov_base = dgram->buf;
+    iov[0].iov_len = dgram->data_len;
+    if (dgram->payload && dgram->payload_len > 0) {
+        iov[1].iov_base = (void *)dgram->payload;
+        iov[1].iov_len = dgram->payload_len;
+        return 2;
+    }
+    return 1;
+}
+
+static size_t udp_datagram_len(udp_datagram_t *dgram) {
+    return dgram->data_len + (dgram->payload ? dgram->payload_len : 0);
+}
+
+// Attach the GSO segment size (when non-zero) and the departure time (when non-zero) to a message
+static void udp_msg_control(struct msghdr *hdr, uint8_t *ctrl, uint16_t segment_size, uint64_t tx_time) {
+    if (segment_size == 0 && tx_time == 0) {
+        return;
+    }
+    memset(ctrl, 0, UDP_SEND_CTRL_SIZE);
+    hdr->msg_control = ctrl;
+    hdr->msg_controllen = UDP_SEND_CTRL_SIZE;
+
+    size_t len = 0;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+    if (segment_size) {
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(uint16_t));
+        len += CMSG_SPACE(sizeof(uint16_t));
+        cmsg = CMSG_NXTHDR(hdr, cmsg);
+    }
+    if (tx_time) {
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        memcpy(CMSG_DATA(cmsg), &tx_time, sizeof(uint64_t));
+        len += CMSG_SPACE(sizeof(uint64_t));
+    }
+    hdr->msg_controllen = len;
+}
+
+int udp_socket_send_batch(int sock_fd, struct sockaddr_in *addr, udp_datagram_t *dgrams, size_t count) {
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iovs[UDP_BATCH_SIZE][2];
+    uint8_t ctrl[UDP_BATCH_SIZE][UDP_SEND_CTRL_SIZE];
+    size_t sent = 0;
+
+    while (sent < count) {
+        size_t chunk = count - sent > UDP_BATCH_SIZE ? UDP_BATCH_SIZE : count - sent;
+
+        memset(msgs, 0, chunk * sizeof(struct mmsghdr));
+        for (size_t i = 0; i < chunk; i++) {
+            msgs[i].msg_hdr.msg_name = addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = udp_datagram_iov(&dgrams[sent + i], iovs[i]);
+            udp_msg_control(&msgs[i].msg_hdr, ctrl[i], 0, dgrams[sent + i].tx_time);
+        }
+
+        syscall_count++;
+        int ret = sendmmsg(sock_fd, msgs, chunk, 0);
+        if (ret <= 0) {
+            break;
+        }
+        sent += ret;
+    }
+
+    return sent > 0 ? (int)sent : -1;
+}
+
+int udp_socket_receive_batch(int sock_fd, udp_datagram_t *dgrams, size_t count, bool blocking) {
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iovs[UDP_BATCH_SIZE];
+    uint8_t ctrl[UDP_BATCH_SIZE][CMSG_SPACE(sizeof(int))];
+
+    if (count > UDP_BATCH_SIZE) {
+        count = UDP_BATCH_SIZE;
+    }
+
+    memset(msgs, 0, count * sizeof(struct mmsghdr));
+    for (size_t i = 0; i < count; i++) {
+        iovs[i].iov_base = dgrams[i].buf;
+        iovs[i].iov_len = dgrams[i].buf_len;
+        msgs[i].msg_hdr.msg_name = &dgrams[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = ctrl[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+    }
+
+    syscall_count++;
+    int ret = recvmmsg(sock_fd, msgs, count, blocking ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+    for (int i = 0; i < ret; i++) {
+        dgrams[i].data_len = msgs[i].msg_len;
+        dgrams[i].segment_size = 0;
+        // With GRO enabled, the kernel reports the size of the coalesced segments
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int gso_size = 0;
+                memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                dgrams[i].segment_size = (uint16_t)gso_size;
+            }
+        }
+    }
+    return ret;
+}
+
+bool udp_socket_enable_reuseport(int sock_fd) {
+    int value = 1;
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) < 0) {
+        fprintf(stderr, "SO_REUSEPORT not supported: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool udp_socket_attach_reuseport_filter(int sock_fd, struct sock_filter* code, unsigned short len) {
+    struct sock_fprog prog = { .len = len, .filter = code };
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        fprintf(stderr, "SO_ATTACH_REUSEPORT_CBPF not supported: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool udp_socket_enable_gso(int sock_fd, uint16_t segment_size) {
+    // Probe for support only. The segment size is attached per super-buffer in
+    // udp_socket_send_gso so that lone datagrams are never split.
+    int value = segment_size;
+    if (setsockopt(sock_fd, SOL_UDP, UDP_SEGMENT, &value, sizeof(value)) < 0) {
+        fprintf(stderr, "UDP GSO not supported: %s\n", strerror(errno));
+        return false;
+    }
+    value = 0;
+    setsockopt(sock_fd, SOL_UDP, UDP_SEGMENT, &value, sizeof(value));
+    return true;
+}
+
+bool udp_socket_enable_gro(int sock_fd) {
+    int value = 1;
+    if (setsockopt(sock_fd, SOL_UDP, UDP_GRO, &value, sizeof(value)) < 0) {
+        fprintf(stderr, "UDP GRO not supported: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool udp_socket_enable_txtime(int sock_fd) {
+    struct sock_txtime config = { .clockid = CLOCK_MONOTONIC, .flags = 0 };
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) < 0) {
+        fprintf(stderr, "SO_TXTIME not supported: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+int udp_socket_send_gso(int sock_fd, struct sockaddr_in *addr, udp_datagram_t *dgrams, size_t count, uint16_t segment_size) {
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    size_t msg_dgrams[UDP_BATCH_SIZE];
+    struct iovec iovs[2 * UDP_BATCH_SIZE];
+    uint8_t ctrl[UDP_BATCH_SIZE][UDP_SEND_CTRL_SIZE];
+    size_t sent = 0;
+
+    while (sent < count) {
+        // Group consecutive datagrams into super-buffers. Every segment but the last in a
+        // super-buffer must be exactly segment_size bytes, so a shorter datagram closes it.
+        size_t num_msgs = 0;
+        size_t num_iovs = 0;
+        size_t num_dgrams = 0;
+        size_t idx = sent;
+        while (idx < count && idx - sent < UDP_BATCH_SIZE && num_msgs < UDP_BATCH_SIZE) {
+            struct msghdr* hdr = &msgs[num_msgs].msg_hdr;
+            memset(&msgs[num_msgs], 0, sizeof(struct mmsghdr));
+            hdr->msg_name = addr;
+            hdr->msg_namelen = sizeof(struct sockaddr_in);
+            hdr->msg_iov = &iovs[num_iovs];
+            hdr->msg_iovlen = 0;
+            msg_dgrams[num_msgs] = 0;
+            uint64_t tx_time = dgrams[idx].tx_time;
+
+            size_t total = 0;
+            while (idx < count && idx - sent < UDP_BATCH_SIZE && msg_dgrams[num_msgs] < UDP_GSO_MAX_SEGMENTS) {
+                size_t len = udp_datagram_len(&dgrams[idx]);
+                if (msg_dgrams[num_msgs] > 0 && (len > segment_size || total + len > UDP_GSO_MAX_PAYLOAD)) {
+                    break;
+                }
+                hdr->msg_iovlen += udp_datagram_iov(&dgrams[idx], &iovs[num_iovs + hdr->msg_iovlen]);
+                msg_dgrams[num_msgs]++;
+                total += len;
+                idx++;
+                if (len != segment_size) {
+                    break;
+                }
+            }
+
+            udp_msg_control(hdr, ctrl[num_msgs], msg_dgrams[num_msgs] > 1 ? segment_size : 0, tx_time);
+            num_iovs += hdr->msg_iovlen;
+            num_dgrams += msg_dgrams[num_msgs];
+            num_msgs++;
+        }
+
+        syscall_count++;
+        int ret = sendmmsg(sock_fd, msgs, num_msgs, 0);
+        if (ret <= 0) {
+            return sent > 0 ? (int)sent : -1;
+        }
+        if ((size_t)ret < num_msgs) {
+            // Only count the datagrams in the super-buffers that went out
+            for (int i = 0; i < ret; i++) {
+                sent += msg_dgrams[i];
+            }
+            continue;
+        }
+        sent += num_dgrams;
+    }
+
+    return (int)sent;
+}
+
+uint64_t udp_socket_syscall_count(void) {
+    return syscall_count;
+}
@@ -4,11 +4,35 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <linux/filter.h>
 
 #define MAXLINE 1024
 
+// Largest UDP payload the kernel will segment (GSO) or hand back coalesced (GRO) in one buffer
+#define UDP_GSO_MAX_PAYLOAD     65507
+#define UDP_GSO_MAX_SEGMENTS    64
+#define UDP_GRO_BUFFER_SIZE     65535
+
+// A single datagram in a batch. For sends, data_len bytes of buf are transmitted, followed
+// by payload_len bytes of payload when set (gathered by the kernel, not copied). For
+// receives, buf_len is the capacity of buf and data_len/addr are filled in. When GRO
+// coalesced several datagrams into buf, segment_size is the size of each one (the last
+// may be shorter), otherwise it is 0. On a socket with SO_TXTIME enabled, a non-zero tx_time
+// (CLOCK_MONOTONIC nanoseconds) holds the datagram back in the qdisc until that time.
+typedef struct __udp_datagram_t {
+    uint8_t* buf;
+    size_t buf_len;
+    size_t data_len;
+    const uint8_t* payload;
+    size_t payload_len;
+    uint16_t segment_size;
+    uint64_t tx_time;
+    struct sockaddr_in addr;
+} udp_datagram_t;
+
 int udp_socket_initialise(struct sockaddr_in **addr, int port);
 
 int udp_socket_bind(int sock_fd, struct sockaddr_in *addr);
@@ -17,4 +41,43 @@ int udp_socket_send(int sock_fd, struct sockaddr_in *addr, uint8_t *buffer, size
 
 int udp_socket_receive_from(int sock_fd, struct sockaddr_in **addr, uint8_t *buffer, size_t buf_len, bool blocking);
 
+// Send up to count datagrams to addr with as few syscalls as possible (sendmmsg).
+// Returns the number of datagrams sent, or -1 if none could be sent.
+int udp_socket_send_batch(int sock_fd, struct sockaddr_in *addr, udp_datagram_t *dgrams, size_t count);
+
+// Receive up to count datagrams in a single syscall (recvmmsg). When blocking, waits for at least one.
+// Returns the number of datagrams received, or -1 on error.
+int udp_socket_receive_batch(int sock_fd, udp_datagram_t *dgrams, size_t count, bool blocking);
+
+// Turn on UDP segmentation offload (UDP_SEGMENT) for segment_size byte datagrams.
+// Returns false if the kernel does not support it.
+bool udp_socket_enable_gso(int sock_fd, uint16_t segment_size);
+
+// Turn on UDP receive offload (UDP_GRO). Receive buffers must then be UDP_GRO_BUFFER_SIZE bytes.
+// Returns false if the kernel does not support it.
+bool udp_socket_enable_gro(int sock_fd);
+
+// Turn on SO_TXTIME so that datagrams leave at their tx_time. This only takes effect when the
+// egress device uses the fq qdisc (or etf); other qdiscs send immediately.
+// Returns false if the kernel does not support it.
+bool udp_socket_enable_txtime(int sock_fd);
+
+// Let several sockets bind the same port (SO_REUSEPORT). Call before udp_socket_bind.
+bool udp_socket_enable_reuseport(int sock_fd);
+
+// Attach a classic BPF program to the SO_REUSEPORT group sock_fd is bound in. The program sees
+// each datagram from the start of its UDP payload and returns the index, in bind order, of the
+// socket that should receive it. Returns false if the kernel does not support steering.
+bool udp_socket_attach_reuseport_filter(int sock_fd, struct sock_filter* code, unsigned short len);
+
+// Send count datagrams, packing runs of segment_size byte datagrams into GSO super-buffers.
+// The socket must have GSO enabled. A super-buffer departs at the tx_time of its first
+// datagram. Returns the number of datagrams sent, or -1 on failure
+// (e.g. EIO when the egress device cannot offload), in which case the caller should fall back
+// to udp_socket_send_batch.
+int udp_socket_send_gso(int sock_fd, struct sockaddr_in *addr, udp_datagram_t *dgrams, size_t count, uint16_t segment_size);
+
+// Number of send/receive syscalls the calling thread has issued through this module
+uint64_t udp_socket_syscall_count(void);
+
 #endif // UDP_SOCKET_H_